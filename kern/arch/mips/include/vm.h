@@ -113,16 +113,23 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown is a batch of pages in one address space. We'll take up
+ * to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+
+#define TS_MAXPAGES	16
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	uint32_t ts_asid;		/* address space (as_id) */
+	unsigned ts_npages;		/* > TS_MAXPAGES: flush everything */
+	vaddr_t ts_vaddrs[TS_MAXPAGES];	/* pages to invalidate */
+	struct semaphore *ts_done;	/* V'd by the target when done */
 };
 
+#define TS_ALL	((vaddr_t)-1)	/* every page of the address space */
+
 #define TLBSHOOTDOWN_MAX 16
 
 
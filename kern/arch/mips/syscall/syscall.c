@@ -37,9 +37,11 @@
 #include <syscall.h>
 #include <file_syscalls.h>
 #include <proc_syscalls.h>
+#include <vm_syscalls.h>
 #include <copyinout.h>
 #include <kern/wait.h>
 #include "opt-fork.h"
+#include "opt-dumbvm.h"
 
 /*
  * System call dispatcher.
@@ -113,7 +115,50 @@ void syscall(struct trapframe *tf)
 						 (userptr_t)tf->tf_a1);
 		break;
 
+	case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
 		/* Add stuff here */
+#if !OPT_DUMBVM
+	case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0,
+			       &retval);
+		if (err)
+			retval = -1;
+		break;
+
+	case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0,
+				 (size_t)tf->tf_a1);
+		if (err)
+			retval = -1;
+		break;
+
+#if OPT_SHELL
+	case SYS_mmap:;
+		int mmap_fd;
+		off_t mmap_offset;
+		err = copyin((userptr_t)tf->tf_sp + 16, &mmap_fd, sizeof(mmap_fd)); // get fd from stack
+		if (!err) {
+			err = copyin((userptr_t)tf->tf_sp + 24, &mmap_offset, sizeof(mmap_offset)); // 64 bit offset is 8-aligned
+		}
+		if (!err) {
+			err = sys_mmap((userptr_t)tf->tf_a0,
+				       (size_t)tf->tf_a1,
+				       (int)tf->tf_a2,
+				       (int)tf->tf_a3,
+				       mmap_fd,
+				       mmap_offset,
+				       &retval);
+		}
+		if (err)
+			retval = -1;
+		break;
+#endif
+#endif
+
 #if OPT_SHELL
 	case SYS_execv:
 		err = sys_execv((userptr_t)tf->tf_a0,
@@ -161,6 +206,49 @@ void syscall(struct trapframe *tf)
 			retval = -1;
 		break;
 
+	case SYS_pread:
+	case SYS_pwrite:;
+		off_t pos;
+		err = copyin((userptr_t)tf->tf_sp + 16, &pos, sizeof(pos)); // 64 bit offset is on the stack
+		if (err)
+		{
+			retval = -1;
+			break;
+		}
+		if (callno == SYS_pread)
+			err = sys_pread((int)tf->tf_a0,
+					(userptr_t)tf->tf_a1,
+					(size_t)tf->tf_a2,
+					pos,
+					&retval);
+		else
+			err = sys_pwrite((int)tf->tf_a0,
+					 (userptr_t)tf->tf_a1,
+					 (size_t)tf->tf_a2,
+					 pos,
+					 &retval);
+		if (err)
+			retval = -1;
+		break;
+
+	case SYS_readv:
+		err = sys_readv((int)tf->tf_a0,
+				(const_userptr_t)tf->tf_a1,
+				(int)tf->tf_a2,
+				&retval);
+		if (err)
+			retval = -1;
+		break;
+
+	case SYS_writev:
+		err = sys_writev((int)tf->tf_a0,
+				 (const_userptr_t)tf->tf_a1,
+				 (int)tf->tf_a2,
+				 &retval);
+		if (err)
+			retval = -1;
+		break;
+
 	case SYS_lseek:;
 		off_t offset = (((off_t)tf->tf_a2) << 32) | tf->tf_a3; // get 64 bit offset from a2:a3
 		int whence;
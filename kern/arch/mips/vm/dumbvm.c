@@ -38,6 +38,7 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -67,7 +68,8 @@ static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	/* Hand physical memory over to the coremap. */
+	coremap_bootstrap();
 }
 
 /*
@@ -90,12 +92,21 @@ dumbvm_can_sleep(void)
 	}
 }
 
+/*
+ * Get physical pages. Before vm_bootstrap these come from ram_stealmem
+ * and are never returned; afterwards they come from the coremap and
+ * can be freed with freeppages.
+ */
 static
 paddr_t
-getppages(unsigned long npages)
+getppages(unsigned long npages, int owner)
 {
 	paddr_t addr;
 
+	if (coremap_isready()) {
+		return coremap_alloc(npages, owner);
+	}
+
 	spinlock_acquire(&stealmem_lock);
 
 	addr = ram_stealmem(npages);
@@ -104,6 +115,15 @@ getppages(unsigned long npages)
 	return addr;
 }
 
+static
+void
+freeppages(paddr_t paddr)
+{
+	if (paddr != 0 && coremap_isready()) {
+		coremap_free(paddr);
+	}
+}
+
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t
 alloc_kpages(unsigned npages)
@@ -111,7 +131,7 @@ alloc_kpages(unsigned npages)
 	paddr_t pa;
 
 	dumbvm_can_sleep();
-	pa = getppages(npages);
+	pa = getppages(npages, CM_KERNEL);
 	if (pa==0) {
 		return 0;
 	}
@@ -121,9 +141,8 @@ alloc_kpages(unsigned npages)
 void
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
-
-	(void)addr;
+	KASSERT(addr >= MIPS_KSEG0);
+	freeppages(addr - MIPS_KSEG0);
 }
 
 void
@@ -138,7 +157,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
-	int i;
 	uint32_t ehi, elo;
 	struct addrspace *as;
 	int spl;
@@ -216,22 +234,16 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
-		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
-	}
-
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
+	/*
+	 * This is a TLB miss, so there is no entry for FAULTADDRESS
+	 * already; let the processor pick a slot to replace.
+	 */
+	ehi = faultaddress;
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	tlb_random(ehi, elo);
 	splx(spl);
-	return EFAULT;
+	return 0;
 }
 
 struct addrspace *
@@ -257,6 +269,9 @@ void
 as_destroy(struct addrspace *as)
 {
 	dumbvm_can_sleep();
+	freeppages(as->as_pbase1);
+	freeppages(as->as_pbase2);
+	freeppages(as->as_stackpbase);
 	kfree(as);
 }
 
@@ -344,17 +359,17 @@ as_prepare_load(struct addrspace *as)
 
 	dumbvm_can_sleep();
 
-	as->as_pbase1 = getppages(as->as_npages1);
+	as->as_pbase1 = getppages(as->as_npages1, CM_USER);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_pbase2 = getppages(as->as_npages2);
+	as->as_pbase2 = getppages(as->as_npages2, CM_USER);
 	if (as->as_pbase2 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
+	as->as_stackpbase = getppages(DUMBVM_STACKPAGES, CM_USER);
 	if (as->as_stackpbase == 0) {
 		return ENOMEM;
 	}
@@ -75,6 +75,54 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/* Cycles per hardclock */
+#define TIMER_PERIOD (CPU_FREQUENCY / HZ)
+
+/*
+ * Read and set the cycle counter ($9 == c0_count). System/161 resets
+ * it to 0 each time it reaches c0_compare, so it counts the cycles
+ * since the last timer interrupt.
+ */
+static
+uint32_t
+mips_timer_getcount(void)
+{
+	uint32_t count;
+
+	__asm volatile(
+		".set push;"
+		".set mips32;"
+		"mfc0 %0, $9;"
+		".set pop"
+		: "=r" (count));
+	return count;
+}
+
+static
+void
+mips_timer_setcount(uint32_t count)
+{
+	__asm volatile(
+		".set push;"
+		".set mips32;"
+		"mtc0 %0, $9;"
+		".set pop"
+		:: "r" (count));
+}
+
+/*
+ * Read the live cause register ($13 == c0_cause).
+ */
+static
+uint32_t
+mips_getcause(void)
+{
+	uint32_t cause;
+
+	__asm volatile("mfc0 %0, $13" : "=r" (cause));
+	return cause;
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -115,7 +163,7 @@ mainbus_bootstrap(void)
 	/*
 	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	mips_timer_set(TIMER_PERIOD);
 }
 
 /*
@@ -275,15 +323,46 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
-/*
- * Interrupt dispatcher.
- */
-
 /* Wiring of LAMEbus interrupts to bits in the cause register */
 #define LAMEBUS_IRQ_BIT  0x00000400	/* all system bus slots */
 #define LAMEBUS_IPI_BIT  0x00000800	/* inter-processor interrupt */
 #define MIPS_TIMER_BIT   0x00008000	/* on-chip timer */
 
+/*
+ * Tickless idle support. Interrupts are off throughout.
+ *
+ * Since the cycle counter restarts at every timer interrupt, pushing
+ * c0_compare out to TICKS periods makes the next interrupt come on
+ * the tick boundary it would have anyway.
+ */
+void
+mainbus_timer_oneshot(unsigned ticks)
+{
+	KASSERT(ticks > 0 && ticks < 0xffffffff / TIMER_PERIOD);
+	mips_timer_set(ticks * TIMER_PERIOD);
+}
+
+bool
+mainbus_timer_periodic(unsigned *ticks)
+{
+	uint32_t count;
+
+	if (mips_getcause() & MIPS_TIMER_BIT) {
+		/* mainbus_interrupt will take it from here. */
+		return false;
+	}
+	count = mips_timer_getcount();
+	*ticks = count / TIMER_PERIOD;
+	/* Keep the part of the current tick that has gone by. */
+	mips_timer_setcount(count % TIMER_PERIOD);
+	mips_timer_set(TIMER_PERIOD);
+	return true;
+}
+
+/*
+ * Interrupt dispatcher.
+ */
+
 void
 mainbus_interrupt(struct trapframe *tf)
 {
@@ -304,8 +383,11 @@ mainbus_interrupt(struct trapframe *tf)
 		seen = true;
 	}
 	if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
+		/*
+		 * Reset the timer (this clears the interrupt, and
+		 * puts it back to periodic after a one-shot)
+		 */
+		mips_timer_set(TIMER_PERIOD);
 		/* and call hardclock */
 		hardclock();
 		seen = true;
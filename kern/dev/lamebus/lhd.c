@@ -36,7 +36,8 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -60,6 +61,12 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Longest run of merged requests, in sectors */
+#define LHD_MAXRUN      128
+
+/* Bounce buffer size for lhd_io on user or scattered buffers, in sectors */
+#define LHD_BOUNCE      8
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,15 +103,192 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * The request queue.
+ *
+ * The card transfers one sector at a time through its buffer, but
+ * the whole of a request is carried through from the interrupt
+ * handler, which copies each sector and starts the next one straight
+ * away, so the caller only hears about it once at the end.
+ *
+ * Pending requests are kept in lh_queue sorted by sector and served
+ * C-SCAN style: the next one is the first at or after the sector the
+ * head is on, and once there are none past it, the lowest. A request
+ * that carries on where a queued one (or the one in progress) leaves
+ * off, in the same direction, is chained behind it instead and done
+ * in the same sweep without going back to the queue, up to
+ * LHD_MAXRUN sectors in a run.
+ *
+ * Everything is protected by lh_lock, which is taken in the interrupt
+ * handler. Completion callbacks are called with it released.
+ */
+
+/*
+ * Find the last request in the run starting with REQ, and the run's
+ * length in sectors.
+ */
+static
+struct devreq *
+lhd_runtail(struct devreq *req, uint32_t *len)
+{
+	*len = req->dr_nblocks;
+	while (req->dr_chain != NULL) {
+		req = req->dr_chain;
+		*len += req->dr_nblocks;
+	}
+	return req;
+}
+
+/*
+ * Chain REQ behind the run starting with RUN if it carries straight
+ * on from it. Returns true if so.
+ */
+static
+bool
+lhd_merge(struct devreq *run, struct devreq *req)
+{
+	struct devreq *tail;
+	uint32_t len;
+
+	if (run->dr_write != req->dr_write) {
+		return false;
+	}
+	tail = lhd_runtail(run, &len);
+	if (tail->dr_block + tail->dr_nblocks != req->dr_block ||
+	    len + req->dr_nblocks > LHD_MAXRUN) {
+		return false;
+	}
+	tail->dr_chain = req;
+	return true;
+}
+
+/*
+ * Add REQ to the queue, merging it if possible.
  */
 static
 void
+lhd_enqueue(struct lhd_softc *lh, struct devreq *req)
+{
+	struct devreq **pp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_cur != NULL && lhd_merge(lh->lh_cur, req)) {
+		return;
+	}
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		if (lhd_merge(*pp, req)) {
+			return;
+		}
+		if ((*pp)->dr_block > req->dr_block) {
+			break;
+		}
+	}
+	req->dr_next = *pp;
+	*pp = req;
+}
+
+/*
+ * Take the next request off the queue in C-SCAN order.
+ */
+static
+struct devreq *
+lhd_dequeue(struct lhd_softc *lh)
+{
+	struct devreq **pp;
+	struct devreq *req;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		if ((*pp)->dr_block >= lh->lh_headpos) {
+			break;
+		}
+	}
+	if (*pp == NULL) {
+		/* Nothing further along; go back to the start */
+		pp = &lh->lh_queue;
+		if (*pp == NULL) {
+			return NULL;
+		}
+	}
+	req = *pp;
+	*pp = req->dr_next;
+	req->dr_next = NULL;
+	return req;
+}
+
+/*
+ * Start the next sector of the request in progress.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct devreq *req = lh->lh_cur;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL && req->dr_pos < req->dr_nblocks);
+
+	/*
+	 * Are we writing? If so, transfer the data to the
+	 * on-card buffer.
+	 */
+	if (req->dr_write) {
+		memcpy(lh->lh_buf,
+		       (char *)req->dr_data + req->dr_pos * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->dr_block + req->dr_pos);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Record that a sector has completed: copy it out if reading, and
+ * either go on to the next sector or finish the request, starting
+ * the next one. Returns the request if it finished.
+ */
+static
+struct devreq *
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq *req = lh->lh_cur;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (req == NULL) {
+		/* Not ours */
+		return NULL;
+	}
+
+	if (err == 0 && !req->dr_write) {
+		membar_load_load();
+		memcpy((char *)req->dr_data + req->dr_pos * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+	lh->lh_headpos = req->dr_block + req->dr_pos + 1;
+	req->dr_pos++;
+
+	if (err == 0 && req->dr_pos < req->dr_nblocks) {
+		lhd_start(lh);
+		return NULL;
+	}
+
+	lh->lh_cur = req->dr_chain;
+	req->dr_chain = NULL;
+	if (lh->lh_cur == NULL) {
+		lh->lh_cur = lhd_dequeue(lh);
+	}
+	if (lh->lh_cur != NULL) {
+		lhd_start(lh);
+	}
+	return req;
 }
 
 /*
@@ -116,7 +300,11 @@ void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct devreq *done = NULL;
 	uint32_t val;
+	int err = 0;
+
+	spinlock_acquire(&lh->lh_lock);
 
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
@@ -128,9 +316,16 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		err = lhd_code_to_errno(lh, val);
+		done = lhd_iodone(lh, err);
 		break;
 	}
+
+	spinlock_release(&lh->lh_lock);
+
+	if (done != NULL) {
+		done->dr_done(done, err);
+	}
 }
 
 /*
@@ -179,8 +374,126 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Queue an asynchronous request.
+ */
+static
+int
+lhd_submit(struct device *d, struct devreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	/* Don't allow I/O past the end of the disk. */
+	if (req->dr_nblocks > lh->lh_dev.d_blocks ||
+	    req->dr_block > lh->lh_dev.d_blocks - req->dr_nblocks) {
+		return EINVAL;
+	}
+
+	req->dr_pos = 0;
+	req->dr_next = NULL;
+	req->dr_chain = NULL;
+
+	if (req->dr_nblocks == 0) {
+		req->dr_done(req, 0);
+		return 0;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	if (lh->lh_cur == NULL) {
+		KASSERT(lh->lh_queue == NULL);
+		lh->lh_cur = req;
+		lhd_start(lh);
+	}
+	else {
+		lhd_enqueue(lh, req);
+	}
+	spinlock_release(&lh->lh_lock);
+	return 0;
+}
+
+/*
+ * Waiting for a request from lhd_io. Each waiter borrows one of the
+ * lh_waitwc channels for the duration, so a completion wakes only the
+ * thread it's for; if all are lent out, it waits on lh_slotwc for
+ * one to come back.
+ */
+struct lhd_wait {
+	struct lhd_softc *lw_lh;
+	struct wchan *lw_wchan;
+	bool lw_done;
+	int lw_result;
+};
+
+static
+void
+lhd_waitdone(struct devreq *req, int result)
+{
+	struct lhd_wait *lw = req->dr_arg;
+	struct lhd_softc *lh = lw->lw_lh;
+
+	spinlock_acquire(&lh->lh_lock);
+	lw->lw_done = true;
+	lw->lw_result = result;
+	wchan_wakeone(lw->lw_wchan, &lh->lh_lock);
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Do one request and wait for it.
+ */
+static
+int
+lhd_rw(struct lhd_softc *lh, uint32_t sector, uint32_t len, void *data,
+       bool write)
+{
+	struct devreq req;
+	struct lhd_wait lw;
+	unsigned slot;
+	int result;
+
+	spinlock_acquire(&lh->lh_lock);
+	while (lh->lh_waitfree == 0) {
+		wchan_sleep(lh->lh_slotwc, &lh->lh_lock);
+	}
+	for (slot = 0; (lh->lh_waitfree & (1U << slot)) == 0; slot++) {
+		/* find the first free one */
+	}
+	lh->lh_waitfree &= ~(1U << slot);
+	spinlock_release(&lh->lh_lock);
+
+	lw.lw_lh = lh;
+	lw.lw_wchan = lh->lh_waitwc[slot];
+	lw.lw_done = false;
+	lw.lw_result = 0;
+
+	req.dr_block = sector;
+	req.dr_nblocks = len;
+	req.dr_write = write;
+	req.dr_data = data;
+	req.dr_done = lhd_waitdone;
+	req.dr_arg = &lw;
+
+	result = lhd_submit(&lh->lh_dev, &req);
+
+	spinlock_acquire(&lh->lh_lock);
+	if (result == 0) {
+		while (!lw.lw_done) {
+			wchan_sleep(lw.lw_wchan, &lh->lh_lock);
+		}
+		result = lw.lw_result;
+	}
+	lh->lh_waitfree |= 1U << slot;
+	wchan_wakeone(lh->lh_slotwc, &lh->lh_lock);
+	spinlock_release(&lh->lh_lock);
+
+	return result;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * A single kernel buffer is handed to the queue as is; anything else
+ * goes through a bounce buffer, LHD_BOUNCE sectors at a time.
  */
 static
 int
@@ -192,8 +505,9 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool write = uio->uio_rw == UIO_WRITE;
+	uint32_t n;
+	char *buf;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -202,72 +516,62 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (len > lh->lh_dev.d_blocks || sector > lh->lh_dev.d_blocks - len) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1 &&
+	    uio->uio_iov->iov_len == uio->uio_resid) {
+		result = lhd_rw(lh, sector, len, uio->uio_iov->iov_kbase,
+				write);
+		if (result) {
+			return result;
+		}
+		uio->uio_iov->iov_kbase =
+			(char *)uio->uio_iov->iov_kbase + uio->uio_resid;
+		uio->uio_iov->iov_len = 0;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	buf = kmalloc(LHD_BOUNCE * LHD_SECTSIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+	result = 0;
+	while (len > 0) {
+		n = len < LHD_BOUNCE ? len : LHD_BOUNCE;
+		if (write) {
+			result = uiomove(buf, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		result = lhd_rw(lh, sector, n, buf, write);
 		if (result) {
-			return result;
+			break;
+		}
+		if (!write) {
+			result = uiomove(buf, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
+		sector += n;
+		len -= n;
 	}
 
-	return 0;
+	kfree(buf);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_submit = lhd_submit,
 };
 
 /*
@@ -277,6 +581,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	unsigned i;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -284,17 +589,28 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. (wchans keep the name pointer.) */
+	COMPILE_ASSERT(LHD_NWAIT <= 32);
+	lh->lh_slotwc = wchan_create("lhd slot");
+	if (lh->lh_slotwc == NULL) {
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	for (i = 0; i < LHD_NWAIT; i++) {
+		lh->lh_waitwc[i] = wchan_create("lhd wait");
+		if (lh->lh_waitwc[i] == NULL) {
+			while (i-- > 0) {
+				wchan_destroy(lh->lh_waitwc[i]);
+			}
+			wchan_destroy(lh->lh_slotwc);
+			return ENOMEM;
+		}
 	}
+	lh->lh_waitfree = (LHD_NWAIT == 32) ? 0xffffffff :
+		(1U << LHD_NWAIT) - 1;
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_headpos = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -37,6 +38,12 @@
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Synchronous requests that can wait at once, each on its own wait
+ * channel (at most 32)
+ */
+#define LHD_NWAIT     16
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +58,13 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the request queue */
+	struct wchan *lh_waitwc[LHD_NWAIT]; /* One per lhd_io waiter */
+	uint32_t lh_waitfree;		/* Bit set for each free lh_waitwc */
+	struct wchan *lh_slotwc;	/* For waiting for a free lh_waitwc */
+	struct devreq *lh_queue;	/* Pending requests, by sector */
+	struct devreq *lh_cur;		/* Request in progress, or NULL */
+	uint32_t lh_headpos;		/* Sector after the last one done */
 
 	struct device lh_dev;		/* VFS device structure */
 };
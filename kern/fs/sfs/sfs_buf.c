@@ -0,0 +1,650 @@
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ *
+ * Blocks are cached by (device, block) in SFS_BUF_MAX buffers shared
+ * by all mounted SFS volumes. Every buffer is on one hash chain and on
+ * one LRU list, most recently used at the head. Writes only go to the
+ * buffer and mark it dirty; dirty buffers reach the disk when they are
+ * evicted, when the volume is synced, or from the flusher thread,
+ * which starts writing back everything dirty every SFS_BUF_FLUSHSECS
+ * seconds without waiting for it. Syncing also starts all its writes
+ * before waiting for any, so the disk can order them.
+ *
+ * Callers get a reference to a buffer and must release it. Buffers
+ * with references are never evicted, so a caller can keep one across
+ * a uiomove that faults and recurses into the filesystem.
+ *
+ * Read-ahead: sfs_buf_prefetch hands a block straight to the device
+ * with DEVOP_SUBMIT and returns, so the reader goes on with the
+ * biglock free while the disk works. The buffer is marked busy until
+ * sfs_buf_iodone, called when the transfer finishes, clears it;
+ * while it's busy the buffer belongs to the I/O, so nothing else
+ * evicts it or touches its contents, and sfs_buf_lookup waits for it
+ * instead of reading the block a second time. Background writes work
+ * the same way. Devices without devop_submit get no read-ahead, and
+ * their writes are done synchronously.
+ *
+ * Like the rest of SFS this relies on the vfs biglock, which is held
+ * across synchronous disk I/O as well; the flusher takes it too.
+ * b_busy is the exception: it's cleared from the completion, which
+ * may run in an interrupt handler, so it is protected by
+ * sfs_buf_iolock.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <objcache.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Buffers to keep; more are only made if all of these are in use */
+#define SFS_BUF_MAX		128
+
+/* Hash chains */
+#define SFS_BUF_HASHSIZE	64
+
+/* How often the flusher writes back dirty buffers */
+#define SFS_BUF_FLUSHSECS	5
+
+struct sfs_buf {
+	struct sfs_fs *b_sfs;		/* volume, for doing the I/O */
+	struct device *b_dev;		/* with b_block, the key */
+	daddr_t b_block;
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data is newer than the disk */
+	bool b_prefetched;		/* read ahead, not used yet */
+	bool b_busy;			/* async I/O in flight */
+	unsigned b_refcount;		/* callers holding the buffer */
+	struct devreq b_req;		/* for the async I/O */
+	struct sfs_buf *b_hashnext;
+	struct sfs_buf *b_lrunext;	/* towards less recently used */
+	struct sfs_buf *b_lruprev;
+	char b_data[SFS_BLOCKSIZE];
+};
+
+static struct objcache sfs_buf_cache =
+	OBJCACHE_INITIALIZER("sfs_buf", sizeof(struct sfs_buf), NULL);
+
+static struct sfs_buf *sfs_buf_hash[SFS_BUF_HASHSIZE];
+static struct sfs_buf *sfs_buf_lruhead, *sfs_buf_lrutail;
+static unsigned sfs_buf_count;
+static bool sfs_buf_flusher_started;
+
+/* Waiting for async I/O to finish */
+static struct spinlock sfs_buf_iolock = SPINLOCK_INITIALIZER;
+static struct wchan *sfs_buf_iowchan;
+
+/* Statistics */
+static unsigned sfs_buf_nhits, sfs_buf_nmisses;
+static unsigned sfs_buf_nreads, sfs_buf_nwrites, sfs_buf_nevicted;
+static unsigned sfs_buf_nrahits, sfs_buf_nradropped;
+static unsigned sfs_buf_nprefetched;	/* sfs_buf_iolock */
+static unsigned sfs_buf_nawrites;	/* sfs_buf_iolock */
+
+static
+unsigned
+sfs_buf_hashfunc(struct device *dev, daddr_t block)
+{
+	return (((uintptr_t)dev >> 4) ^ block) % SFS_BUF_HASHSIZE;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+void
+sfs_buf_lru_remove(struct sfs_buf *buf)
+{
+	if (buf->b_lruprev != NULL) {
+		buf->b_lruprev->b_lrunext = buf->b_lrunext;
+	}
+	else {
+		KASSERT(sfs_buf_lruhead == buf);
+		sfs_buf_lruhead = buf->b_lrunext;
+	}
+	if (buf->b_lrunext != NULL) {
+		buf->b_lrunext->b_lruprev = buf->b_lruprev;
+	}
+	else {
+		KASSERT(sfs_buf_lrutail == buf);
+		sfs_buf_lrutail = buf->b_lruprev;
+	}
+	buf->b_lrunext = buf->b_lruprev = NULL;
+}
+
+static
+void
+sfs_buf_lru_addhead(struct sfs_buf *buf)
+{
+	buf->b_lruprev = NULL;
+	buf->b_lrunext = sfs_buf_lruhead;
+	if (sfs_buf_lruhead != NULL) {
+		sfs_buf_lruhead->b_lruprev = buf;
+	}
+	else {
+		sfs_buf_lrutail = buf;
+	}
+	sfs_buf_lruhead = buf;
+}
+
+static
+void
+sfs_buf_hash_remove(struct sfs_buf *buf)
+{
+	struct sfs_buf **pp;
+
+	pp = &sfs_buf_hash[sfs_buf_hashfunc(buf->b_dev, buf->b_block)];
+	while (*pp != buf) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = buf->b_hashnext;
+	buf->b_hashnext = NULL;
+}
+
+static
+struct sfs_buf *
+sfs_buf_find(struct device *dev, daddr_t block)
+{
+	struct sfs_buf *buf;
+
+	for (buf = sfs_buf_hash[sfs_buf_hashfunc(dev, block)]; buf != NULL;
+	     buf = buf->b_hashnext) {
+		if (buf->b_dev == dev && buf->b_block == block) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O
+
+/*
+ * Completion for async I/O. May be called from an interrupt handler.
+ * A failed write leaves the buffer dirty, to be tried again.
+ */
+static
+void
+sfs_buf_iodone(struct devreq *req, int result)
+{
+	struct sfs_buf *buf = req->dr_arg;
+
+	spinlock_acquire(&sfs_buf_iolock);
+	KASSERT(buf->b_busy);
+	if (req->dr_write) {
+		if (result) {
+			buf->b_dirty = true;
+		}
+		else {
+			sfs_buf_nawrites++;
+		}
+	}
+	else if (result == 0) {
+		buf->b_valid = true;
+		buf->b_prefetched = true;
+		sfs_buf_nprefetched++;
+	}
+	buf->b_busy = false;
+	wchan_wakeall(sfs_buf_iowchan, &sfs_buf_iolock);
+	spinlock_release(&sfs_buf_iolock);
+}
+
+/*
+ * Start reading or writing BUF in the background. A write takes the
+ * dirty mark off when it starts, so changes made after it finishes
+ * are written again.
+ */
+static
+int
+sfs_buf_startio(struct sfs_buf *buf, bool write)
+{
+	struct devreq *req = &buf->b_req;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(!buf->b_busy);
+	KASSERT(write ? buf->b_dirty : !buf->b_valid);
+
+	req->dr_block = buf->b_block;
+	req->dr_nblocks = 1;
+	req->dr_write = write;
+	req->dr_data = buf->b_data;
+	req->dr_done = sfs_buf_iodone;
+	req->dr_arg = buf;
+
+	spinlock_acquire(&sfs_buf_iolock);
+	buf->b_busy = true;
+	if (write) {
+		buf->b_dirty = false;
+	}
+	spinlock_release(&sfs_buf_iolock);
+
+	result = DEVOP_SUBMIT(buf->b_dev, req);
+	if (result) {
+		spinlock_acquire(&sfs_buf_iolock);
+		buf->b_busy = false;
+		if (write) {
+			buf->b_dirty = true;
+		}
+		spinlock_release(&sfs_buf_iolock);
+	}
+	return result;
+}
+
+/*
+ * Wait for async I/O on BUF, if any, to finish.
+ */
+static
+void
+sfs_buf_wait(struct sfs_buf *buf)
+{
+	spinlock_acquire(&sfs_buf_iolock);
+	while (buf->b_busy) {
+		wchan_sleep(sfs_buf_iowchan, &sfs_buf_iolock);
+	}
+	spinlock_release(&sfs_buf_iolock);
+}
+
+static
+int
+sfs_buf_writeout(struct sfs_buf *buf)
+{
+	int result;
+
+	KASSERT(buf->b_valid && buf->b_dirty);
+	KASSERT(!buf->b_busy);
+
+	result = sfs_rawio(buf->b_sfs, buf->b_block, buf->b_data, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	buf->b_dirty = false;
+	sfs_buf_nwrites++;
+	return 0;
+}
+
+/*
+ * Start writing back BUF without waiting, or write it now if the
+ * device can't do that.
+ */
+static
+int
+sfs_buf_startwrite(struct sfs_buf *buf)
+{
+	if (buf->b_dev->d_ops->devop_submit == NULL) {
+		return sfs_buf_writeout(buf);
+	}
+	return sfs_buf_startio(buf, true);
+}
+
+/*
+ * Take the least recently used buffer nobody is holding out of the
+ * cache, writing it back first if it's dirty. Returns NULL if there
+ * isn't one, or if every candidate failed to write back.
+ *
+ * b_busy is only ever set with the biglock held, so if we see it
+ * clear it stays clear.
+ */
+static
+struct sfs_buf *
+sfs_buf_evict(void)
+{
+	struct sfs_buf *buf;
+
+	for (buf = sfs_buf_lrutail; buf != NULL; buf = buf->b_lruprev) {
+		if (buf->b_refcount > 0 || buf->b_busy) {
+			continue;
+		}
+		if (buf->b_dirty && sfs_buf_writeout(buf)) {
+			/* Keep it; maybe the next try will work */
+			continue;
+		}
+		sfs_buf_lru_remove(buf);
+		sfs_buf_hash_remove(buf);
+		sfs_buf_nevicted++;
+		return buf;
+	}
+	return NULL;
+}
+
+/*
+ * Find or make the buffer for BLOCK of SFS and take a reference to
+ * it. Its contents are not read in, but if a read-ahead of it is in
+ * flight we wait for that.
+ */
+static
+int
+sfs_buf_lookup(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	unsigned h;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(sfs->sfs_device != NULL);
+
+	buf = sfs_buf_find(sfs->sfs_device, block);
+	if (buf != NULL) {
+		KASSERT(buf->b_sfs == sfs);
+		sfs_buf_lru_remove(buf);
+		sfs_buf_lru_addhead(buf);
+		buf->b_refcount++;
+		sfs_buf_wait(buf);
+		*ret = buf;
+		return 0;
+	}
+
+	buf = NULL;
+	if (sfs_buf_count >= SFS_BUF_MAX) {
+		buf = sfs_buf_evict();
+	}
+	if (buf == NULL) {
+		buf = objcache_alloc(&sfs_buf_cache);
+		if (buf == NULL) {
+			buf = sfs_buf_evict();
+			if (buf == NULL) {
+				return ENOMEM;
+			}
+		}
+		else {
+			sfs_buf_count++;
+		}
+	}
+
+	buf->b_sfs = sfs;
+	buf->b_dev = sfs->sfs_device;
+	buf->b_block = block;
+	buf->b_valid = false;
+	buf->b_dirty = false;
+	buf->b_prefetched = false;
+	buf->b_busy = false;
+	buf->b_refcount = 1;
+
+	h = sfs_buf_hashfunc(buf->b_dev, block);
+	buf->b_hashnext = sfs_buf_hash[h];
+	sfs_buf_hash[h] = buf;
+	sfs_buf_lru_addhead(buf);
+
+	*ret = buf;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Get BLOCK of SFS, reading it in if it isn't cached.
+ */
+int
+sfs_buf_read(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	result = sfs_buf_lookup(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+
+	if (buf->b_valid) {
+		sfs_buf_nhits++;
+		if (buf->b_prefetched) {
+			sfs_buf_nrahits++;
+			buf->b_prefetched = false;
+		}
+	}
+	else {
+		sfs_buf_nmisses++;
+		result = sfs_rawio(sfs, block, buf->b_data, UIO_READ);
+		if (result) {
+			sfs_buf_release(buf);
+			return result;
+		}
+		buf->b_valid = true;
+		sfs_buf_nreads++;
+	}
+
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Get BLOCK of SFS without reading it, for a caller that is going to
+ * overwrite all of it. If it wasn't cached the contents are garbage
+ * (sfs_buf_valid says which), and become the block when the caller
+ * marks the buffer dirty.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	return sfs_buf_lookup(sfs, block, ret);
+}
+
+bool
+sfs_buf_valid(struct sfs_buf *buf)
+{
+	return buf->b_valid;
+}
+
+void *
+sfs_buf_data(struct sfs_buf *buf)
+{
+	return buf->b_data;
+}
+
+/*
+ * The caller has changed the buffer; it needs writing back.
+ */
+void
+sfs_buf_markdirty(struct sfs_buf *buf)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(buf->b_refcount > 0);
+
+	buf->b_valid = true;
+	buf->b_dirty = true;
+}
+
+void
+sfs_buf_release(struct sfs_buf *buf)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(buf->b_refcount > 0);
+
+	buf->b_refcount--;
+}
+
+/*
+ * Write back every dirty buffer of SFS: start them all, wait for
+ * them all, then write whatever is still dirty (writes that failed,
+ * or that the flusher had in flight and failed) synchronously to
+ * get an error. Keeps going past errors and returns the first one.
+ */
+int
+sfs_buf_sync(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf;
+	int result, err = 0;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (buf = sfs_buf_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_sfs == sfs && buf->b_dirty && !buf->b_busy) {
+			/* If it fails we'll find it still dirty below */
+			(void)sfs_buf_startwrite(buf);
+		}
+	}
+
+	for (buf = sfs_buf_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_sfs != sfs) {
+			continue;
+		}
+		sfs_buf_wait(buf);
+		if (!buf->b_dirty) {
+			continue;
+		}
+		result = sfs_buf_writeout(buf);
+		if (result && err == 0) {
+			err = result;
+		}
+	}
+	return err;
+}
+
+/*
+ * Throw away every buffer of SFS, which is going away. It must have
+ * been synced already, and nothing may be holding its buffers, but
+ * read-ahead may still be in flight.
+ */
+void
+sfs_buf_drop(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf, *next;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (buf = sfs_buf_lruhead; buf != NULL; buf = next) {
+		next = buf->b_lrunext;
+		if (buf->b_sfs != sfs) {
+			continue;
+		}
+		KASSERT(buf->b_refcount == 0);
+		sfs_buf_wait(buf);
+		KASSERT(!buf->b_dirty);
+		sfs_buf_lru_remove(buf);
+		sfs_buf_hash_remove(buf);
+		objcache_free(&sfs_buf_cache, buf);
+		sfs_buf_count--;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+
+/*
+ * Start reading BLOCK of SFS into the cache in the background.
+ * Nothing happens if it's already cached or the device can't do
+ * async I/O; it's dropped if there's no buffer for it.
+ */
+void
+sfs_buf_prefetch(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *buf;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs->sfs_device->d_ops->devop_submit == NULL ||
+	    sfs_buf_find(sfs->sfs_device, block) != NULL) {
+		return;
+	}
+
+	if (sfs_buf_lookup(sfs, block, &buf)) {
+		sfs_buf_nradropped++;
+		return;
+	}
+	if (sfs_buf_startio(buf, false)) {
+		sfs_buf_nradropped++;
+	}
+	sfs_buf_release(buf);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Flusher
+
+static
+void
+sfs_buf_flusher(void *data1, unsigned long data2)
+{
+	struct sfs_buf *buf;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(SFS_BUF_FLUSHSECS);
+
+		vfs_biglock_acquire();
+		for (buf = sfs_buf_lruhead; buf != NULL;
+		     buf = buf->b_lrunext) {
+			if (buf->b_dirty && buf->b_refcount == 0 &&
+			    !buf->b_busy) {
+				/* Errors are retried next time round */
+				(void)sfs_buf_startwrite(buf);
+			}
+		}
+		vfs_biglock_release();
+	}
+}
+
+/*
+ * Start the flusher thread, the first time a volume is mounted.
+ */
+void
+sfs_buf_bootstrap(void)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_buf_flusher_started) {
+		return;
+	}
+
+	sfs_buf_iowchan = wchan_create("sfs_buf io");
+	if (sfs_buf_iowchan == NULL) {
+		panic("sfs: out of memory\n");
+	}
+
+	result = thread_fork("sfs flusher", NULL, sfs_buf_flusher, NULL, 0);
+	if (result) {
+		panic("sfs: thread_fork flusher: %s\n", strerror(result));
+	}
+	sfs_buf_flusher_started = true;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Statistics
+
+void
+sfs_buf_printstats(void)
+{
+	unsigned ndirty = 0, nheld = 0, nbusy = 0;
+	struct sfs_buf *buf;
+
+	vfs_biglock_acquire();
+	for (buf = sfs_buf_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_dirty) {
+			ndirty++;
+		}
+		if (buf->b_refcount > 0) {
+			nheld++;
+		}
+		if (buf->b_busy) {
+			nbusy++;
+		}
+	}
+	kprintf("SFS buffer cache: %u/%u buffers, %u dirty, %u held, "
+		"%u in flight\n", sfs_buf_count, SFS_BUF_MAX, ndirty, nheld,
+		nbusy);
+	kprintf("    %u hits, %u misses, %u reads, %u writes, %u evicted\n",
+		sfs_buf_nhits, sfs_buf_nmisses, sfs_buf_nreads,
+		sfs_buf_nwrites + sfs_buf_nawrites, sfs_buf_nevicted);
+	kprintf("    read-ahead: %u blocks, %u used, %u dropped\n",
+		sfs_buf_nprefetched, sfs_buf_nrahits, sfs_buf_nradropped);
+	vfs_biglock_release();
+}
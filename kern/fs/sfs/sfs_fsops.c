@@ -229,6 +229,13 @@ sfs_sync(struct fs *fs)
 		return result;
 	}
 
+	/* All of the above only got as far as the buffer cache. */
+	result = sfs_buf_sync(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	vfs_biglock_release();
 	return 0;
 }
@@ -262,6 +269,7 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
+	sfs_buf_drop(sfs);
 	vnodearray_destroy(sfs->sfs_vnodes);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
@@ -414,6 +422,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENOMEM;
 	}
 
+	/* Make sure someone writes back the buffer cache */
+	sfs_buf_bootstrap();
+
 	/* Set the device so we can use sfs_readblock() */
 	sfs->sfs_device = dev;
 
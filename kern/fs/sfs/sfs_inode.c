@@ -36,9 +36,13 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <objcache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* In-memory vnodes, for all SFS volumes */
+static struct objcache sfs_vnode_cache =
+	OBJCACHE_INITIALIZER("sfs_vnode", sizeof(struct sfs_vnode), NULL);
 
 /*
  * Write an on-disk inode structure back out to disk.
@@ -136,7 +140,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	objcache_free(&sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -184,7 +188,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = objcache_alloc(&sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -198,7 +202,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		objcache_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -235,18 +239,21 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		objcache_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_ranext = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
 
 	/* Add it to our table */
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
+		objcache_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
@@ -53,7 +54,9 @@
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Read or write a block, retrying I/O errors. Each retry waits one
+ * hardclock longer than the last, to give a flaky device a chance to
+ * recover instead of hammering it.
  */
 static
 int
@@ -85,10 +88,12 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 			kprintf("sfs: %s: block %llu I/O error, retrying\n",
 				sfs->sfs_sb.sb_volname,
 				uio->uio_offset / SFS_BLOCKSIZE);
+			clocksleep_ticks(tries);
 			goto retry;
 		}
 		else if (tries < 10) {
 			tries++;
+			clocksleep_ticks(tries);
 			goto retry;
 		}
 		else {
@@ -102,33 +107,59 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read or write a block straight to the disk. Only the buffer cache
+ * should use this.
  */
 int
-sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_rawio(struct sfs_fs *sfs, daddr_t block, void *data, enum uio_rw rw)
 {
 	struct iovec iov;
 	struct uio ku;
 
+	SFSUIO(&iov, &ku, data, block, rw);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Read a block, through the buffer cache.
+ */
+int
+sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_buf *buf;
+	int result;
+
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_read(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, sfs_buf_data(buf), len);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block. It goes into the buffer cache and reaches the disk
+ * later; see sfs_buf.c.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(sfs_buf_data(buf), data, len);
+	sfs_buf_markdirty(buf);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,16 +181,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,7 +192,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
+	/* The buffer cache needs the big lock */
 	KASSERT(vfs_biglock_do_i_hold());
 
 	/* Compute the block offset of this block in the file */
@@ -184,40 +207,32 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_buf_read(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * A write may have changed part of it even if uiomove failed,
+	 * so it's dirty either way.
 	 */
+	result = uiomove((char *)sfs_buf_data(buf) + skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		sfs_buf_markdirty(buf);
 	}
+	sfs_buf_release(buf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -228,14 +243,12 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	bool wasvalid;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -258,31 +271,99 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * Go through the buffer cache. A whole-block write doesn't need
+	 * the old contents, so don't read them in.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_buf_read(sfs, diskblock, &buf);
+	}
+	else {
+		result = sfs_buf_get(sfs, diskblock, &buf);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	wasvalid = sfs_buf_valid(buf);
+	result = uiomove(sfs_buf_data(buf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE && (result == 0 || wasvalid)) {
+		/*
+		 * If the copy failed partway, a buffer we didn't read
+		 * in is only partly the block: leave it invalid.
+		 */
+		sfs_buf_markdirty(buf);
+	}
+	sfs_buf_release(buf);
 
-	result = sfs_rwblock(sfs, uio);
+	return result;
+}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+/*
+ * Sequential read-ahead. A read is sequential if it starts in the
+ * block the last read of the file ended in, or the one after; then
+ * the window of blocks to read ahead of it starts at SFS_RA_MIN and
+ * doubles with each sequential read up to SFS_RA_MAX. Anything else
+ * turns read-ahead off until the file is read sequentially again.
+ *
+ * Blocks are only prefetched once (sv_raend); sfs_buf_prefetch
+ * starts reading them into the buffer cache without waiting.
+ */
+#define SFS_RA_MIN	4
+#define SFS_RA_MAX	32
 
-	return result;
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t pos, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t first, last, fileblock, endblock, eofblock;
+	daddr_t diskblock;
+
+	KASSERT(endpos > pos);
+
+	first = pos / SFS_BLOCKSIZE;
+	last = (endpos - 1) / SFS_BLOCKSIZE;
+
+	if (first == sv->sv_ranext || first + 1 == sv->sv_ranext) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RA_MIN;
+		}
+		else if (sv->sv_rawindow < SFS_RA_MAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+	}
+	sv->sv_ranext = last + 1;
+
+	if (sv->sv_rawindow == 0 || sv->sv_i.sfi_size == 0) {
+		return;
+	}
+
+	/* Don't go past the end of the file */
+	eofblock = (sv->sv_i.sfi_size - 1) / SFS_BLOCKSIZE;
+	endblock = last + sv->sv_rawindow;
+	if (endblock > eofblock) {
+		endblock = eofblock;
+	}
+
+	fileblock = last + 1;
+	if (fileblock < sv->sv_raend) {
+		fileblock = sv->sv_raend;
+	}
+	for (; fileblock <= endblock; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			sfs_buf_prefetch(sfs, diskblock);
+		}
+	}
+	if (endblock + 1 > sv->sv_raend) {
+		sv->sv_raend = endblock + 1;
+	}
 }
 
 /*
@@ -295,8 +376,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t origpos;
 
 	origresid = uio->uio_resid;
+	origpos = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -381,6 +464,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/* If reading and we did anything, queue up what comes next */
+	if (result == 0 && uio->uio_rw == UIO_READ &&
+	    uio->uio_offset > origpos) {
+		sfs_readahead(sv, origpos, uio->uio_offset);
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -407,6 +496,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	char *bufdata;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,16 +505,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
+	/* The buffer cache needs the big lock */
 	KASSERT(vfs_biglock_do_i_hold());
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
@@ -446,26 +528,23 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block from the buffer cache */
+	result = sfs_buf_read(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
+	bufdata = sfs_buf_data(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, bufdata + blockoffset, len);
+		sfs_buf_release(buf);
 	}
 	else {
-		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* Update the selected region; it gets written back later */
+		memcpy(bufdata + blockoffset, data, len);
+		sfs_buf_markdirty(buf);
+		sfs_buf_release(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
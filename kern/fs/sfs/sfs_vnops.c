@@ -226,20 +226,28 @@ sfs_fsync(struct vnode *v)
 
 	vfs_biglock_acquire();
 	result = sfs_sync_inode(sv);
+	if (result == 0) {
+		/*
+		 * The buffer cache doesn't know which blocks are this
+		 * file's, so write back the whole volume.
+		 */
+		result = sfs_buf_sync(sv->sv_absvn.vn_fs->fs_data);
+	}
 	vfs_biglock_release();
 
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Regular files can be mapped; the VM system does
+ * the rest through VOP_READ and VOP_WRITE.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
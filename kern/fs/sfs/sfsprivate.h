@@ -42,11 +42,26 @@ extern const struct vnode_ops sfs_dirops;
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
 
+/* Buffer cache entry (private to sfs_buf.c) */
+struct sfs_buf;
+
 /* Functions in sfs_balloc.c */
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
+/* Functions in sfs_buf.c */
+void sfs_buf_bootstrap(void);
+int sfs_buf_read(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+int sfs_buf_get(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+bool sfs_buf_valid(struct sfs_buf *buf);
+void *sfs_buf_data(struct sfs_buf *buf);
+void sfs_buf_markdirty(struct sfs_buf *buf);
+void sfs_buf_release(struct sfs_buf *buf);
+int sfs_buf_sync(struct sfs_fs *sfs);
+void sfs_buf_prefetch(struct sfs_fs *sfs, daddr_t block);
+void sfs_buf_drop(struct sfs_fs *sfs);
+
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
@@ -71,6 +86,7 @@ int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
+int sfs_rawio(struct sfs_fs *sfs, daddr_t block, void *data, enum uio_rw rw);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
@@ -39,6 +39,40 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct array;
+struct lock;
+struct pagetable;
+
+#if !OPT_DUMBVM
+/*
+ * A region of the address space (text, data, stack, ...).
+ *
+ * Pages in [vr_base, vr_base + vr_npages * PAGE_SIZE) are created on
+ * first touch. If vr_vnode is set, the bytes of the region between
+ * vr_filevaddr and vr_filevaddr + vr_filesize come from vr_vnode at
+ * vr_offset onwards; everything else reads as zeros.
+ *
+ * Regions made by mmap have vr_mmap set. For MAP_PRIVATE they work
+ * like any other file-backed region. For MAP_SHARED, vr_filesize is 0
+ * and every page instead comes from the page cache: the page at VADDR
+ * is the one at vr_offset + (VADDR - vr_filevaddr) in the file.
+ */
+struct vm_region {
+        vaddr_t vr_base;                /* page-aligned start */
+        size_t vr_npages;               /* length in pages */
+        int vr_perms;                   /* VR_READ | VR_WRITE | VR_EXEC */
+        struct vnode *vr_vnode;         /* file backing, or NULL */
+        off_t vr_offset;                /* file offset of vr_filevaddr */
+        vaddr_t vr_filevaddr;           /* where the file data starts */
+        size_t vr_filesize;             /* bytes of file data */
+        int vr_mmap;                    /* MAP_SHARED, MAP_PRIVATE, or 0 */
+};
+
+/* Region permissions */
+#define VR_READ         0x1
+#define VR_WRITE        0x2
+#define VR_EXEC         0x4
+#endif
 
 
 /*
@@ -58,7 +92,13 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+        uint32_t as_id;                 /* unique, never reused; never 0 */
+        vaddr_t as_heapstart;           /* page-aligned base of the heap */
+        vaddr_t as_heapend;             /* current break */
+        vaddr_t as_mmapbase;            /* lowest mmap region so far */
+        struct array *as_regions;       /* struct vm_region * */
+        struct pagetable *as_pt;        /* virtual page -> frame */
+        struct lock *as_lock;           /* protects regions and as_pt */
 #endif
 };
 
@@ -99,6 +139,33 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_backing - arrange for part of a region to be read from
+ *                a file when its pages are first touched, instead of
+ *                being copied in at load time. Takes a reference to
+ *                the vnode. (Not available with dumbvm.)
+ *
+ *    as_fault  - resolve a fault at VADDR: find the region, make sure
+ *                the page is resident, and load it into the TLB.
+ *                Called by vm_fault. (Not available with dumbvm.)
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes and hand
+ *                back the old end. Pages are created on first touch;
+ *                shrinking frees them. (Not available with dumbvm.)
+ *
+ *    as_pageout - evict the page at VADDR, whose frame is PADDR, to
+ *                swap (or just drop it if it is read-only). Called by
+ *                the pageout daemon; fails without doing anything if
+ *                the page has changed hands since the daemon picked
+ *                it. (Not available with dumbvm.)
+ *
+ *    as_mmap   - map LEN bytes of V starting at OFFSET, below the stack
+ *                and any earlier mappings, and hand back the address.
+ *                Takes a reference to the vnode. (Not available with
+ *                dumbvm.)
+ *
+ *    as_munmap - remove the pages in [ADDR, ADDR+LEN) from the mapping
+ *                containing them. (Not available with dumbvm.)
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -117,6 +184,21 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if !OPT_DUMBVM
+int               as_define_backing(struct addrspace *as, vaddr_t vaddr,
+                                    size_t filesize, struct vnode *v,
+                                    off_t offset);
+int               as_fault(struct addrspace *as, int faulttype,
+                           vaddr_t vaddr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_pageout(struct addrspace *as, vaddr_t vaddr,
+                             paddr_t paddr);
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          off_t offset, size_t len, int perms, int flags,
+                          vaddr_t *addr);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+#endif
 
 
 /*
@@ -48,6 +48,15 @@
 void hardclock_bootstrap(void);
 void hardclock(void);
 
+/*
+ * Tickless idle. An idle cpu calls clock_idle, with interrupts off,
+ * right before waiting for an interrupt, and clock_unidle when it
+ * wakes up. In between, the periodic hardclock is stopped until this
+ * cpu's next timer is due.
+ */
+void clock_idle(void);
+void clock_unidle(void);
+
 /*
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -73,11 +82,45 @@ void timespec_sub(const struct timespec *t1,
 		  const struct timespec *t2,
 		  struct timespec *ret);
 
+/*
+ * One-shot timers.
+ *
+ * timer_start arranges for the timer's function to be called with
+ * its data once, after TICKS hardclocks, on the current cpu. It is
+ * called from hardclock, with interrupts off, so it must not sleep.
+ * The timer must not already be running. timer_stop cancels it and
+ * returns the number of ticks that were left, or 0 if it was too late
+ * (the function has been or is being called). Starting and stopping
+ * take constant time.
+ *
+ * Each cpu keeps its timers on a timer wheel made by timerwheel_create
+ * when the cpu is created.
+ */
+struct timerwheel;
+
+struct timer {
+	void (*tm_func)(void *);
+	void *tm_data;
+
+	/* Private to clock.c */
+	struct timerwheel *tm_wheel;	/* wheel it is on, or NULL */
+	unsigned tm_expires;		/* tick it is due */
+	struct timer *tm_next;
+	struct timer **tm_prevp;
+};
+
+struct timerwheel *timerwheel_create(void);
+void timer_init(struct timer *tm, void (*func)(void *), void *data);
+void timer_start(struct timer *tm, unsigned ticks);
+unsigned timer_stop(struct timer *tm);
+
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * clocksleep_ticks() does the same for a number of hardclock ticks.
  */
 void clocksleep(int seconds);
+void clocksleep_ticks(unsigned ticks);
 
 
 #endif /* _CLOCK_H_ */
@@ -0,0 +1,81 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page allocator.
+ *
+ * The coremap keeps one entry for every physical frame of RAM. Frames
+ * that are not in use sit on a doubly-linked free list threaded
+ * through the coremap itself, so single-page allocations and frees
+ * are O(1). Multi-page allocations (kernel stacks, large kmalloc
+ * blocks) need physically contiguous frames and are satisfied by a
+ * first-fit scan; the length of each allocation is recorded in its
+ * first frame so it can be freed from the address alone.
+ *
+ * Each allocation starts with one reference. User frames can pick up
+ * more with coremap_share when fork shares them copy-on-write; they
+ * are only returned to the free list when the last reference is
+ * dropped.
+ *
+ * When free memory runs low the pageout daemon evicts user pages,
+ * picking victims with a second-chance clock. A user frame can only
+ * be evicted once it has exactly one reference and coremap_touch has
+ * recorded which address space and virtual page it belongs to. User
+ * allocations leave a small reserve for the kernel; a fault that
+ * can't get a frame waits for the daemon in coremap_wait.
+ *
+ * Functions:
+ *     coremap_bootstrap  - take over physical memory from ram.c. Until
+ *                          this is called, pages come from ram_stealmem
+ *                          and can never be freed.
+ *     coremap_isready    - true once coremap_bootstrap has run.
+ *     coremap_alloc      - allocate NPAGES contiguous frames. Returns 0
+ *                          if no suitable run of free frames exists.
+ *     coremap_free       - drop a reference to an allocation made by
+ *                          coremap_alloc, freeing it when none remain.
+ *                          Frames stolen before bootstrap are ignored.
+ *     coremap_share      - add a reference to a single user frame, for
+ *                          copy-on-write sharing between address spaces.
+ *     coremap_refcount   - return the number of references to a frame.
+ *     coremap_touch      - note that AS has just used the user frame at
+ *                          VADDR: sets the frame's referenced bit, and
+ *                          makes AS the owner if it is the only user.
+ *     coremap_owns       - true if the frame is evictable and owned by
+ *                          AS at VADDR.
+ *     coremap_disown     - forget the owner of a user frame, so the
+ *                          daemon won't pick it; it gets one again on
+ *                          the next coremap_touch.
+ *     coremap_pageout_wait - wait for the daemon to finish with AS.
+ *                          Called by as_destroy once AS's frames are
+ *                          freed, which also clears their owner.
+ *     coremap_wait       - wait for the daemon to free enough memory for
+ *                          a user allocation. Returns ENOMEM if it can't.
+ *     coremap_pageout_start - start the pageout daemon. (Not available
+ *                          with dumbvm.)
+ *     coremap_printstats - print frame usage counters.
+ */
+
+#include <vm.h>
+
+struct addrspace;
+
+/* Who a frame is allocated to (argument to coremap_alloc) */
+#define CM_KERNEL	0	/* kernel heap, stacks, etc. */
+#define CM_USER		1	/* user-level memory */
+
+void    coremap_bootstrap(void);
+bool    coremap_isready(void);
+paddr_t coremap_alloc(unsigned npages, int owner);
+void    coremap_free(paddr_t paddr);
+void    coremap_share(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+void    coremap_touch(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+bool    coremap_owns(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void    coremap_disown(paddr_t paddr);
+void    coremap_pageout_wait(struct addrspace *as);
+int     coremap_wait(void);
+void    coremap_pageout_start(void);
+void    coremap_printstats(void);
+
+
+#endif /* _COREMAP_H_ */
@@ -35,6 +35,28 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct timerwheel;	/* from <clock.h> */
+
+/*
+ * VM event counts. Each cpu counts its own with interrupts off, so no
+ * lock is needed; vm_printstats adds them up with cpu_sumvmstats.
+ */
+struct cpu_vmstats {
+	unsigned vs_nfaults;
+	unsigned vs_ntlbrefills;	/* translations loaded */
+	unsigned vs_ntlbflushes;	/* address space switches */
+	unsigned vs_ntlbkept;		/* switches that kept the TLB */
+	unsigned vs_nshootdowns;
+	unsigned vs_nshootdownipis;	/* CPUs interrupted for them */
+	unsigned vs_nshootdownflushes;	/* batches that became flushes */
+};
+
+
+/*
+ * Number of scheduling priorities. Priority 0 is the highest; see
+ * schedule() in thread.c.
+ */
+#define SCHED_NPRIO 4
 
 /*
  * Per-cpu structure
@@ -60,14 +82,27 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	struct timerwheel *c_timerwheel; /* Timers due on this cpu */
+	bool c_tickless;		/* Periodic tick off while idle */
+	unsigned c_idleticks;		/* Ticks until the one-shot fires */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_nmigrated;		/* Threads pulled from other cpus */
+	unsigned c_nstealfails;		/* Attempts that found none to take */
+	struct cpu_vmstats c_vmstats;	/* VM counters, interrupts off */
+
+	/*
+	 * Written only by this cpu (with interrupts off); read by
+	 * other cpus to decide whom to send TLB shootdowns to.
+	 */
+	uint32_t c_tlb_asid;		/* Address space the TLB belongs to */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NPRIO]; /* Run queues, by priority */
+	unsigned c_nrunnable;		/* Threads on all of c_runqueue[] */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -150,6 +185,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_asid sends it to every CPU except the current one
+ * whose TLB holds translations for address space ASID (c_tlb_asid),
+ * and returns how many CPUs that was.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -164,6 +202,11 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_asid(uint32_t asid,
+			       const struct tlbshootdown *mapping);
+
+/* Add up every cpu's c_vmstats into SUM. */
+void cpu_sumvmstats(struct cpu_vmstats *sum);
 
 void interprocessor_interrupt(void);
 
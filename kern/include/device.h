@@ -36,6 +36,7 @@
 
 
 struct uio;  /* in <uio.h> */
+struct devreq;
 
 /*
  * Filesystem-namespace-accessible device.
@@ -56,11 +57,40 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_submit - start an asynchronous block transfer (see below);
+ *                     NULL for devices that can't
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_submit)(struct device *, struct devreq *);
+};
+
+/*
+ * Asynchronous block I/O request.
+ *
+ * The caller fills in the first six fields: DR_NBLOCKS blocks starting
+ * at DR_BLOCK are transferred to or from the kernel buffer DR_DATA.
+ * devop_submit returns an error only if the request can't be queued
+ * at all; otherwise DR_DONE is called with the request and the result
+ * once the transfer is over. DR_DONE may be called from an interrupt
+ * handler, so it must not sleep, but it may submit more requests.
+ *
+ * The request belongs to the driver from submission until DR_DONE is
+ * called, and the remaining fields are the driver's.
+ */
+struct devreq {
+	daddr_t dr_block;		/* first block */
+	uint32_t dr_nblocks;		/* length in blocks */
+	bool dr_write;			/* direction */
+	void *dr_data;			/* kernel buffer */
+	void (*dr_done)(struct devreq *, int result);
+	void *dr_arg;			/* for dr_done */
+
+	uint32_t dr_pos;		/* blocks done so far */
+	struct devreq *dr_next;		/* driver's queue */
+	struct devreq *dr_chain;	/* next request merged with this one */
 };
 
 /*
@@ -69,6 +99,7 @@ struct device_ops {
 #define DEVOP_EACHOPEN(d, f)	((d)->d_ops->devop_eachopen(d, f))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_SUBMIT(d, r)	((d)->d_ops->devop_submit(d, r))
 
 
 /* Create vnode for a vfs-level device. */
@@ -0,0 +1,61 @@
+#ifndef _FDTABLE_H_
+#define _FDTABLE_H_
+
+/*
+ * Per-process file descriptor table.
+ *
+ * The table starts with FDTABLE_INITSIZE slots and doubles when it
+ * runs out, up to OPEN_MAX. A bitmap with a bit per slot finds the
+ * lowest free descriptor without walking the slots one by one.
+ *
+ * Every slot holds a reference to its file handle. Lookups take a
+ * further reference under the table's spinlock, which is held only
+ * long enough to read the slot, so read/write never hold a lock on
+ * the whole table while doing I/O, and a close or dup2 from another
+ * thread can't free the handle underneath them. Drop the reference
+ * with fhandle_decref when done.
+ *
+ * Functions:
+ *     fdtable_create  - make an empty table. Returns NULL if out of memory.
+ *     fdtable_copy    - give DST a reference to every open file in SRC,
+ *                       at the same descriptors (for fork).
+ *     fdtable_destroy - drop every slot's reference and free the table.
+ *     fdtable_add     - put a handle in the lowest free slot. Takes over
+ *                       the caller's reference. EMFILE if full.
+ *     fdtable_set     - put a handle at a given slot, returning what was
+ *                       there before (or NULL). Takes over the caller's
+ *                       reference and hands back the old slot's.
+ *     fdtable_get     - look up a descriptor and take a reference.
+ *     fdtable_remove  - empty a slot, handing its reference back.
+ *
+ * fdtable_get, fdtable_set and fdtable_remove return EBADF for a
+ * descriptor out of range; fdtable_get and fdtable_remove also for
+ * a free slot.
+ */
+
+#include <spinlock.h>
+
+struct fhandle;
+struct bitmap;
+
+/* Slots in a new table; a multiple of 32 so the bitmap grows by words. */
+#define FDTABLE_INITSIZE	32
+
+struct fdtable {
+	struct spinlock fdt_lock;	/* protects everything below */
+	struct fhandle **fdt_files;	/* indexed by fd, NULL if free */
+	struct bitmap *fdt_map;		/* bit set for each fd in use */
+	unsigned fdt_size;		/* slots in fdt_files and fdt_map */
+};
+
+struct fdtable *fdtable_create(void);
+int fdtable_copy(struct fdtable *src, struct fdtable *dst);
+void fdtable_destroy(struct fdtable *fdt);
+int fdtable_add(struct fdtable *fdt, struct fhandle *fh, int *fd);
+int fdtable_set(struct fdtable *fdt, int fd, struct fhandle *fh,
+		struct fhandle **oldfh);
+int fdtable_get(struct fdtable *fdt, int fd, struct fhandle **fh);
+int fdtable_remove(struct fdtable *fdt, int fd, struct fhandle **fh);
+
+
+#endif /* _FDTABLE_H_ */
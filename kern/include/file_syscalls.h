@@ -1,5 +1,6 @@
 #include <types.h> // types (userptr_t, size_t, ...)
 #include <synch.h> // synchronization (lock)
+#include <spinlock.h> // for the reference count (spinlock)
 
 #ifndef _FILE_SYSCALLS_H_
 #define _FILE_SYSCALLS_H_
@@ -7,14 +8,17 @@
 #include "opt-shell.h"
 #if OPT_SHELL
 
+struct fdtable;
+
 /* File handle struct */
 struct fhandle
 {
 	struct vnode *vn;
 	off_t offset;
 	int flags;
-	unsigned int ref_count;
-	struct lock *lock;
+	unsigned int ref_count; /* fd table slots and lookups using it */
+	struct spinlock ref_lock; /* protects ref_count */
+	struct lock *lock; /* protects offset */
 };
 
 /* file syscalls */
@@ -23,6 +27,10 @@ int sys_dup2(int oldfd, int newfd, int *retval);
 int sys_close(int fd);
 int sys_read(int fd, userptr_t buf, size_t size, ssize_t *retval);
 int sys_write(int fd, userptr_t buf, size_t size, ssize_t *retval);
+int sys_pread(int fd, userptr_t buf, size_t size, off_t pos, ssize_t *retval);
+int sys_pwrite(int fd, userptr_t buf, size_t size, off_t pos, ssize_t *retval);
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, ssize_t *retval);
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, ssize_t *retval);
 int sys_lseek(int fd, off_t pos, int whence, off_t *retval);
 int sys_chdir(userptr_t pathname, int32_t *retval);
 int sys___getcwd(userptr_t buf, size_t buflen, int *retval);
@@ -31,7 +39,9 @@ int sys___getcwd(userptr_t buf, size_t buflen, int *retval);
 int create_fhandle_struct(
 	char* path, int flags, int mode, off_t offset, struct fhandle* retval
 );
-int open_console(struct fhandle *fdtable[]);
+int open_console(struct fdtable *fdt);
+void fhandle_incref(struct fhandle *fh);
+void fhandle_decref(struct fhandle *fh);
 
 #endif
 
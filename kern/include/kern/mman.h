@@ -0,0 +1,22 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), shared between the kernel and <sys/mman.h>.
+ */
+
+/* Page protections (PROT_NONE or any combination of the rest) */
+#define PROT_NONE     0x0    /* No access */
+#define PROT_READ     0x1    /* Pages can be read */
+#define PROT_WRITE    0x2    /* Pages can be written */
+#define PROT_EXEC     0x4    /* Pages can be executed */
+
+/* Mapping types (exactly one) */
+#define MAP_SHARED    0x1    /* Writes go back to the file */
+#define MAP_PRIVATE   0x2    /* Writes are copy-on-write */
+
+/* Returned by mmap on error */
+#define MAP_FAILED    ((void *)-1)
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -129,7 +129,11 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_bootstrap sizes the heap's bookkeeping for the amount of RAM;
+ * it must be called right after ram_bootstrap.
  */
+void kheap_bootstrap(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
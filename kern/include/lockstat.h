@@ -0,0 +1,61 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock profiling (the "lockstat" kernel option).
+ *
+ * Sleep locks are grouped into classes by name: every lock called
+ * "vfs_biglock" counts toward the one class. For each class we count
+ * acquisitions and contended acquisitions, and add up the time spent
+ * waiting for the lock and holding it, in nanoseconds by gettime().
+ * Spinlocks have no names, so the interesting ones are registered
+ * with lockstat_addspinlock; for those the counters kept by the
+ * spinlock itself are reported.
+ *
+ * Timing is off until lockstat_start is called, from the menu (the
+ * clock isn't there early in boot); until then each lock operation
+ * only checks lockstat_enabled.
+ *
+ * Functions:
+ *     lockstat_getclass    - find or make the class for lock name NAME.
+ *     lockstat_now         - current time, for the lock code.
+ *     lockstat_acquired    - account a lock acquisition that started at
+ *                            START; returns the time it was acquired.
+ *     lockstat_released    - account a hold that began at ACQUIRED.
+ *     lockstat_addspinlock - include spinlock LK, labeled NAME, in the
+ *                            report. Compiles to nothing without the
+ *                            option.
+ *     lockstat_start/stop  - turn timing on or off.
+ *     lockstat_reset       - zero all the counters.
+ *     lockstat_print       - print the TOP classes with the most wait
+ *                            time, then the registered spinlocks.
+ */
+
+#include "opt-lockstat.h"
+
+struct spinlock;
+
+#if OPT_LOCKSTAT
+
+struct lockstat_class;
+
+extern volatile bool lockstat_enabled;
+
+struct lockstat_class *lockstat_getclass(const char *name);
+uint64_t lockstat_now(void);
+uint64_t lockstat_acquired(struct lockstat_class *lc, uint64_t start,
+			   bool contended);
+void lockstat_released(struct lockstat_class *lc, uint64_t acquired);
+void lockstat_addspinlock(const char *name, struct spinlock *lk);
+void lockstat_start(void);
+void lockstat_stop(void);
+void lockstat_reset(void);
+void lockstat_print(unsigned top);
+
+#else
+
+#define lockstat_addspinlock(name, lk) ((void)(name), (void)(lk))
+
+#endif /* OPT_LOCKSTAT */
+
+#endif /* _LOCKSTAT_H_ */
@@ -55,6 +55,17 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Control of the current cpu's periodic timer, for tickless idle.
+ * mainbus_timer_oneshot makes the next timer interrupt come TICKS
+ * periods after the last one instead of one; the interrupt puts it
+ * back to periodic. mainbus_timer_periodic puts it back early and
+ * sets *TICKS to the number of whole periods that went by, or returns
+ * false if the one-shot interrupt is already pending.
+ */
+void mainbus_timer_oneshot(unsigned ticks);
+bool mainbus_timer_periodic(unsigned *ticks);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
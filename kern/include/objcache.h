@@ -0,0 +1,63 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches (slab allocator) for fixed-size kernel structures.
+ *
+ * Each cache hands out objects of one size, carved out of whole-page
+ * slabs, so there is no rounding up to a kmalloc size class. An
+ * optional constructor is run on each object once, when its slab is
+ * made; objects must be freed back in their constructed state, so
+ * whatever the constructor set up is still there the next time the
+ * object is allocated. Constructors must not acquire anything that
+ * would need undoing: there is no destructor, and slabs are freed
+ * without one.
+ *
+ * Caches are declared statically with OBJCACHE_INITIALIZER and need
+ * no setup, so they can be used from the very start of boot. A cache
+ * shows up in objcache_printstats once it has made its first slab.
+ *
+ * Objects must be smaller than about a page.
+ *
+ * Functions:
+ *     objcache_alloc      - get an object. Returns NULL if out of memory.
+ *     objcache_free       - give an object back to the cache it came from.
+ *     objcache_printstats - print usage and fragmentation of every cache.
+ */
+
+#include <spinlock.h>
+
+struct oc_slab;		/* Private to objcache.c */
+
+struct objcache {
+	/* Set by OBJCACHE_INITIALIZER */
+	const char *oc_name;
+	size_t oc_size;			/* object size */
+	void (*oc_ctor)(void *obj);	/* constructor, or NULL */
+
+	/* Private to objcache.c */
+	struct spinlock oc_lock;	/* protects everything below */
+	size_t oc_stride;		/* bytes per object in a slab */
+	unsigned oc_perslab;		/* objects per slab */
+	struct oc_slab *oc_partial;	/* slabs with some objects free */
+	struct oc_slab *oc_full;	/* slabs with none free */
+	struct oc_slab *oc_empty;	/* one slab kept with all free */
+	unsigned oc_nslabs;
+	unsigned oc_ninuse;		/* objects allocated */
+	unsigned oc_nallocs;		/* counters */
+	unsigned oc_nfrees;
+	unsigned oc_ngrows;		/* slabs made */
+	bool oc_listed;			/* on the list for printstats */
+	struct objcache *oc_next;
+};
+
+#define OBJCACHE_INITIALIZER(name, size, ctor) \
+	{ .oc_name = (name), .oc_size = (size), .oc_ctor = (ctor), \
+	  .oc_lock = SPINLOCK_INITIALIZER }
+
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+void objcache_printstats(void);
+
+
+#endif /* _OBJCACHE_H_ */
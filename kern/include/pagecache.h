@@ -0,0 +1,44 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for shared file mappings.
+ *
+ * Every process that maps a file with MAP_SHARED maps the same frame
+ * for each page of the file, so they all see each other's writes.
+ * The cache keeps one reference to each frame it hands out, keyed on
+ * (vnode, offset), for as long as anyone has the file mapped shared;
+ * when the last such mapping goes away, dirty pages are written back
+ * to the file and the frames are dropped. Cached pages are not
+ * evictable while they are cached.
+ *
+ * Reads and writes through the file descriptor do not go through the
+ * cache, so they only see changes made through a mapping once it has
+ * been written back.
+ *
+ * Functions:
+ *     pagecache_bootstrap - set up. Called from vm_bootstrap.
+ *     pagecache_addmap    - note a new shared mapping of V.
+ *     pagecache_release   - a shared mapping of V is gone; the last one
+ *                           writes back and frees V's pages.
+ *     pagecache_get       - hand back the frame for the page of V at
+ *                           OFFSET (page-aligned), reading it in if
+ *                           needed. The caller gets its own reference
+ *                           to the frame, to be dropped with
+ *                           coremap_free. V must be mapped.
+ *     pagecache_markdirty - note that the page of V at OFFSET has been
+ *                           written and must be written back.
+ */
+
+#include <vm.h>
+
+struct vnode;
+
+void pagecache_bootstrap(void);
+int  pagecache_addmap(struct vnode *v);
+void pagecache_release(struct vnode *v);
+int  pagecache_get(struct vnode *v, off_t offset, paddr_t *paddr);
+void pagecache_markdirty(struct vnode *v, off_t offset);
+
+
+#endif /* _PAGECACHE_H_ */
@@ -0,0 +1,64 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table for user address spaces.
+ *
+ * The top level (directory) has one slot per 4M of user address
+ * space; each slot points to a second-level table of PTEs covering
+ * 1024 pages, or is NULL if nothing in that 4M has been touched yet.
+ * Second-level tables are exactly one page in size.
+ *
+ * A PTE holds the physical frame in its top 20 bits and flags in the
+ * low bits. A PTE of 0 means the page has never been touched (or was
+ * a clean page that got evicted); the fault handler materializes it
+ * on first access. A page that has been paged out has PTE_SWAPPED
+ * set and its swap slot in place of the frame.
+ *
+ * Functions:
+ *     pt_create  - allocate an empty page table. Returns NULL on error.
+ *     pt_destroy - free the page table itself. The caller must have
+ *                  already released whatever the PTEs refer to.
+ *     pt_lookup  - return a pointer to the PTE for VADDR. If CREATE is
+ *                  true, allocates the second-level table if needed
+ *                  (and returns NULL only if out of memory); otherwise
+ *                  returns NULL if there is no table for VADDR.
+ *     pt_foreach - call FUNC on every nonzero PTE in ascending address
+ *                  order. Stops and returns the first nonzero result.
+ */
+
+#include <vm.h>
+
+typedef uint32_t pte_t;
+
+/* PTE fields */
+#define PTE_FRAME	0xfffff000	/* physical frame */
+#define PTE_VALID	0x00000001	/* page is resident in PTE_FRAME */
+#define PTE_DIRTY	0x00000002	/* page may be written through the TLB */
+#define PTE_SWAPPED	0x00000004	/* page is in swap slot PTE_SLOT */
+
+/* Swap slot of a PTE_SWAPPED page, and the PTE for one */
+#define PTE_SLOT(pte)		((pte) >> PT_L2_SHIFT)
+#define PTE_MKSWAPPED(slot)	(((pte_t)(slot) << PT_L2_SHIFT) | PTE_SWAPPED)
+
+/* Address breakdown */
+#define PT_L1_SHIFT	22
+#define PT_L2_SHIFT	12
+#define PT_L2_ENTRIES	(PAGE_SIZE / sizeof(pte_t))
+#define PT_L1_ENTRIES	(USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L1_INDEX(va)	((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va)	(((va) >> PT_L2_SHIFT) & (PT_L2_ENTRIES - 1))
+
+struct pagetable {
+	pte_t *pt_dir[PT_L1_ENTRIES];
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int pt_foreach(struct pagetable *pt,
+	       int (*func)(vaddr_t vaddr, pte_t *pte, void *data),
+	       void *data);
+
+
+#endif /* _PAGETABLE_H_ */
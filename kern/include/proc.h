@@ -87,22 +87,25 @@ struct proc
 
 	/* add more material here as needed */
 #if OPT_SHELL
-	struct fhandle *p_fdtable[OPEN_MAX]; // file table
+	struct fdtable *p_fdtable; // file table
     	pid_t pid;
 	struct array *children;
 	struct lock *proc_lock;
+	struct cv *p_exitcv; /* Signalled when this process exits */
 #endif
 };
 
 #if OPT_SHELL
 struct pidhandle 
 {
-	struct lock *pid_lock;
+	struct rwlock *pid_rwlock; /* Protects the tables below */
+	struct lock *pid_lock; /* Goes with each proc's p_exitcv, for waiting on exits */
 	pid_t *pid_array[PID_MAX];
-	struct cv *pid_cv;  /* Condition variable usde int waitpid */
 	struct proc *pid_proc[MAX_RUNNING_PROCS +1 ]; /* Array of processes where pid is the index*/
 	int qty_available;
-	int next_pid;
+	int next_pid; /* Head of the free pid list, 0 if it is empty */
+	int last_pid; /* Tail of the free pid list, where freed pids go */
+	int pid_nextfree[MAX_RUNNING_PROCS +1]; /* Links of the free pid list, 0 ends it */
 	int pid_status[MAX_RUNNING_PROCS +1 ]; /* Array to maintain status of processes*/
 	int pid_exitcode[MAX_RUNNING_PROCS +1]; /* Array to keep the exit code status*/
 };
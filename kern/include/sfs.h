@@ -56,6 +56,9 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	uint32_t sv_ranext;             /* block a sequential read reads next */
+	uint32_t sv_raend;              /* first block not yet read ahead */
+	uint32_t sv_rawindow;           /* blocks to read ahead, 0 if none */
 };
 
 /*
@@ -76,5 +79,10 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Print buffer cache statistics (for the kernel menu)
+ */
+void sfs_buf_printstats(void);
+
 
 #endif /* _SFS_H_ */
@@ -50,19 +50,33 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * Spinlocks are ticket locks, so CPUs get the lock in the order they
+ * asked for it: each takes the next number from splk_next and waits
+ * for splk_serving to come up to it.
+ *
+ * The counters are updated by the holder, so they are protected by
+ * the lock itself: acquisitions, acquisitions that had to wait, and
+ * the total number of times waiters looked at the lock and found it
+ * still held.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
-	struct cpu *splk_holder;	    /* CPU holding this lock. */
+	volatile spinlock_data_t splk_next;    /* Next ticket to give out. */
+	volatile spinlock_data_t splk_serving; /* Ticket that may go in. */
+	struct cpu *splk_holder;	       /* CPU holding this lock. */
+	unsigned splk_nacquires;
+	unsigned splk_ncontended;
+	unsigned splk_nspins;
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, 0, 0, 0 }
 
 /*
  * Spinlock functions.
@@ -74,6 +88,8 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * printstats	Print the lock's counters on one line, labeled NAME.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -84,5 +100,7 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_printstats(const char *name, struct spinlock *lk);
+
 
 #endif /* _SPINLOCK_H_ */
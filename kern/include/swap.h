@@ -0,0 +1,49 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Swap is the raw disk SWAP_DEVICE, divided into page-sized slots.
+ * Free slots are tracked with a bitmap. Each slot in use also has a
+ * reference count, because fork shares swapped-out pages between
+ * parent and child the same way it shares resident ones; whoever
+ * faults a shared slot in gets a private copy and drops a reference.
+ *
+ * If there is no swap device the system runs without swap: dirty
+ * pages can't be evicted, only clean ones.
+ *
+ * Pageouts are asynchronous when the device has devop_submit: the
+ * write is started and swap takes over the frame, freeing it once the
+ * page is on disk. Until then (or for good, if the write fails) the
+ * slot's data lives in that frame, and swap_pagein copies it from
+ * there instead of reading the disk.
+ *
+ * Functions:
+ *     swap_bootstrap  - attach the swap device. Called from vm_bootstrap.
+ *     swap_alloc      - allocate a free slot. Returns ENOSPC if swap is
+ *                       full or missing.
+ *     swap_share      - add a reference to a slot.
+ *     swap_free       - drop a reference to a slot, freeing it at zero.
+ *     swap_pagein     - read SLOT into the frame PADDR.
+ *     swap_pageout    - write the frame PADDR to SLOT. On success the
+ *                       frame belongs to swap, which frees it when done;
+ *                       on error the caller still has it.
+ *     swap_printstats - print slot usage and paging counters.
+ */
+
+#include <vm.h>
+
+/* Disk to swap on (raw device; see vfs_swapon) */
+#define SWAP_DEVICE	"lhd0"
+
+void swap_bootstrap(void);
+int  swap_alloc(unsigned *slot);
+void swap_share(unsigned slot);
+void swap_free(unsigned slot);
+int  swap_pagein(paddr_t paddr, unsigned slot);
+int  swap_pageout(paddr_t paddr, unsigned slot);
+void swap_printstats(void);
+
+
+#endif /* _SWAP_H_ */
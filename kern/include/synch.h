@@ -35,6 +35,7 @@
  */
 
 #include <spinlock.h>
+#include <lockstat.h>
 #include "opt-synch.h"
 
 /*
@@ -59,8 +60,13 @@ void sem_destroy(struct semaphore *);
  *     P (proberen): decrement count. If the count is 0, block until
  *                   the count is 1 again before decrementing.
  *     V (verhogen): increment count.
+ *
+ * P_timed is P that gives up after TICKS hardclocks, returning
+ * ETIMEDOUT; with TICKS 0 it only takes the semaphore if it can do
+ * so without waiting. It returns 0 on success.
  */
 void P(struct semaphore *);
+int P_timed(struct semaphore *, unsigned ticks);
 void V(struct semaphore *);
 
 /*
@@ -82,6 +88,11 @@ struct lock
         struct spinlock lk_lock;
         volatile struct thread *lk_owner;
         volatile int lk_flag;
+        volatile unsigned lk_nwaiters;  /* threads asleep on lk_wchan */
+#if OPT_LOCKSTAT
+        struct lockstat_class *lk_stat; /* profiling class, by name */
+        uint64_t lk_stamp;              /* when acquired, if profiling */
+#endif
 #endif
 };
 
@@ -137,6 +148,10 @@ void cv_destroy(struct cv *);
  *                   waking up again, re-acquire the lock.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
+ *    cv_timedwait - Like cv_wait, but stop waiting after TICKS
+ *                   hardclocks. Returns ETIMEDOUT if it timed out and
+ *                   0 if it was woken; the lock is held again either
+ *                   way.
  *
  * For all three operations, the current thread must hold the lock passed
  * in. Note that under normal circumstances the same lock should be used
@@ -145,7 +160,57 @@ void cv_destroy(struct cv *);
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * Writers have preference: once a writer is waiting, new readers wait
+ * behind it, so a stream of readers can't starve writers out.
+ *
+ * rwlock_create_percpu makes a read-biased variant for data that is
+ * almost never written. Readers only touch a counter for their own
+ * cpu, so they don't contend with each other at all; in exchange a
+ * writer has to look at every cpu's counter.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock_cpu;
+
+struct rwlock
+{
+        char *rwlock_name;
+        struct spinlock rw_lock;
+        struct wchan *rw_rwchan;        /* readers wait here */
+        struct wchan *rw_wwchan;        /* writers wait here */
+        volatile unsigned rw_nreaders;  /* readers in */
+        volatile unsigned rw_nwriters;  /* writers waiting */
+        volatile struct thread *rw_writer;  /* writer in, if any */
+        struct rwlock_cpu *rw_percpu;   /* per-cpu reader counts, or NULL */
+};
+
+struct rwlock *rwlock_create(const char *name);
+struct rwlock *rwlock_create_percpu(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Give up a write hold. Only the thread
+ *                           holding the lock may do this.
+ *
+ * A thread holding the lock for reading must not try to get it
+ * again: if a writer has come along in between, that deadlocks.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+
 #endif /* _SYNCH_H_ */
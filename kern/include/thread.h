@@ -39,8 +39,10 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include <clock.h>
 
 struct cpu;
+struct wchan;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -84,6 +86,32 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduling fields. t_priority picks the run queue the thread
+	 * goes on (0 is highest); t_ticks counts the hardclocks it has
+	 * run for at that priority. The times are hardclock counts, used
+	 * for migration. Changed only by the thread itself,
+	 * by whoever wakes it, and by schedule() while it is on a run
+	 * queue, with that run queue locked.
+	 */
+	unsigned t_priority;
+	unsigned t_ticks;
+	unsigned t_lastran;		/* when it last ran, on t_cpu's clock */
+	unsigned t_lastmigrate;		/* when it last changed cpus */
+
+	/*
+	 * Timed sleep fields (see wchan_sleep_timed). While the thread
+	 * is in a timed sleep, t_sleepwc and t_sleeplk are the channel
+	 * and its lock; whoever takes it off the channel clears
+	 * t_sleepwc, holding t_sleeplk. t_timerbusy stays set until
+	 * t_timer can no longer touch the thread.
+	 */
+	struct timer t_timer;
+	struct wchan *t_sleepwc;
+	struct spinlock *t_sleeplk;
+	bool t_timedout;		/* the timer woke it up */
+	volatile bool t_timerbusy;
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -157,16 +185,28 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for one timer tick. Returns true if it
+ * should yield: it has used up its time slice, or a thread of higher
+ * priority is waiting. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Potentially pull ready threads over from busier CPUs. Called from
+ * the timer interrupt.
  */
 void thread_consider_migration(void);
 
+/*
+ * Print per-CPU thread migration counts.
+ */
+void thread_printstats(void);
+
 
 #endif /* _THREAD_H_ */
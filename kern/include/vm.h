@@ -58,5 +58,41 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * TLB manipulation (not provided by dumbvm).
+ *
+ * Each CPU remembers which address space (by as_id) its TLB holds
+ * translations for, so that switching away to a kernel thread and
+ * back, or rescheduling the same process, doesn't cost a flush.
+ *
+ *    vm_tlb_activate   - make this CPU's TLB belong to address space
+ *                        ASID, flushing it unless it already does.
+ *    vm_tlb_load       - install a translation for VADDR on this CPU.
+ *    vm_tlb_invalidate - drop this CPU's translation for VADDR, if any.
+ *    vm_tlb_flush      - drop all of this CPU's translations.
+ *    vm_tlb_shootdown  - drop the translation for VADDR in address
+ *                        space ASID (or all of them, if VADDR is
+ *                        TS_ALL) on every CPU, and wait until it's done.
+ *
+ * To drop many pages at once, batch them: vm_tlb_batch_init, then
+ * vm_tlb_batch_add for each page, then vm_tlb_batch_finish, which
+ * sends one IPI to each CPU holding the address space's translations
+ * and waits for all of them. A batch that outgrows TS_MAXPAGES turns
+ * into a flush of the whole address space. The caller must hold
+ * whatever lock keeps the pages from being faulted back in until
+ * the batch is finished.
+ */
+void vm_tlb_activate(uint32_t asid);
+void vm_tlb_load(vaddr_t vaddr, paddr_t paddr, bool writable);
+void vm_tlb_invalidate(vaddr_t vaddr);
+void vm_tlb_flush(void);
+void vm_tlb_shootdown(uint32_t asid, vaddr_t vaddr);
+void vm_tlb_batch_init(struct tlbshootdown *ts, uint32_t asid);
+void vm_tlb_batch_add(struct tlbshootdown *ts, vaddr_t vaddr);
+void vm_tlb_batch_finish(struct tlbshootdown *ts);
+
+/* Print fault, memory, and swap counters (not provided by dumbvm) */
+void vm_printstats(void);
+
 
 #endif /* _VM_H_ */
@@ -0,0 +1,19 @@
+#include <types.h> // types (userptr_t, intptr_t, ...)
+
+#ifndef _VM_SYSCALLS_H_
+#define _VM_SYSCALLS_H_
+
+#include "opt-dumbvm.h"
+#include "opt-shell.h"
+#if !OPT_DUMBVM
+
+/* memory syscalls */
+int sys_sbrk(intptr_t amount, int32_t *retval);
+#if OPT_SHELL
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int32_t *retval);
+#endif
+int sys_munmap(userptr_t addr, size_t len);
+
+#endif
+#endif
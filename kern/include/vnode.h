@@ -120,9 +120,11 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check whether this file can be mapped into
+ *                      memory. The mapping itself is done by the VM
+ *                      system, which pages through vop_read and
+ *                      vop_write; returns ENOSYS for objects (such as
+ *                      devices) that can't be mapped.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
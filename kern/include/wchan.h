@@ -66,6 +66,14 @@ bool wchan_isempty(struct wchan *wc, struct spinlock *lk);
  */
 void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Like wchan_sleep, but give up after *TICKS hardclocks if nobody
+ * wakes the thread first. Returns ETIMEDOUT if the time ran out and 0
+ * otherwise; either way *TICKS is set to the ticks that were left.
+ * If *TICKS is 0 it returns ETIMEDOUT without sleeping.
+ */
+int wchan_sleep_timed(struct wchan *wc, struct spinlock *lk, unsigned *ticks);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The associated spinlock should be locked.
@@ -40,9 +40,13 @@
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
+#include <coremap.h>
+#include <objcache.h>
+#include <lockstat.h>
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 #include <proc_syscalls.h>
 
 /*
@@ -371,6 +375,87 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	objcache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_threadstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for lock profiling: with no argument, print the 10 lock
+ * classes with the most wait time, or as many as asked for.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+#if OPT_LOCKSTAT
+	if (nargs == 1) {
+		lockstat_print(10);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		lockstat_start();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		lockstat_stop();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		lockstat_print(atoi(args[1]));
+	}
+	else {
+		kprintf("Usage: lks [on | off | reset | count]\n");
+	}
+#else
+	(void)nargs;
+	(void)args;
+	kprintf("lks: kernel not built with options lockstat\n");
+#endif
+
+	return 0;
+}
+
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+#if OPT_DUMBVM
+	coremap_printstats();
+#else
+	vm_printstats();
+#endif
+
+	return 0;
+}
+
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+#if OPT_SFS
+	sfs_buf_printstats();
+#else
+	kprintf("bc: kernel not built with options sfs\n");
+#endif
 
 	return 0;
 }
@@ -478,6 +563,7 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[sy5] Rwlock test                   ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
@@ -509,6 +595,10 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[cm] Memory and paging stats        ",
+	"[ts] Thread migration stats         ",
+	"[lks] Lock profiling                ",
+	"[bc] Buffer cache stats             ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -558,6 +648,10 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "cm",         cmd_coremapstats },
+	{ "ts",         cmd_threadstats },
+	{ "lks",        cmd_lockstat },
+	{ "bc",         cmd_bufstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -580,6 +674,7 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwlocktest },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
@@ -0,0 +1,262 @@
+/*
+ * Per-process file descriptor tables. See fdtable.h.
+ *
+ * Growing needs kmalloc, which can't be called holding a spinlock, so
+ * the bigger arrays are made with the lock dropped and swapped in
+ * afterwards; if someone else grew the table in the meantime the new
+ * ones are just thrown away.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <limits.h>
+#include <bitmap.h>
+#include <file_syscalls.h>
+#include <fdtable.h>
+
+/*
+ * Make FDT at least WANT slots big, doubling. EMFILE if that would
+ * take it past OPEN_MAX.
+ */
+static
+int
+fdtable_grow(struct fdtable *fdt, unsigned want)
+{
+	struct fhandle **files, **oldfiles;
+	struct bitmap *map, *oldmap;
+	unsigned size, oldsize;
+
+	if (want > OPEN_MAX) {
+		return EMFILE;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	size = fdt->fdt_size;
+	spinlock_release(&fdt->fdt_lock);
+
+	if (size >= want) {
+		return 0;
+	}
+	while (size < want) {
+		size *= 2;
+	}
+	if (size > OPEN_MAX) {
+		size = OPEN_MAX;
+	}
+
+	files = kmalloc(size * sizeof(struct fhandle *));
+	if (files == NULL) {
+		return ENOMEM;
+	}
+	map = bitmap_create(size);
+	if (map == NULL) {
+		kfree(files);
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	oldsize = fdt->fdt_size;
+	if (oldsize >= want) {
+		/* Someone beat us to it */
+		spinlock_release(&fdt->fdt_lock);
+		bitmap_destroy(map);
+		kfree(files);
+		return 0;
+	}
+	KASSERT(oldsize < size);
+	memcpy(files, fdt->fdt_files, oldsize * sizeof(struct fhandle *));
+	bzero(files + oldsize, (size - oldsize) * sizeof(struct fhandle *));
+	memcpy(bitmap_getdata(map), bitmap_getdata(fdt->fdt_map),
+	       oldsize / 8);
+	oldfiles = fdt->fdt_files;
+	oldmap = fdt->fdt_map;
+	fdt->fdt_files = files;
+	fdt->fdt_map = map;
+	fdt->fdt_size = size;
+	spinlock_release(&fdt->fdt_lock);
+
+	bitmap_destroy(oldmap);
+	kfree(oldfiles);
+	return 0;
+}
+
+struct fdtable *
+fdtable_create(void)
+{
+	struct fdtable *fdt;
+
+	COMPILE_ASSERT(FDTABLE_INITSIZE % 32 == 0);
+
+	fdt = kmalloc(sizeof(*fdt));
+	if (fdt == NULL) {
+		return NULL;
+	}
+	fdt->fdt_files = kmalloc(FDTABLE_INITSIZE * sizeof(struct fhandle *));
+	if (fdt->fdt_files == NULL) {
+		kfree(fdt);
+		return NULL;
+	}
+	fdt->fdt_map = bitmap_create(FDTABLE_INITSIZE);
+	if (fdt->fdt_map == NULL) {
+		kfree(fdt->fdt_files);
+		kfree(fdt);
+		return NULL;
+	}
+	bzero(fdt->fdt_files, FDTABLE_INITSIZE * sizeof(struct fhandle *));
+	fdt->fdt_size = FDTABLE_INITSIZE;
+	spinlock_init(&fdt->fdt_lock);
+	return fdt;
+}
+
+int
+fdtable_copy(struct fdtable *src, struct fdtable *dst)
+{
+	unsigned i, size;
+	int err;
+
+	KASSERT(src != dst);
+
+	while (1) {
+		spinlock_acquire(&src->fdt_lock);
+		size = src->fdt_size;
+		spinlock_release(&src->fdt_lock);
+
+		err = fdtable_grow(dst, size);
+		if (err) {
+			return err;
+		}
+
+		spinlock_acquire(&src->fdt_lock);
+		if (src->fdt_size <= dst->fdt_size) {
+			break;
+		}
+		/* src grew while we were growing dst */
+		spinlock_release(&src->fdt_lock);
+	}
+
+	/* dst is new and nobody else can see it yet */
+	for (i = 0; i < src->fdt_size; i++) {
+		if (src->fdt_files[i] == NULL) {
+			continue;
+		}
+		KASSERT(dst->fdt_files[i] == NULL);
+		fhandle_incref(src->fdt_files[i]);
+		dst->fdt_files[i] = src->fdt_files[i];
+		bitmap_mark(dst->fdt_map, i);
+	}
+	spinlock_release(&src->fdt_lock);
+	return 0;
+}
+
+void
+fdtable_destroy(struct fdtable *fdt)
+{
+	unsigned i;
+
+	/* We have the only reference, and closing may sleep: no lock */
+	for (i = 0; i < fdt->fdt_size; i++) {
+		if (fdt->fdt_files[i] != NULL) {
+			fhandle_decref(fdt->fdt_files[i]);
+		}
+	}
+	bitmap_destroy(fdt->fdt_map);
+	kfree(fdt->fdt_files);
+	spinlock_cleanup(&fdt->fdt_lock);
+	kfree(fdt);
+}
+
+int
+fdtable_add(struct fdtable *fdt, struct fhandle *fh, int *fd)
+{
+	unsigned index, size;
+	int err;
+
+	KASSERT(fh != NULL);
+
+	while (1) {
+		spinlock_acquire(&fdt->fdt_lock);
+		if (bitmap_alloc(fdt->fdt_map, &index) == 0) {
+			KASSERT(fdt->fdt_files[index] == NULL);
+			fdt->fdt_files[index] = fh;
+			spinlock_release(&fdt->fdt_lock);
+			*fd = index;
+			return 0;
+		}
+		size = fdt->fdt_size;
+		spinlock_release(&fdt->fdt_lock);
+
+		err = fdtable_grow(fdt, size + 1);
+		if (err) {
+			return err;
+		}
+	}
+}
+
+int
+fdtable_set(struct fdtable *fdt, int fd, struct fhandle *fh,
+	    struct fhandle **oldfh)
+{
+	int err;
+
+	KASSERT(fh != NULL);
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+	err = fdtable_grow(fdt, fd + 1);
+	if (err) {
+		return err;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	KASSERT((unsigned)fd < fdt->fdt_size);
+	*oldfh = fdt->fdt_files[fd];
+	if (*oldfh == NULL) {
+		bitmap_mark(fdt->fdt_map, fd);
+	}
+	fdt->fdt_files[fd] = fh;
+	spinlock_release(&fdt->fdt_lock);
+	return 0;
+}
+
+int
+fdtable_get(struct fdtable *fdt, int fd, struct fhandle **fh)
+{
+	struct fhandle *file;
+
+	if (fd < 0) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	if ((unsigned)fd >= fdt->fdt_size || fdt->fdt_files[fd] == NULL) {
+		spinlock_release(&fdt->fdt_lock);
+		return EBADF;
+	}
+	file = fdt->fdt_files[fd];
+	fhandle_incref(file);
+	spinlock_release(&fdt->fdt_lock);
+
+	*fh = file;
+	return 0;
+}
+
+int
+fdtable_remove(struct fdtable *fdt, int fd, struct fhandle **fh)
+{
+	if (fd < 0) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	if ((unsigned)fd >= fdt->fdt_size || fdt->fdt_files[fd] == NULL) {
+		spinlock_release(&fdt->fdt_lock);
+		return EBADF;
+	}
+	*fh = fdt->fdt_files[fd];
+	fdt->fdt_files[fd] = NULL;
+	bitmap_unmark(fdt->fdt_map, fd);
+	spinlock_release(&fdt->fdt_lock);
+	return 0;
+}
@@ -49,6 +49,8 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <limits.h>
+#include <objcache.h>
+#include <fdtable.h>
 #include <kern/errno.h>
 
 /*
@@ -56,6 +58,9 @@
  */
 struct proc *kproc;
 
+static struct objcache proc_cache =
+	OBJCACHE_INITIALIZER("proc", sizeof(struct proc), NULL);
+
 /* Global PID handle table */
  struct pidhandle *pidhandle;
 
@@ -67,7 +72,7 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = objcache_alloc(&proc_cache);
 	if (proc == NULL)
 	{
 		return NULL;
@@ -75,7 +80,7 @@ proc_create(const char *name)
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL)
 	{
-		kfree(proc);
+		objcache_free(&proc_cache, proc);
 		return NULL;
 	}
 
@@ -93,11 +98,25 @@ proc_create(const char *name)
 	proc->children = array_create();
 	if (proc->children == NULL) 
 	{
-		kfree(proc);
+		objcache_free(&proc_cache, proc);
+		return NULL;
+	}
+	proc->p_exitcv = cv_create("exit");
+	if (proc->p_exitcv == NULL)
+	{
+		array_destroy(proc->children);
+		objcache_free(&proc_cache, proc);
 		return NULL;
 	}
 	DEBUG(DB_SYSFILE, "Initializing file table\n");
-	bzero(proc->p_fdtable, OPEN_MAX * sizeof(struct fhandle *));
+	proc->p_fdtable = fdtable_create();
+	if (proc->p_fdtable == NULL)
+	{
+		cv_destroy(proc->p_exitcv);
+		array_destroy(proc->children);
+		objcache_free(&proc_cache, proc);
+		return NULL;
+	}
 	proc->pid = 1; // the kernel thread is defined to be 1
 #endif
 
@@ -188,11 +207,18 @@ void proc_destroy(struct proc *proc)
 	}
 
 
+#if OPT_SHELL
+	/* Closes whatever files were still open */
+	fdtable_destroy(proc->p_fdtable);
+	proc->p_fdtable = NULL;
+	cv_destroy(proc->p_exitcv);
+#endif
+
 	KASSERT(proc->p_numthreads == 0);
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	objcache_free(&proc_cache, proc);
 }
 
 /*
@@ -229,7 +255,7 @@ proc_create_runprogram(const char *name)
 	//We add to proces s handle table
 	int ret = pidhandle_add(newproc, &newproc->pid);
 	if (ret){
-		kfree(newproc);
+		objcache_free(&proc_cache, newproc);
 		return NULL;
 	}
 #endif
@@ -353,6 +379,28 @@ proc_setas(struct addrspace *newas)
 }
 
 #if OPT_SHELL
+/*
+ * Puts PID back on the tail of the free list. Freed pids go to the
+ * back so a pid isn't handed out again right after its owner goes
+ * away. Caller holds the pid table write lock.
+ */
+static
+void
+pid_putfree(pid_t pid)
+{
+	KASSERT(pid >= 2 && pid <= MAX_RUNNING_PROCS);
+
+	pidhandle->pid_nextfree[pid] = 0;
+	if (pidhandle->last_pid == 0) {
+		pidhandle->next_pid = pid;
+	}
+	else {
+		pidhandle->pid_nextfree[pidhandle->last_pid] = pid;
+	}
+	pidhandle->last_pid = pid;
+	pidhandle->qty_available++;
+}
+
 /* Returns the process assciated with the given PID. */
  struct proc *
  get_proc_pid(pid_t pid)
@@ -360,21 +408,19 @@ proc_setas(struct addrspace *newas)
 
  	struct proc *proc;
 
- 	// If lock is not acquired, acquire it
-	if (!(lock_do_i_hold(pidhandle->pid_lock))){
-		lock_acquire(pidhandle->pid_lock);
-	}
-
+	/* Lookups only read the table, so they can run side by side */
+	rwlock_acquire_read(pidhandle->pid_rwlock);
  	proc = pidhandle->pid_proc[pid];
-	if (!(lock_do_i_hold(pidhandle->pid_lock))){
-		lock_release(pidhandle->pid_lock);
-	}
- 	// release lock
+	rwlock_release_read(pidhandle->pid_rwlock);
 
  	return proc;
  }
 
- /* Frees a given PID from the PID handle table. */
+ /*
+  * Frees a given PID from the PID handle table. Only used to back out
+  * a failed fork, so the child is also dropped from our children list
+  * before the caller destroys it.
+  */
  void pidhandle_free_pid(pid_t pid)
  {
  	//if (pid < PID_MIN || pid > PID_MAX)
@@ -384,12 +430,18 @@ proc_setas(struct addrspace *newas)
  	//}
 	KASSERT(pid >= 1 && pid <= MAX_RUNNING_PROCS);
 
- 	lock_acquire(pidhandle->pid_lock);
- 	pidhandle->qty_available++;
+ 	rwlock_acquire_write(pidhandle->pid_rwlock);
+	for (int i = array_num(curproc->children) - 1; i >= 0; i--) {
+		if (array_get(curproc->children, i) == pidhandle->pid_proc[pid]) {
+			array_remove(curproc->children, i);
+			break;
+		}
+	}
  	pidhandle->pid_proc[pid] = NULL;
 	pidhandle->pid_status[pid] = (int) NULL;
 	pidhandle->pid_exitcode[pid] = (int) NULL;
- 	lock_release(pidhandle->pid_lock);
+	pid_putfree(pid);
+ 	rwlock_release_write(pidhandle->pid_rwlock);
  }
 
  /*
@@ -404,35 +456,34 @@ proc_setas(struct addrspace *newas)
  		panic("Error initializing PID handle table.\n");
  	}
 
+ 	pidhandle->pid_rwlock = rwlock_create("pid table");
+ 	if (pidhandle->pid_rwlock == NULL)
+ 	{
+ 		panic("Error initializing PID handle's rwlock.\n");
+ 	}
+
  	pidhandle->pid_lock = lock_create("pid");
  	if (pidhandle->pid_lock == NULL)
  	{
  		panic("Error initializing PID handle's lock.\n");
  	}
- 	/* TO DO, IMPLEMENT CV*/
- 	pidhandle->pid_cv = cv_create("pidhandle cv");
- 	if (pidhandle->pid_cv == NULL)
- 	{
- 		panic("Error initializing PID handle's cv.\n");
- 	}
-
- 	pidhandle->qty_available = 1; /* 1 space for kernel */
- 	pidhandle->next_pid = 2;
+ 	pidhandle->qty_available = 0;
+ 	pidhandle->next_pid = 0;
+ 	pidhandle->last_pid = 0;
 
  	pid_t kpid = kproc->pid;
  	/* Set the kernel thread process into the pid structure */
  	pidhandle->pid_proc[kpid] = kproc;
 	pidhandle->pid_status[kpid] = RUNNING_STATUS;
 	pidhandle->pid_exitcode[kpid] = (int) NULL;
- 	pidhandle->qty_available--;
 
- 	/* Initialize the handle table */
- 	for (int i = 2; i < MAX_RUNNING_PROCS; i++)
+ 	/* Initialize the handle table, all other pids go on the free list */
+ 	for (int i = 2; i <= MAX_RUNNING_PROCS; i++)
  	{
- 		pidhandle->qty_available++;
  		pidhandle->pid_proc[i] = NULL;
 		pidhandle->pid_status[i] = (int) NULL;
 		pidhandle->pid_exitcode[i] = (int) NULL;
+		pid_putfree(i);
  	}
  }
 
@@ -448,42 +499,33 @@ proc_setas(struct addrspace *newas)
  		return ESRCH;
  	}
 
- 	lock_acquire(pidhandle->pid_lock);
+ 	rwlock_acquire_write(pidhandle->pid_rwlock);
 
- 	if (pidhandle->qty_available < 1)
+ 	if (pidhandle->next_pid == 0)
  	{
- 		lock_release(pidhandle->pid_lock);
+ 		rwlock_release_write(pidhandle->pid_rwlock);
  		return ENPROC;
  	}
 
  	array_add(curproc->children, proc, NULL);
+
+ 	/* Take the head of the free list */
  	nextpid = pidhandle->next_pid;
+	KASSERT(nextpid >= 2 && nextpid <= MAX_RUNNING_PROCS);
+	KASSERT(pidhandle->pid_proc[nextpid] == NULL);
+ 	pidhandle->next_pid = pidhandle->pid_nextfree[nextpid];
+ 	if (pidhandle->next_pid == 0)
+ 	{
+ 		pidhandle->last_pid = 0;
+ 	}
+ 	pidhandle->qty_available--;
  	*retval = nextpid;
-	
-	KASSERT(nextpid >= 1 && nextpid <= MAX_RUNNING_PROCS);
+
  	pidhandle->pid_proc[nextpid] = proc;
 	pidhandle->pid_status[nextpid] = RUNNING_STATUS;
 	pidhandle->pid_exitcode[nextpid] = (int) NULL;
- 	pidhandle->qty_available--;
-	
- 	/* Find next avaliable pid (from actual "next"), maybe implement status for processes */
- 	if (pidhandle->qty_available > 0)
- 	{
- 		for (int i = nextpid; i < MAX_RUNNING_PROCS; i++)
- 		{
- 			if (pidhandle->pid_proc[i] == NULL)
- 			{
- 				pidhandle->next_pid = i;
- 				break;
- 			}
- 		}
- 	}
- 	else
- 	{
- 		pidhandle->next_pid = MAX_RUNNING_PROCS + 1;
- 	}
 
- 	lock_release(pidhandle->pid_lock);
+ 	rwlock_release_write(pidhandle->pid_rwlock);
  	return 0;
  }
 
@@ -491,32 +533,33 @@ proc_setas(struct addrspace *newas)
 void process_exit(struct proc *proc, int exitcode){
 
 	KASSERT(proc != NULL);
-	
+
+	/*
+	 * pid_lock is taken before the rwlock, the same order waitpid
+	 * uses, and held until after the wakeup: our parent reaps us
+	 * under it when it exits, so our CV can't go away before we
+	 * signal it.
+	 */
 	lock_acquire(pidhandle->pid_lock);
+	rwlock_acquire_write(pidhandle->pid_rwlock);
 	pid_t pid = proc->pid;
-	
+	bool waited = false;
 
 	/* Update list of children due to exit of process, this will be manage by status*/
 	int childrennum = array_num(proc->children);
-	/* We do a for loop backwards from last children so next pid is set correctly*/
 	for(int i = childrennum -1; i >= 0; i--){
 
 		struct proc *child = array_get(proc->children, i);
 		pid_t childpid = child->pid;
 		/* If is in zombie status, we destroy the process and clean the pidhandle*/
-		if (childpid <= 0 || childpid >= MAX_RUNNING_PROCS){
+		if (childpid <= 1 || childpid > MAX_RUNNING_PROCS){
 			continue;}
 		if(pidhandle->pid_status[childpid] == ZOMBIE_STATUS){
-			/* We update next pid*/
-			if(childpid < pidhandle->next_pid){
-				pidhandle->next_pid = childpid;
-			}
 			proc_destroy(child);
-			pidhandle->qty_available++;
 			pidhandle->pid_proc[childpid] = NULL;
 			pidhandle->pid_status[childpid] = (int) NULL;
 			pidhandle->pid_exitcode[childpid] = (int) NULL;
-			
+			pid_putfree(childpid);
 		}
 		else if(pidhandle->pid_status[childpid] == RUNNING_STATUS){
 			pidhandle->pid_status[childpid] = ORPHAN_STATUS;
@@ -529,17 +572,26 @@ void process_exit(struct proc *proc, int exitcode){
 	if(pidhandle->pid_status[pid] == RUNNING_STATUS){
 		pidhandle->pid_status[pid] = ZOMBIE_STATUS; /* parent has not executed wait*/
 		pidhandle->pid_exitcode[pid] = exitcode;
+		waited = true;
 	} 
 	else if(pidhandle->pid_status[pid] == ORPHAN_STATUS){
 		/* destroy process and delete it from handle */
 		proc_destroy(curproc);
-		pidhandle->qty_available++;
 		pidhandle->pid_proc[pid] = NULL;
 		pidhandle->pid_status[pid] = (int) NULL;
 		pidhandle->pid_exitcode[pid] = (int) NULL;
+		pid_putfree(pid);
+	}
+	rwlock_release_write(pidhandle->pid_rwlock);
+
+	/*
+	 * Only our parent can be waiting for us, and it sleeps on our
+	 * own CV, so wake just that instead of every waitpid in the
+	 * system. An orphan has no one to wake.
+	 */
+	if (waited) {
+		cv_broadcast(proc->p_exitcv, pidhandle->pid_lock);
 	}
-	/* TODO: maybe not broadcast all because there's no guarantee that they are waiting on us. Improve*/
-	cv_broadcast(pidhandle->pid_cv, pidhandle->pid_lock); /* Broadcast to all waiting processes*/
 	lock_release(pidhandle->pid_lock);
 
 }
@@ -577,22 +629,13 @@ int handle_proc_fork(struct proc **new_proc, const char *new_name){
 	}
 	spinlock_release(&curproc->p_lock);
 	
-	lock_acquire(curproc->proc_lock);
-	/* We copy the filetable*/
-	for( int i = 0; i < OPEN_MAX; i++){
-		struct fhandle *fhandle_entry;
-		fhandle_entry = curproc->p_fdtable[i];
-
-		if (fhandle_entry == NULL) {
-			continue;
-		}
-		lock_acquire(fhandle_entry->lock);
-		fhandle_entry->ref_count ++;
-		lock_release(fhandle_entry->lock);
-
-		proc->p_fdtable[i] = fhandle_entry;
+	/* We copy the filetable, the child shares our open files */
+	res = fdtable_copy(curproc->p_fdtable, proc->p_fdtable);
+	if (res) {
+		pidhandle_free_pid(proc->pid);
+		proc_destroy(proc);
+		return res;
 	}
-	lock_release(curproc->proc_lock);
 	*new_proc = proc;
 
 	return 0;
@@ -11,6 +11,11 @@
 #include <copyinout.h>	   // for moving data (copyinstr)
 #include <kern/seek.h>	   // for seek constants (SEEK_SET, SEEK_CUR, ..)
 #include <kern/stat.h>	   // for getting file info via VOP_STAT (stat)
+#include <objcache.h>	   // for allocating file handles (objcache_alloc)
+#include <fdtable.h>	   // per-process file table (fdtable_get, ..)
+
+static struct objcache fhandle_cache =
+	OBJCACHE_INITIALIZER("fhandle", sizeof(struct fhandle), NULL);
 
 
 int 
@@ -44,20 +49,6 @@ sys_open(userptr_t filename, int flags, int *retval)
 		}
 	}
 
-	// find first available slot in file table
-	fd = -1;
-	for (int i = 3; i < OPEN_MAX; i++) {
-		if (curproc->p_fdtable[i] == NULL) {
-			fd = i;
-			break;
-		}
-	}
-	// no slot found
-	if (fd == -1) {
-		DEBUG(DB_SYSFILE, "Open error: File table full.\n");
-		return EMFILE;
-	}
-
 	// copy filename from userpointer into kernel buffer
 	int err = copyinstr(filename, path, sizeof(path) - 1, &pathlen);
 	if (err) {
@@ -66,196 +57,255 @@ sys_open(userptr_t filename, int flags, int *retval)
 	}
 
 	// create fhandle struct
-	open_file = kmalloc(sizeof(struct fhandle));
+	open_file = objcache_alloc(&fhandle_cache);
+	if (open_file == NULL) {
+		return ENOMEM;
+	}
 	err = create_fhandle_struct(path, flags, 0, 0, open_file);
 	if (err) {
 		DEBUG(DB_SYSFILE,
 			  "Open error: couldn't open file. path: %s (could be altered!),"
-			  " fd: %d, err: %d.\n",
-			  path, fd, err);
-		kfree(open_file);
+			  " err: %d.\n",
+			  path, err);
+		objcache_free(&fhandle_cache, open_file);
 		return err;
 	}
 
 	// set offset  to EOF if O_APPEND
 	if (flags & O_APPEND) {
-		struct stat *file_stat = NULL;
-		err = VOP_STAT(open_file->vn, file_stat);
+		struct stat file_stat;
+		err = VOP_STAT(open_file->vn, &file_stat);
 		if (err) {
 			DEBUG(DB_SYSFILE,
 				  "Open error: Couldn't compute offset. err: %d\n",
 				  err);
-			vfs_close(open_file->vn);
-			kfree(open_file);
+			fhandle_decref(open_file);
 			return err;
 		}
-		open_file->offset = file_stat->st_size;
+		open_file->offset = file_stat.st_size;
 	}
 
-	// TODO: lock acquired before added to file table? revise locking of fhandles!!!!!
-
-	// add file handle to fdtable
-	curproc->p_fdtable[fd] = open_file;
+	// add file handle to the lowest free fd, the table takes our reference
+	err = fdtable_add(curproc->p_fdtable, open_file, &fd);
+	if (err) {
+		DEBUG(DB_SYSFILE, "Open error: File table full.\n");
+		fhandle_decref(open_file);
+		return err;
+	}
 
 
 	*retval = fd;
 	return 0;
 }
 
-int sys_read(int fd, userptr_t buf, size_t size, ssize_t *retval)
+/*
+ * Reads or writes fd through the user buffers in iov. If positional,
+ * the I/O is done at pos and the handle's offset is neither used nor
+ * changed, so the handle lock isn't taken at all and any number of
+ * threads can pread/pwrite one handle at once. Otherwise it goes at
+ * the handle's offset and moves it, under the lock, like read/write.
+ */
+static int
+file_rw(int fd, struct iovec *iov, unsigned iovcnt, bool positional,
+	off_t pos, enum uio_rw rw, ssize_t *retval)
 {
-	int err;
 	struct fhandle *open_file;
-	struct iovec iov;
 	struct uio u;
-
-	DEBUG(DB_SYSCALL,
-		  "Read syscall invoked, fd:%d, buf: %p, size: %d.\n",
-		  fd, buf, size);
-
-	// check fd is within bounds
-	if (fd < 0 || fd >= OPEN_MAX) {
-		DEBUG(DB_SYSFILE,
-			  "Read error: File descriptor out of bounds. fd: %d.\n",
-			  fd);
-		return EBADF;
+	size_t total;
+	int accmode, err;
+
+	// the total has to fit in the return value
+	total = 0;
+	for (unsigned i = 0; i < iovcnt; i++) {
+		if (total + iov[i].iov_len < total ||
+		    (ssize_t)(total + iov[i].iov_len) < 0) {
+			return EINVAL;
+		}
+		total += iov[i].iov_len;
 	}
 
-	// get file handle from file table
-	open_file = curproc->p_fdtable[fd];
-
-	// check that fd points to valid file handle
-	if (open_file == NULL) {
-		DEBUG(DB_SYSFILE,
-			  "Read error: fd points to invalid p_fdtable entry. fd: %d.\n",
-			  fd);
-		return EBADF;
+	// get file handle from file table, holding a reference to it
+	err = fdtable_get(curproc->p_fdtable, fd, &open_file);
+	if (err) {
+		return err;
 	}
 
-	// check that flags allow reading from file
-	if (open_file->flags & O_WRONLY) {
-		DEBUG(DB_SYSFILE,
-			  "Read error: Flags do not allow file to be read from."
-			  " fd: %d, flags: 0x%x.\n",
-			  fd, open_file->flags);
+	// check that flags allow this direction
+	accmode = open_file->flags & O_ACCMODE;
+	if ((rw == UIO_READ && accmode == O_WRONLY) ||
+	    (rw == UIO_WRITE && accmode == O_RDONLY)) {
+		fhandle_decref(open_file);
 		return EBADF;
 	}
 
-	// synchronize access to file handle during read
-	lock_acquire(open_file->lock);
+	if (positional && !VOP_ISSEEKABLE(open_file->vn)) {
+		fhandle_decref(open_file);
+		return ESPIPE;
+	}
 
-	// init iovec and uio to read from file
-	uio_kinit(&iov, &u, buf, size, open_file->offset, UIO_READ);
+	u.uio_iov = iov;
+	u.uio_iovcnt = iovcnt;
+	u.uio_resid = total;
 	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = rw;
 	u.uio_space = curproc->p_addrspace;
 
-	// read from file
-	err = VOP_READ(open_file->vn, &u);
+	if (positional) {
+		u.uio_offset = pos;
+		err = rw == UIO_READ ?
+			VOP_READ(open_file->vn, &u) :
+			VOP_WRITE(open_file->vn, &u);
+	}
+	else {
+		lock_acquire(open_file->lock);
+		u.uio_offset = open_file->offset;
+		err = rw == UIO_READ ?
+			VOP_READ(open_file->vn, &u) :
+			VOP_WRITE(open_file->vn, &u);
+		if (!err) {
+			open_file->offset = u.uio_offset;
+		}
+		lock_release(open_file->lock);
+	}
+	fhandle_decref(open_file);
+
 	if (err) {
 		DEBUG(DB_SYSFILE,
-			  "Read error: Couldn't read to uio struct. err: %d\n",
-			  err);
-		lock_release(open_file->lock);
+			  "I/O error: fd: %d, err: %d\n",
+			  fd, err);
 		return err;
 	}
 
-	// update offset
-	open_file->offset = u.uio_offset;
+	*retval = total - u.uio_resid;
+	return 0;
+}
+
+int sys_read(int fd, userptr_t buf, size_t size, ssize_t *retval)
+{
+	struct iovec iov;
 
-	lock_release(open_file->lock);
+	DEBUG(DB_SYSCALL,
+		  "Read syscall invoked, fd:%d, buf: %p, size: %d.\n",
+		  fd, buf, size);
 
-	// return number of bytes read
-	*retval = size - u.uio_resid;
-	return 0;
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return file_rw(fd, &iov, 1, false, 0, UIO_READ, retval);
 }
 
 int
 sys_write(int fd, userptr_t buf, size_t size, ssize_t *retval)
 {
-	struct fhandle *open_file;
 	struct iovec iov;
-	struct uio u;
-	int err;
 
 	DEBUG(DB_SYSCALL,
 		  "Write syscall invoked, fd: %d, buf: %p, size: %d.\n",
 		  fd, buf, size);
 
-	// check fd is within bounds
-	if (fd < 0 || fd >= OPEN_MAX)
-	{
-		DEBUG(DB_SYSFILE,
-			  "Write error: File descriptor out of bounds. fd: %d.\n",
-			  fd);
-		return EBADF;
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return file_rw(fd, &iov, 1, false, 0, UIO_WRITE, retval);
+}
+
+/* iovecs readv/writev keep on the stack before going to kmalloc */
+#define FILE_FASTIOV 8
+
+/* Copies in the user's iovec array and does readv or writev with it. */
+static int
+file_rwv(int fd, const_userptr_t iov, int iovcnt, enum uio_rw rw,
+	 ssize_t *retval)
+{
+	struct iovec fastiov[FILE_FASTIOV];
+	struct iovec *kiov;
+	int err;
+
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
 	}
 
-	// get file handle from file table
-	open_file = curproc->p_fdtable[fd];
+	kiov = fastiov;
+	if (iovcnt > FILE_FASTIOV) {
+		kiov = kmalloc(iovcnt * sizeof(struct iovec));
+		if (kiov == NULL) {
+			return ENOMEM;
+		}
+	}
 
-	// check that fd points to valid file handle
-	if (open_file == NULL)
-	{
-		DEBUG(DB_SYSFILE,
-			  "Write error: fd points to invalid p_fdtable entry. fd: %d.\n",
-			  fd);
-		return EBADF;
+	// the user's iov_base pointers land in iov_ubase
+	err = copyin(iov, kiov, iovcnt * sizeof(struct iovec));
+	if (!err) {
+		err = file_rw(fd, kiov, iovcnt, false, 0, rw, retval);
 	}
 
-	// check that flags allow writing to file
-	if (open_file->flags & O_RDONLY)
-	{
-		DEBUG(DB_SYSFILE,
-			  "Write error: Flags do not allow file to be written to."
-			  " fd: %d, flags: 0x%x.\n",
-			  fd, open_file->flags);
-		lock_release(open_file->lock);
-		return EBADF;
+	if (kiov != fastiov) {
+		kfree(kiov);
 	}
+	return err;
+}
 
-	// synchronize access to file handle during write
-	lock_acquire(open_file->lock);
+int
+sys_pread(int fd, userptr_t buf, size_t size, off_t pos, ssize_t *retval)
+{
+	struct iovec iov;
 
-	// init iovec and uio to write to file
-	uio_kinit(&iov, &u, buf, size, open_file->offset, UIO_WRITE);
-	u.uio_segflg = UIO_USERSPACE;
-	u.uio_space = curproc->p_addrspace;
+	DEBUG(DB_SYSCALL,
+		  "Pread syscall invoked, fd: %d, buf: %p, size: %d.\n",
+		  fd, buf, size);
 
-	// write to vnode
-	err = VOP_WRITE(open_file->vn, &u);
-	if (err)
-	{
-		DEBUG(DB_SYSFILE,
-			  "Write error: Couldn't write to uio struct. err: %d\n",
-			  err);
-		lock_release(open_file->lock);
-		return err;
+	if (pos < 0) {
+		return EINVAL;
 	}
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return file_rw(fd, &iov, 1, true, pos, UIO_READ, retval);
+}
 
-	// update offset
-	open_file->offset = u.uio_offset;
+int
+sys_pwrite(int fd, userptr_t buf, size_t size, off_t pos, ssize_t *retval)
+{
+	struct iovec iov;
 
-	lock_release(open_file->lock);
+	DEBUG(DB_SYSCALL,
+		  "Pwrite syscall invoked, fd: %d, buf: %p, size: %d.\n",
+		  fd, buf, size);
 
-	// return number of bytes read
-	*retval = size - u.uio_resid;
-	return 0;
+	if (pos < 0) {
+		return EINVAL;
+	}
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return file_rw(fd, &iov, 1, true, pos, UIO_WRITE, retval);
 }
 
-int sys_lseek(int fd, off_t pos, int whence, off_t *retval)
+int
+sys_readv(int fd, const_userptr_t iov, int iovcnt, ssize_t *retval)
 {
+	DEBUG(DB_SYSCALL,
+		  "Readv syscall invoked, fd: %d, iov: %p, iovcnt: %d.\n",
+		  fd, iov, iovcnt);
 
-	if (fd < 0 || fd >= OPEN_MAX)
-	{ // if fd out of bounds of fdtable
-		return EBADF;
-	}
+	return file_rwv(fd, iov, iovcnt, UIO_READ, retval);
+}
 
+int
+sys_writev(int fd, const_userptr_t iov, int iovcnt, ssize_t *retval)
+{
+	DEBUG(DB_SYSCALL,
+		  "Writev syscall invoked, fd: %d, iov: %p, iovcnt: %d.\n",
+		  fd, iov, iovcnt);
+
+	return file_rwv(fd, iov, iovcnt, UIO_WRITE, retval);
+}
+
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval)
+{
 	struct fhandle *open_file;
-	open_file = curproc->p_fdtable[fd]; // get file handle from file table
+	int err;
 
-	if (open_file == NULL)
+	err = fdtable_get(curproc->p_fdtable, fd, &open_file); // get file handle from file table
+	if (err)
 	{
-		return EBADF;
+		return err;
 	}
 
 	lock_acquire(open_file->lock); // synchronize access to file handle during seek
@@ -263,6 +313,7 @@ int sys_lseek(int fd, off_t pos, int whence, off_t *retval)
 	if (!VOP_ISSEEKABLE(open_file->vn))
 	{								   // check if file allows for seeking
 		lock_release(open_file->lock); // release lock
+		fhandle_decref(open_file);
 		return ESPIPE;
 	}
 
@@ -277,29 +328,33 @@ int sys_lseek(int fd, off_t pos, int whence, off_t *retval)
 		offset = offset + pos;
 		break;
 	case SEEK_END:; // empty statement for label
-		struct stat *file_stat = NULL;
-		int err = VOP_STAT(open_file->vn, file_stat);
+		struct stat file_stat;
+		err = VOP_STAT(open_file->vn, &file_stat);
 		if (err)
 		{
 			lock_release(open_file->lock); // release lock
+			fhandle_decref(open_file);
 			return err;
 		}
-		offset = file_stat->st_size + pos;
+		offset = file_stat.st_size + pos;
 		break;
 	default:
 		lock_release(open_file->lock); // release lock
+		fhandle_decref(open_file);
 		return EINVAL;
 	}
 
 	if (offset < 0)
 	{
 		lock_release(open_file->lock); // release lock
+		fhandle_decref(open_file);
 		return EINVAL;
 	}
 
 	open_file->offset = offset; // update offset in file handle
 
 	lock_release(open_file->lock); // release lock
+	fhandle_decref(open_file);
 
 	*retval = offset;
 	return 0;
@@ -369,160 +424,161 @@ sys___getcwd(userptr_t buf, size_t buflen, int *retval)
 
 int sys_close(int fd)
 {
-
 	struct fhandle *open_file;
-	open_file = curproc->p_fdtable[fd];
-
-	if (open_file == NULL)
-	{
-		return EBADF;
-	}
+	int err;
 
-	lock_acquire(open_file->lock);
-	// we make sure that open file is not null
-	// we check if fd is invalid
-	if (fd < 0 || fd > OPEN_MAX)
+	// take the handle out of the table, along with the table's reference
+	err = fdtable_remove(curproc->p_fdtable, fd, &open_file);
+	if (err)
 	{
-		lock_release(open_file->lock);
-		return EINVAL;
+		return err;
 	}
 
-	if (open_file->ref_count -= 1 > 0)
-	{
-		lock_release(open_file->lock); // we release to not produce deadlock
-		return 0;
-	}; // we decrement by one and return 0
-
-	if (open_file->ref_count == 0)
-	{
-		// maybe create another function with this, with other optfile
-		KASSERT(open_file->vn != NULL); // i interrup the program if file is null
-		vfs_close(open_file->vn);
-		open_file->vn = NULL;
-		lock_release(open_file->lock);
-		lock_destroy(open_file->lock);
-		kfree(open_file); //i dont know if kfree is implemented fully
-	}
-	curproc->p_fdtable[fd] = NULL;
+	// the file is closed when the last reference goes, which may be
+	// a read or write still running on it in another thread
+	fhandle_decref(open_file);
 	return 0;
 }
 
 int sys_dup2(int oldfd, int newfd, int *retval)
 {
+	struct fhandle *old_file;
+	struct fhandle *previous_file;
+	int err;
 
-	if (oldfd < 0 || oldfd >= OPEN_MAX || newfd < 0 || newfd >= OPEN_MAX)
+	if (newfd < 0 || newfd >= OPEN_MAX)
 	{
 		return EBADF;
 	}
+
+	// the reference we get here is the one newfd's slot will hold
+	err = fdtable_get(curproc->p_fdtable, oldfd, &old_file);
+	if (err) // nothing to copy
+	{
+		return err;
+	}
+
 	// If oldfd is a valid file descriptor, and newfd has the same value as oldfd, then dup2() does
 	// nothing, and returns newfd.
 	if (oldfd == newfd)
 	{
-		return newfd;
+		fhandle_decref(old_file);
+		*retval = newfd;
+		return 0;
 	}
 
-	struct fhandle *old_file;
-	struct fhandle *previous_file;
-	old_file = curproc->p_fdtable[oldfd];
-
-	if (old_file == NULL) // nothing to copy
+	//asign to the new fd the old file
+	err = fdtable_set(curproc->p_fdtable, newfd, old_file, &previous_file);
+	if (err)
 	{
-		return EBADF;
+		fhandle_decref(old_file);
+		return err;
 	}
 
 	// If the descriptor newfd was previously open, it is silently closed before being reused.
-	previous_file = curproc->p_fdtable[newfd];
 	if (previous_file != NULL)
 	{
-		lock_acquire(previous_file->lock);
-
-		previous_file->ref_count -= 1;
-		if (previous_file->ref_count == 0)
-		{
-			vfs_close(previous_file->vn); // we close the previously open file
-			lock_destroy(previous_file->lock);
-		}
-		lock_release(previous_file->lock);
-		curproc->p_fdtable[newfd] = NULL; // we set it to null
-		kfree(previous_file);
+		fhandle_decref(previous_file);
 	}
 
-	//asign to the new fd the old file
-	curproc->p_fdtable[newfd] = old_file;
-	lock_acquire(old_file->lock);
-	old_file->ref_count += 1;
-	lock_release(old_file->lock);
 	*retval = newfd;
-
 	return 0;
 }
 
 int create_fhandle_struct(char *path, int flags, int mode, off_t offset, struct fhandle *retval)
 {
-	struct vnode *vn;
 	int err;
 
-	// initialize fhandle struct
-	retval->vn = vn;
-	retval->offset = offset;
-	retval->flags = flags;
-	retval->ref_count = 1;
-	retval->lock = lock_create(path);
-
 	// open file
-	err = vfs_open(path, flags, mode, &vn);
+	err = vfs_open(path, flags, mode, &retval->vn);
 	if (err)
 	{
 		return err;
 	}
 
+	retval->lock = lock_create(path);
+	if (retval->lock == NULL)
+	{
+		vfs_close(retval->vn);
+		return ENOMEM;
+	}
+
+	// initialize fhandle struct
+	retval->offset = offset;
+	retval->flags = flags;
+	retval->ref_count = 1;
+	spinlock_init(&retval->ref_lock);
+
 	return 0;
 }
 
-int open_console(struct fhandle *fdtable[])
+/* Takes another reference to an open file. */
+void fhandle_incref(struct fhandle *fh)
 {
-	int err;
+	spinlock_acquire(&fh->ref_lock);
+	KASSERT(fh->ref_count > 0);
+	fh->ref_count++;
+	spinlock_release(&fh->ref_lock);
+}
 
-	char con0[] = "con:";
-	fdtable[0] = kmalloc(sizeof(struct fhandle));
-	err = create_fhandle_struct(con0, O_RDONLY, 0664, 0, fdtable[0]);
-	if (err)
-	{
-		DEBUG(DB_SYSFILE,
-			  "ConsoleIO error: couldn't open stdin. err: %d.\n",
-			  err);
-		kfree(fdtable[0]);
-		return err;
-	}
+/* Drops a reference to an open file, closing it if it was the last. */
+void fhandle_decref(struct fhandle *fh)
+{
+	unsigned int refs;
 
-	char con1[] = "con:";
-	fdtable[1] = kmalloc(sizeof(struct fhandle));
-	err = create_fhandle_struct(con1, O_WRONLY, 0664, 0, fdtable[1]);
-	if (err)
+	spinlock_acquire(&fh->ref_lock);
+	KASSERT(fh->ref_count > 0);
+	refs = --fh->ref_count;
+	spinlock_release(&fh->ref_lock);
+
+	if (refs > 0)
 	{
-		DEBUG(DB_SYSFILE,
-			  "ConsoleIO error: couldn't open stdout. err: %d.\n",
-			  err);
-		vfs_close(fdtable[0]->vn);
-		kfree(fdtable[0]);
-		kfree(fdtable[1]);
-		return err;
+		return;
 	}
 
-	char con2[] = "con:";
-	fdtable[2] = kmalloc(sizeof(struct fhandle));
-	err = create_fhandle_struct(con2, O_WRONLY, 0664, 0, fdtable[2]);
-	if (err)
+	KASSERT(fh->vn != NULL);
+	vfs_close(fh->vn);
+	fh->vn = NULL;
+	lock_destroy(fh->lock);
+	spinlock_cleanup(&fh->ref_lock);
+	objcache_free(&fhandle_cache, fh);
+}
+
+int open_console(struct fdtable *fdt)
+{
+	static const int con_flags[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct fhandle *console, *previous_file;
+	int err;
+
+	// stdin, stdout and stderr each get their own handle on con:
+	for (int fd = 0; fd < 3; fd++)
 	{
-		DEBUG(DB_SYSFILE,
-			  "ConsoleIO error: couldn't open stderr. err: %d.\n",
-			  err);
-		vfs_close(fdtable[0]->vn);
-		vfs_close(fdtable[1]->vn);
-		kfree(fdtable[0]);
-		kfree(fdtable[1]);
-		kfree(fdtable[2]);
-		return err;
+		char con[] = "con:";
+		console = objcache_alloc(&fhandle_cache);
+		if (console == NULL)
+		{
+			return ENOMEM;
+		}
+		err = create_fhandle_struct(con, con_flags[fd], 0664, 0, console);
+		if (err)
+		{
+			DEBUG(DB_SYSFILE,
+				  "ConsoleIO error: couldn't open fd %d. err: %d.\n",
+				  fd, err);
+			objcache_free(&fhandle_cache, console);
+			return err;
+		}
+
+		err = fdtable_set(fdt, fd, console, &previous_file);
+		if (err)
+		{
+			fhandle_decref(console);
+			return err;
+		}
+		if (previous_file != NULL)
+		{
+			fhandle_decref(previous_file);
+		}
 	}
 
 	return 0;
@@ -14,6 +14,7 @@
 #include <lib.h>
 #include <addrspace.h>
 #include <syscall.h>  
+#include <objcache.h>      // for allocating trapframes (objcache_alloc)
 
 #define ALIGN_POINTER 4
 #define ALIGN_STACK 8 
@@ -221,12 +222,20 @@ int sys_waitpid(pid_t pid, int *retval, int options){
     }
 
     /*Only allow values for PID that are between the minimum and maximum*/
-    if (pid < 2 || pid > MAX_RUNNING_PROCS || pidhandle->pid_status[pid] == (int)NULL){
+    if (pid < 2 || pid > MAX_RUNNING_PROCS){
         return EINVAL;
     }
 
-    /*Check if actual pid is child of the current process */
+    /* Look the pid up with a read hold, so waiters don't serialise */
+    rwlock_acquire_read(pidhandle->pid_rwlock);
+    if (pidhandle->pid_status[pid] == (int)NULL){
+        rwlock_release_read(pidhandle->pid_rwlock);
+        return EINVAL;
+    }
     child = pidhandle->pid_proc[pid];
+    rwlock_release_read(pidhandle->pid_rwlock);
+
+    /*Check if actual pid is child of the current process */
     childrennum = array_num(curproc->children);
     for(int i = 0; i< childrennum; i++){
         if (child == array_get(curproc->children, i)){
@@ -239,15 +248,23 @@ int sys_waitpid(pid_t pid, int *retval, int options){
         return ECHILD;
     } 
 
+    /*
+     * process_exit changes the status under the rwlock and then
+     * signals the child's own exit CV holding pid_lock, so checking
+     * under both can't miss the wakeup. The child can't be destroyed
+     * while we wait, since only its parent (us) reaps zombies.
+     */
     lock_acquire(pidhandle->pid_lock);
-    
-
+    rwlock_acquire_read(pidhandle->pid_rwlock);
     while(pidhandle->pid_status[pid] != ZOMBIE_STATUS){
-        cv_wait(pidhandle->pid_cv, pidhandle->pid_lock);
+        rwlock_release_read(pidhandle->pid_rwlock);
+        cv_wait(child->p_exitcv, pidhandle->pid_lock);
+        rwlock_acquire_read(pidhandle->pid_rwlock);
     }
 
     exitcode = pidhandle->pid_exitcode[pid];
 
+    rwlock_release_read(pidhandle->pid_rwlock);
     lock_release(pidhandle->pid_lock);
 
     if (retval != NULL){
@@ -261,6 +278,10 @@ int sys_waitpid(pid_t pid, int *retval, int options){
     return 0;
 }
 #if OPT_FORK
+/* Copies of the parent's trapframe, handed to the child thread */
+static struct objcache trapframe_cache =
+	OBJCACHE_INITIALIZER("trapframe", sizeof(struct trapframe), NULL);
+
 /*
 Function that child first enters, in charge of setting trapframes
 */
@@ -274,7 +295,7 @@ void child_forkentry(void *data1, unsigned long data2){
 
     /* We activate the new address space */
     as_activate();
-    kfree((struct trapframe *) data1);
+    objcache_free(&trapframe_cache, data1);
     /* We return to user mode */
     mips_usermode(tf);
     
@@ -295,9 +316,11 @@ int sys_fork(struct trapframe *tf, int *retval ){
         return res;
     }
 
-    new_tf = kmalloc(sizeof(struct trapframe));
+    new_tf = objcache_alloc(&trapframe_cache);
 	if (new_tf == NULL) {
 		kprintf("No more trapfame space :( \n");
+		pidhandle_free_pid(new_proc->pid);
+		proc_destroy(new_proc);
 		return ENOMEM;
 	}
     // we store the copy of the trampfram on a kernel heap and set to 0 all trapframes
@@ -320,7 +343,7 @@ int sys_fork(struct trapframe *tf, int *retval ){
 		proc_destroy(new_proc);
 		
 		
-		kfree(new_tf);
+		objcache_free(&trapframe_cache, new_tf);
 		return res;
 	}
 
@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +57,47 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Longest sleep we bother to count, in seconds; the tick count has to
+ * fit in an unsigned. Longer requests just sleep this long.
+ */
+#define NANOSLEEP_MAXSECS	(0x7fffffff / HZ)
+
+/* Nanoseconds per hardclock */
+#define NSEC_PER_TICK		(1000000000 / HZ)
+
+/*
+ * nanosleep: sleep for the time in *USER_REQ, rounded up to a whole
+ * number of hardclocks. The sleep is on the thread's own timer
+ * (clocksleep_ticks uses wchan_sleep_timed), so other sleepers'
+ * expiries don't wake us. Nothing can interrupt the sleep (there are
+ * no signals), so the remaining time is always zero and USER_REM is
+ * not written.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec req;
+	unsigned ticks;
+	int result;
+
+	(void)user_rem;
+
+	result = copyin(user_req, &req, sizeof(req));
+	if (result) {
+		return result;
+	}
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	if (req.tv_sec > NANOSLEEP_MAXSECS) {
+		req.tv_sec = NANOSLEEP_MAXSECS;
+	}
+	ticks = (unsigned)req.tv_sec * HZ;
+	ticks += (req.tv_nsec + NSEC_PER_TICK - 1) / NSEC_PER_TICK;
+
+	clocksleep_ticks(ticks);
+	return 0;
+}
@@ -0,0 +1,146 @@
+#include "vm_syscalls.h" // prototype for this file
+#include <kern/errno.h>  // Errors (EINVAL, ENOMEM, ..)
+#include <kern/fcntl.h>  // open flags (O_RDONLY, O_RDWR, ..)
+#include <kern/mman.h>   // mmap flags (PROT_READ, MAP_SHARED, ..)
+#include <types.h>
+#include <lib.h>
+#include <limits.h>      // OPEN_MAX
+#include <current.h>     // curproc
+#include <proc.h>        // proc_getas
+#include <vnode.h>       // VOP_MMAP
+#include <addrspace.h>   // as_sbrk, as_mmap, as_munmap
+#include <file_syscalls.h> // struct fhandle
+#include <fdtable.h>      // fdtable_get
+
+
+/*
+Moves the end of the heap by amount bytes and returns the old end.
+New pages are only allocated when they are first touched.
+*/
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int err;
+
+	DEBUG(DB_VM, "sbrk syscall invoked, amount: %d.\n", (int)amount);
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	err = as_sbrk(as, amount, &oldbreak);
+	if (err) {
+		return err;
+	}
+
+	*retval = (int32_t)oldbreak;
+	return 0;
+}
+
+#if OPT_SHELL
+/*
+Maps len bytes of the open file fd, starting at offset, and returns the
+address of the mapping. addr is only a hint and is ignored.
+*/
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int32_t *retval)
+{
+	struct addrspace *as;
+	struct fhandle *open_file;
+	vaddr_t base;
+	int perms, accmode;
+	int err;
+
+	(void)addr;
+
+	DEBUG(DB_VM, "mmap syscall invoked, len: %d, prot: 0x%x, flags: 0x%x,"
+	      " fd: %d.\n", len, prot, flags, fd);
+
+	// check arguments
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+	if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) {
+		return EINVAL;
+	}
+
+	// check fd points to valid file handle, and hold on to it
+	err = fdtable_get(curproc->p_fdtable, fd, &open_file);
+	if (err) {
+		return err;
+	}
+
+	// file must be readable, and writable too for shared writes
+	accmode = open_file->flags & O_ACCMODE;
+	if (accmode == O_WRONLY) {
+		err = EACCES;
+		goto out;
+	}
+	if (flags == MAP_SHARED && (prot & PROT_WRITE) && accmode != O_RDWR) {
+		err = EACCES;
+		goto out;
+	}
+
+	// check the file can be mapped at all (no devices)
+	err = VOP_MMAP(open_file->vn);
+	if (err) {
+		goto out;
+	}
+
+	perms = 0;
+	if (prot & PROT_READ) {
+		perms |= VR_READ;
+	}
+	if (prot & PROT_WRITE) {
+		perms |= VR_WRITE;
+	}
+	if (prot & PROT_EXEC) {
+		perms |= VR_EXEC;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		err = EINVAL;
+		goto out;
+	}
+
+	// the mapping takes its own reference to the vnode
+	err = as_mmap(as, open_file->vn, offset, len, perms, flags, &base);
+	if (err) {
+		goto out;
+	}
+
+	*retval = (int32_t)base;
+ out:
+	fhandle_decref(open_file);
+	return err;
+}
+#endif
+
+/*
+Removes the pages in [addr, addr + len) from the mapping containing
+them. Dirty pages of shared mappings are written back once nobody has
+the file mapped anymore.
+*/
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	DEBUG(DB_VM, "munmap syscall invoked, addr: %p, len: %d.\n",
+	      addr, len);
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	return as_munmap(as, (vaddr_t)addr, len);
+}
@@ -399,3 +399,102 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock test. Every fourth thread is a writer, which
+ * sets the test values together; readers check that they never see
+ * them half changed. Run once on a plain rwlock and once on a
+ * per-cpu one.
+ */
+
+#define NRWLOOPS 200
+
+static struct rwlock *testrw;
+static volatile unsigned rwfailed;
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned long v1, v2, v3;
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % 4 == 0) {
+			rwlock_acquire_write(testrw);
+			testval1 = num + i;
+			thread_yield();
+			testval2 = testval1 * testval1;
+			testval3 = testval1 % 3;
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			v1 = testval1;
+			thread_yield();
+			v2 = testval2;
+			v3 = testval3;
+			rwlock_release_read(testrw);
+			if (v2 != v1 * v1 || v3 != v1 % 3) {
+				rwfailed = 1;
+			}
+		}
+	}
+	V(donesem);
+}
+
+static
+void
+rwtestrun(const char *what)
+{
+	int i, result;
+
+	kprintf("Starting %s rwlock test...\n", what);
+	rwfailed = 0;
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", NULL, rwtestthread,
+				     NULL, i);
+		if (result) {
+			panic("rwlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+	kprintf("%s\n", rwfailed ? "Test failed" : "ok");
+}
+
+int
+rwlocktest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testval1 = 0;
+	testval2 = 0;
+	testval3 = 0;
+
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwlocktest: rwlock_create failed\n");
+	}
+	rwtestrun("plain");
+	rwlock_destroy(testrw);
+
+	testrw = rwlock_create_percpu("testrw");
+	if (testrw == NULL) {
+		panic("rwlocktest: rwlock_create_percpu failed\n");
+	}
+	rwtestrun("per-cpu");
+	rwlock_destroy(testrw);
+	testrw = NULL;
+
+	kprintf("Rwlock test done.\n");
+	return 0;
+}
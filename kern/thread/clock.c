@@ -30,17 +30,24 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spl.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * Each CPU counts its hardclocks in c_hardclocks and keeps a timer
+ * wheel of one-shot callbacks that come due on particular ticks;
+ * clocksleep and friends are built on top of that.
+ *
+ * An idle CPU doesn't take the periodic tick: before it waits for an
+ * interrupt, clock_idle programs its timer to go off only when its
+ * next timer is due (or after CLOCK_IDLEMAX ticks), and the ticks
+ * that went by are made up for when it wakes up.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -50,14 +57,276 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	100	/* Reset priorities every 100. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define CLOCK_IDLEMAX		HZ	/* Longest tickless idle, in ticks */
+
+////////////////////////////////////////////////////////////
+//
+// Timer wheel.
+//
+//    Two levels of TW_SIZE slots. A timer due within TW_SIZE ticks is
+//    on the level 0 slot for its exact tick; one due later is on the
+//    level 1 slot for its block of TW_SIZE ticks, and is moved down
+//    ("cascaded") when that block begins. Timers more than
+//    TW_SIZE*TW_SIZE ticks out are parked on the furthest level 1
+//    slot and re-filed each time they are cascaded.
+//
+//    Starting, stopping, and firing a timer are all constant time;
+//    only finding the next due timer for tickless idle needs a scan.
+//
+
+#define TW_BITS		6
+#define TW_SIZE		(1U << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+
+struct timerwheel {
+	struct spinlock tw_lock;
+	unsigned tw_now;		/* last tick processed */
+	unsigned tw_count;		/* timers on the wheel */
+	struct timer *tw_slots[2][TW_SIZE];
+};
+
+struct timerwheel *
+timerwheel_create(void)
+{
+	struct timerwheel *tw;
+
+	tw = kmalloc(sizeof(*tw));
+	if (tw == NULL) {
+		return NULL;
+	}
+	spinlock_init(&tw->tw_lock);
+	tw->tw_now = 0;
+	tw->tw_count = 0;
+	bzero(tw->tw_slots, sizeof(tw->tw_slots));
+	return tw;
+}
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Put TM on the right slot of TW for its expiry time.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+static
+void
+tw_insert(struct timerwheel *tw, struct timer *tm)
+{
+	struct timer **slot;
+	unsigned delta, when;
+
+	KASSERT(spinlock_do_i_hold(&tw->tw_lock));
+
+	delta = tm->tm_expires - tw->tw_now;
+	if (delta < TW_SIZE) {
+		slot = &tw->tw_slots[0][tm->tm_expires & TW_MASK];
+	}
+	else {
+		when = tm->tm_expires;
+		if (delta >= TW_SIZE * TW_SIZE) {
+			when = tw->tw_now + TW_SIZE * TW_SIZE - 1;
+		}
+		slot = &tw->tw_slots[1][(when >> TW_BITS) & TW_MASK];
+	}
+
+	tm->tm_next = *slot;
+	if (tm->tm_next != NULL) {
+		tm->tm_next->tm_prevp = &tm->tm_next;
+	}
+	tm->tm_prevp = slot;
+	*slot = tm;
+}
+
+static
+void
+tw_remove(struct timer *tm)
+{
+	*tm->tm_prevp = tm->tm_next;
+	if (tm->tm_next != NULL) {
+		tm->tm_next->tm_prevp = tm->tm_prevp;
+	}
+	tm->tm_next = NULL;
+	tm->tm_prevp = NULL;
+}
+
+/*
+ * Advance TW by one tick. Returns the timers that are now due,
+ * already off the wheel, chained through tm_next.
+ */
+static
+struct timer *
+tw_tick(struct timerwheel *tw)
+{
+	struct timer *tm, *next, *due;
+	unsigned idx;
+
+	KASSERT(spinlock_do_i_hold(&tw->tw_lock));
+
+	tw->tw_now++;
+	if ((tw->tw_now & TW_MASK) == 0) {
+		idx = (tw->tw_now >> TW_BITS) & TW_MASK;
+		tm = tw->tw_slots[1][idx];
+		tw->tw_slots[1][idx] = NULL;
+		for (; tm != NULL; tm = next) {
+			next = tm->tm_next;
+			tw_insert(tw, tm);
+		}
+	}
+
+	idx = tw->tw_now & TW_MASK;
+	due = tw->tw_slots[0][idx];
+	tw->tw_slots[0][idx] = NULL;
+	for (tm = due; tm != NULL; tm = tm->tm_next) {
+		KASSERT(tm->tm_expires == tw->tw_now);
+		tm->tm_wheel = NULL;
+		tm->tm_prevp = NULL;
+		tw->tw_count--;
+	}
+	return due;
+}
+
+/*
+ * Return the number of ticks until the first timer on TW is due, or
+ * MAX if that is further out.
+ */
+static
+unsigned
+tw_nextdue(struct timerwheel *tw, unsigned max)
+{
+	struct timer *tm;
+	unsigned i, idx, best;
+
+	KASSERT(spinlock_do_i_hold(&tw->tw_lock));
+
+	if (tw->tw_count == 0) {
+		return max;
+	}
+	for (i=1; i<TW_SIZE && i<max; i++) {
+		if (tw->tw_slots[0][(tw->tw_now + i) & TW_MASK] != NULL) {
+			return i;
+		}
+	}
+
+	/* Nothing in level 0; look at the first busy level 1 slot. */
+	best = max;
+	for (i=1; i<=TW_SIZE; i++) {
+		idx = ((tw->tw_now >> TW_BITS) + i) & TW_MASK;
+		if (tw->tw_slots[1][idx] == NULL) {
+			continue;
+		}
+		for (tm = tw->tw_slots[1][idx]; tm != NULL; tm = tm->tm_next) {
+			if (tm->tm_expires - tw->tw_now < best) {
+				best = tm->tm_expires - tw->tw_now;
+			}
+		}
+		break;
+	}
+	return best;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Timers.
+
+void
+timer_init(struct timer *tm, void (*func)(void *), void *data)
+{
+	tm->tm_func = func;
+	tm->tm_data = data;
+	tm->tm_wheel = NULL;
+	tm->tm_expires = 0;
+	tm->tm_next = NULL;
+	tm->tm_prevp = NULL;
+}
+
+void
+timer_start(struct timer *tm, unsigned ticks)
+{
+	struct timerwheel *tw;
+	int s;
+
+	KASSERT(tm->tm_wheel == NULL);
+	if (ticks == 0) {
+		ticks = 1;
+	}
+
+	/* Stay on this cpu while picking its wheel. */
+	s = splhigh();
+	tw = curcpu->c_timerwheel;
+	spinlock_acquire(&tw->tw_lock);
+	tm->tm_expires = tw->tw_now + ticks;
+	tm->tm_wheel = tw;
+	tw_insert(tw, tm);
+	tw->tw_count++;
+	spinlock_release(&tw->tw_lock);
+	splx(s);
+}
+
+unsigned
+timer_stop(struct timer *tm)
+{
+	struct timerwheel *tw;
+	unsigned left;
+
+	tw = tm->tm_wheel;
+	if (tw == NULL) {
+		return 0;
+	}
+	spinlock_acquire(&tw->tw_lock);
+	if (tm->tm_wheel != tw) {
+		/* It went off while we were getting the lock. */
+		spinlock_release(&tw->tw_lock);
+		return 0;
+	}
+	left = tm->tm_expires - tw->tw_now;
+	tw_remove(tm);
+	tm->tm_wheel = NULL;
+	tw->tw_count--;
+	spinlock_release(&tw->tw_lock);
+	return left;
+}
+
+/*
+ * Account for NTICKS ticks on this cpu, firing the timers that come
+ * due. Called with interrupts off.
+ */
+static
+void
+clock_advance(unsigned nticks)
+{
+	struct timerwheel *tw;
+	struct timer *tm, *next;
+	void (*func)(void *);
+	void *data;
+
+	tw = curcpu->c_timerwheel;
+	while (nticks-- > 0) {
+		curcpu->c_hardclocks++;
+
+		spinlock_acquire(&tw->tw_lock);
+		tm = tw_tick(tw);
+		spinlock_release(&tw->tw_lock);
+
+		/* The timer may be reused as soon as its function runs. */
+		for (; tm != NULL; tm = next) {
+			next = tm->tm_next;
+			func = tm->tm_func;
+			data = tm->tm_data;
+			tm->tm_next = NULL;
+			func(data);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Ticks.
+
+/*
+ * Timed sleeps all park on one channel, but nobody ever wakes it:
+ * each sleeper is taken off by its own thread timer (see
+ * wchan_sleep_timed), so an expiry only wakes the thread it's for.
+ */
+static struct wchan *sleep_wchan;
+static struct spinlock sleep_lock;
 
 /*
  * Setup.
@@ -65,45 +334,124 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	spinlock_init(&sleep_lock);
+	sleep_wchan = wchan_create("clocksleep");
+	if (sleep_wchan == NULL) {
+		panic("Couldn't create clocksleep wchan\n");
 	}
 }
 
 /*
  * This is called once per second, on one processor, by the timer
- * code.
+ * code. Timed sleeps now use the per-cpu timers, so there is nothing
+ * left to do here.
  */
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
 }
 
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code, except while the processor is idle; see clock_idle.
  */
 void
 hardclock(void)
 {
+	unsigned nticks;
+
 	/*
-	 * Collect statistics here as desired.
+	 * If we were idle with the tick off, this is the one-shot
+	 * interrupt clock_idle asked for, and that many ticks have
+	 * gone by.
 	 */
+	nticks = 1;
+	if (curcpu->c_tickless) {
+		nticks = curcpu->c_idleticks;
+		curcpu->c_tickless = false;
+	}
+	clock_advance(nticks);
 
-	curcpu->c_hardclocks++;
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	if (thread_tick()) {
+		thread_yield();
+	}
+}
+
+/*
+ * Called on an idle cpu with interrupts off, right before it waits
+ * for an interrupt. Unless a timer is due at the next tick, turn the
+ * periodic tick off until the first one is.
+ */
+void
+clock_idle(void)
+{
+	struct timerwheel *tw;
+	unsigned nticks;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	if (curcpu->c_tickless) {
+		/* Still waiting for the last one-shot to be taken. */
+		return;
+	}
+
+	tw = curcpu->c_timerwheel;
+	spinlock_acquire(&tw->tw_lock);
+	nticks = tw_nextdue(tw, CLOCK_IDLEMAX);
+	spinlock_release(&tw->tw_lock);
+
+	if (nticks <= 1) {
+		return;
+	}
+	curcpu->c_idleticks = nticks;
+	curcpu->c_tickless = true;
+	mainbus_timer_oneshot(nticks);
+}
+
+/*
+ * Called on an idle cpu with interrupts off, after it wakes up. If it
+ * was woken by something other than the timer, put the periodic tick
+ * back and make up the ticks that went by.
+ */
+void
+clock_unidle(void)
+{
+	unsigned nticks;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	if (!curcpu->c_tickless) {
+		return;
+	}
+	if (!mainbus_timer_periodic(&nticks)) {
+		/* The one-shot is pending; hardclock will handle it. */
+		return;
+	}
+	curcpu->c_tickless = false;
+	clock_advance(nticks);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sleeping.
+
+/*
+ * Suspend execution for NTICKS hardclock ticks.
+ */
+void
+clocksleep_ticks(unsigned nticks)
+{
+	spinlock_acquire(&sleep_lock);
+	while (wchan_sleep_timed(sleep_wchan, &sleep_lock, &nticks) == 0) {
+		/* Nobody wakes sleep_wchan, but keep going if we were */
+	}
+	spinlock_release(&sleep_lock);
 }
 
 /*
@@ -112,10 +460,7 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	if (num_secs > 0) {
+		clocksleep_ticks(num_secs * HZ);
 	}
-	spinlock_release(&lbolt_lock);
 }
@@ -0,0 +1,335 @@
+/*
+ * Lock profiling. See lockstat.h.
+ *
+ * Classes live in a fixed open-addressed hash table keyed by name;
+ * once a slot is given a name it keeps it, so a lock can hang on to
+ * its class pointer for life. If the table fills up, further names
+ * all share the "(other)" class. Each class has its own spinlock for
+ * its counters, so locks of different classes don't contend here.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <lockstat.h>
+
+#define LOCKSTAT_NCLASSES	128
+#define LOCKSTAT_NAMELEN	24
+#define LOCKSTAT_NSPINLOCKS	64
+
+struct lockstat_class {
+	char lc_name[LOCKSTAT_NAMELEN];	/* empty if the slot is free */
+	struct spinlock lc_lock;	/* protects the counters */
+	unsigned lc_nacquires;
+	unsigned lc_ncontended;
+	uint64_t lc_waitns;		/* total time spent waiting */
+	uint64_t lc_maxwaitns;
+	uint64_t lc_holdns;		/* total time held */
+	uint64_t lc_maxholdns;
+};
+
+struct lockstat_spin {
+	const char *ls_name;
+	struct spinlock *ls_lock;
+};
+
+volatile bool lockstat_enabled;
+
+/* Protects the class names and the spinlock list. */
+static struct spinlock lockstat_lock = SPINLOCK_INITIALIZER;
+static struct lockstat_class lockstat_classes[LOCKSTAT_NCLASSES];
+static struct lockstat_class lockstat_other = {
+	.lc_name = "(other)",
+	.lc_lock = SPINLOCK_INITIALIZER,
+};
+static struct lockstat_spin lockstat_spins[LOCKSTAT_NSPINLOCKS];
+static unsigned lockstat_nspins;
+
+////////////////////////////////////////////////////////////
+//
+// Recording
+
+/*
+ * Names longer than a class slot holds are cut short; the hash and
+ * the comparison only look at the part that fits.
+ */
+static
+unsigned
+lockstat_hash(const char *name)
+{
+	unsigned h = 5381;
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN-1 && name[i] != 0; i++) {
+		h = h * 33 + (unsigned char)name[i];
+	}
+	return h;
+}
+
+static
+void
+lockstat_setname(char *buf, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN-1 && name[i] != 0; i++) {
+		buf[i] = name[i];
+	}
+	buf[i] = 0;
+}
+
+static
+bool
+lockstat_samename(const char *buf, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN-1; i++) {
+		if (buf[i] != name[i]) {
+			return false;
+		}
+		if (buf[i] == 0) {
+			break;
+		}
+	}
+	return true;
+}
+
+struct lockstat_class *
+lockstat_getclass(const char *name)
+{
+	struct lockstat_class *lc;
+	unsigned h, i;
+
+	h = lockstat_hash(name);
+	spinlock_acquire(&lockstat_lock);
+	for (i=0; i<LOCKSTAT_NCLASSES; i++) {
+		lc = &lockstat_classes[(h + i) % LOCKSTAT_NCLASSES];
+		if (lc->lc_name[0] == 0) {
+			/* Not there; claim this slot for it. */
+			spinlock_init(&lc->lc_lock);
+			lockstat_setname(lc->lc_name, name);
+			spinlock_release(&lockstat_lock);
+			return lc;
+		}
+		if (lockstat_samename(lc->lc_name, name)) {
+			spinlock_release(&lockstat_lock);
+			return lc;
+		}
+	}
+	spinlock_release(&lockstat_lock);
+	return &lockstat_other;
+}
+
+uint64_t
+lockstat_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t
+lockstat_acquired(struct lockstat_class *lc, uint64_t start, bool contended)
+{
+	uint64_t now, wait;
+
+	now = lockstat_now();
+	wait = now - start;
+
+	spinlock_acquire(&lc->lc_lock);
+	lc->lc_nacquires++;
+	if (contended) {
+		lc->lc_ncontended++;
+	}
+	lc->lc_waitns += wait;
+	if (wait > lc->lc_maxwaitns) {
+		lc->lc_maxwaitns = wait;
+	}
+	spinlock_release(&lc->lc_lock);
+	return now;
+}
+
+void
+lockstat_released(struct lockstat_class *lc, uint64_t acquired)
+{
+	uint64_t hold;
+
+	hold = lockstat_now() - acquired;
+
+	spinlock_acquire(&lc->lc_lock);
+	lc->lc_holdns += hold;
+	if (hold > lc->lc_maxholdns) {
+		lc->lc_maxholdns = hold;
+	}
+	spinlock_release(&lc->lc_lock);
+}
+
+void
+lockstat_addspinlock(const char *name, struct spinlock *lk)
+{
+	spinlock_acquire(&lockstat_lock);
+	if (lockstat_nspins < LOCKSTAT_NSPINLOCKS) {
+		lockstat_spins[lockstat_nspins].ls_name = name;
+		lockstat_spins[lockstat_nspins].ls_lock = lk;
+		lockstat_nspins++;
+	}
+	spinlock_release(&lockstat_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Control and reporting
+
+void
+lockstat_start(void)
+{
+	lockstat_enabled = true;
+}
+
+void
+lockstat_stop(void)
+{
+	lockstat_enabled = false;
+}
+
+static
+void
+lockstat_zero(struct lockstat_class *lc)
+{
+	spinlock_acquire(&lc->lc_lock);
+	lc->lc_nacquires = 0;
+	lc->lc_ncontended = 0;
+	lc->lc_waitns = 0;
+	lc->lc_maxwaitns = 0;
+	lc->lc_holdns = 0;
+	lc->lc_maxholdns = 0;
+	spinlock_release(&lc->lc_lock);
+}
+
+void
+lockstat_reset(void)
+{
+	struct spinlock *lk;
+	unsigned i, n;
+
+	for (i=0; i<LOCKSTAT_NCLASSES; i++) {
+		if (lockstat_classes[i].lc_name[0] != 0) {
+			lockstat_zero(&lockstat_classes[i]);
+		}
+	}
+	lockstat_zero(&lockstat_other);
+
+	spinlock_acquire(&lockstat_lock);
+	n = lockstat_nspins;
+	spinlock_release(&lockstat_lock);
+
+	/* Entries never change once added, so no need to hold on. */
+	for (i=0; i<n; i++) {
+		lk = lockstat_spins[i].ls_lock;
+		spinlock_acquire(lk);
+		lk->splk_nacquires = 0;
+		lk->splk_ncontended = 0;
+		lk->splk_nspins = 0;
+		spinlock_release(lk);
+	}
+}
+
+static
+void
+lockstat_printclass(struct lockstat_class *lc)
+{
+	kprintf("%-24s %9u %9u %11llu %9llu %11llu %9llu\n",
+		lc->lc_name, lc->lc_nacquires, lc->lc_ncontended,
+		lc->lc_waitns / 1000, lc->lc_maxwaitns / 1000,
+		lc->lc_holdns / 1000, lc->lc_maxholdns / 1000);
+}
+
+/*
+ * Print the spinlocks, adding up the ones that share a name (such as
+ * the per-cpu run queue locks).
+ */
+static
+void
+lockstat_printspins(unsigned n)
+{
+	struct spinlock total;
+	struct spinlock *lk;
+	unsigned i, j;
+
+	for (i=0; i<n; i++) {
+		for (j=0; j<i; j++) {
+			if (!strcmp(lockstat_spins[j].ls_name,
+				    lockstat_spins[i].ls_name)) {
+				break;
+			}
+		}
+		if (j < i) {
+			/* Already printed with the first of its name. */
+			continue;
+		}
+
+		spinlock_init(&total);
+		for (j=i; j<n; j++) {
+			if (strcmp(lockstat_spins[j].ls_name,
+				   lockstat_spins[i].ls_name)) {
+				continue;
+			}
+			lk = lockstat_spins[j].ls_lock;
+			total.splk_nacquires += lk->splk_nacquires;
+			total.splk_ncontended += lk->splk_ncontended;
+			total.splk_nspins += lk->splk_nspins;
+		}
+		spinlock_printstats(lockstat_spins[i].ls_name, &total);
+	}
+}
+
+void
+lockstat_print(unsigned top)
+{
+	struct lockstat_class *lc, *best;
+	bool printed[LOCKSTAT_NCLASSES];
+	unsigned i, k, n;
+
+	kprintf("Lock profiling is %s.\n", lockstat_enabled ? "on" : "off");
+	kprintf("%-24s %9s %9s %11s %9s %11s %9s\n", "lock", "acquires",
+		"contended", "wait us", "max", "hold us", "max");
+
+	/*
+	 * Pick out the classes with the most wait time, one at a time;
+	 * there aren't enough of them for sorting to be worth it.
+	 */
+	bzero(printed, sizeof(printed));
+	for (k=0; k<top; k++) {
+		best = NULL;
+		n = 0;
+		for (i=0; i<LOCKSTAT_NCLASSES; i++) {
+			lc = &lockstat_classes[i];
+			if (printed[i] || lc->lc_name[0] == 0 ||
+			    lc->lc_nacquires == 0) {
+				continue;
+			}
+			if (best == NULL || lc->lc_waitns > best->lc_waitns) {
+				best = lc;
+				n = i;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		printed[n] = true;
+		lockstat_printclass(best);
+	}
+	if (lockstat_other.lc_nacquires > 0) {
+		lockstat_printclass(&lockstat_other);
+	}
+
+	spinlock_acquire(&lockstat_lock);
+	n = lockstat_nspins;
+	spinlock_release(&lockstat_lock);
+
+	kprintf("Spinlocks:\n");
+	lockstat_printspins(n);
+}
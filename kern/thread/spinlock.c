@@ -50,8 +50,12 @@
 void
 spinlock_init(struct spinlock *splk)
 {
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_next, 0);
+	spinlock_data_set(&splk->splk_serving, 0);
 	splk->splk_holder = NULL;
+	splk->splk_nacquires = 0;
+	splk->splk_ncontended = 0;
+	splk->splk_nspins = 0;
 }
 
 /*
@@ -61,7 +65,8 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(spinlock_data_get(&splk->splk_next) ==
+		spinlock_data_get(&splk->splk_serving));
 }
 
 /*
@@ -69,12 +74,14 @@ spinlock_cleanup(struct spinlock *splk)
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
  * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * atomic operation to take a ticket, and wait for it to be served.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+	unsigned spins;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -90,28 +97,24 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
-		}
-		break;
+	/*
+	 * Taking a ticket is the only atomic operation; after that
+	 * we only read splk_serving, which changes just once per
+	 * release, so waiting doesn't keep the bus busy.
+	 */
+	ticket = spinlock_data_fetchinc(&splk->splk_next);
+	spins = 0;
+	while (spinlock_data_get(&splk->splk_serving) != ticket) {
+		spins++;
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+	splk->splk_nacquires++;
+	if (spins > 0) {
+		splk->splk_ncontended++;
+		splk->splk_nspins += spins;
+	}
 }
 
 /*
@@ -129,7 +132,9 @@ spinlock_release(struct spinlock *splk)
 
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	/* Only the holder changes splk_serving, so no atomic op needed. */
+	spinlock_data_set(&splk->splk_serving,
+			  spinlock_data_get(&splk->splk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -146,3 +151,15 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Print the lock's counters. They're read without the lock, so they
+ * may be a little out of step with each other.
+ */
+void
+spinlock_printstats(const char *name, struct spinlock *splk)
+{
+	kprintf("%-16s %10u acquires %10u contended %12u spins\n", name,
+		splk->splk_nacquires, splk->splk_ncontended,
+		splk->splk_nspins);
+}
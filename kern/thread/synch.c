@@ -33,13 +33,25 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <cpu.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <objcache.h>
 #include <synch.h>
 
+static struct objcache sem_cache =
+	OBJCACHE_INITIALIZER("semaphore", sizeof(struct semaphore), NULL);
+static struct objcache lock_cache =
+	OBJCACHE_INITIALIZER("lock", sizeof(struct lock), NULL);
+static struct objcache cv_cache =
+	OBJCACHE_INITIALIZER("cv", sizeof(struct cv), NULL);
+static struct objcache rwlock_cache =
+	OBJCACHE_INITIALIZER("rwlock", sizeof(struct rwlock), NULL);
+
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
@@ -49,7 +61,7 @@ sem_create(const char *name, unsigned initial_count)
 {
 	struct semaphore *sem;
 
-	sem = kmalloc(sizeof(*sem));
+	sem = objcache_alloc(&sem_cache);
 	if (sem == NULL)
 	{
 		return NULL;
@@ -58,7 +70,7 @@ sem_create(const char *name, unsigned initial_count)
 	sem->sem_name = kstrdup(name);
 	if (sem->sem_name == NULL)
 	{
-		kfree(sem);
+		objcache_free(&sem_cache, sem);
 		return NULL;
 	}
 
@@ -66,7 +78,7 @@ sem_create(const char *name, unsigned initial_count)
 	if (sem->sem_wchan == NULL)
 	{
 		kfree(sem->sem_name);
-		kfree(sem);
+		objcache_free(&sem_cache, sem);
 		return NULL;
 	}
 
@@ -84,7 +96,7 @@ void sem_destroy(struct semaphore *sem)
 	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
 	kfree(sem->sem_name);
-	kfree(sem);
+	objcache_free(&sem_cache, sem);
 }
 
 void P(struct semaphore *sem)
@@ -122,6 +134,31 @@ void P(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+int P_timed(struct semaphore *sem, unsigned ticks)
+{
+	int result;
+
+	KASSERT(sem != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&sem->sem_lock);
+	while (sem->sem_count == 0)
+	{
+		/* Someone else may get in first after a wakeup; go again. */
+		result = wchan_sleep_timed(sem->sem_wchan, &sem->sem_lock,
+					   &ticks);
+		if (result && sem->sem_count == 0)
+		{
+			spinlock_release(&sem->sem_lock);
+			return result;
+		}
+	}
+	KASSERT(sem->sem_count > 0);
+	sem->sem_count--;
+	spinlock_release(&sem->sem_lock);
+	return 0;
+}
+
 void V(struct semaphore *sem)
 {
 	KASSERT(sem != NULL);
@@ -138,13 +175,28 @@ void V(struct semaphore *sem)
 ////////////////////////////////////////////////////////////
 //
 // Lock.
+//
+//    Locks are adaptive: a thread that finds the lock held by a thread
+//    running on another cpu spins for a while, since the owner is
+//    likely to let go before a context switch would even finish. It
+//    only goes to sleep once the owner is not running or it has spun
+//    LOCK_SPINMAX times. lk_nwaiters lets lock_release skip the
+//    wakeup when nobody is asleep.
+//
+//    The spinning thread looks at the owner's t_state without any
+//    lock, so the owner may have released the lock and even exited by
+//    then. That is harmless: threads come from an object cache, so
+//    the memory is still there, and a stale answer only costs a
+//    little spinning or an early sleep.
+
+#define LOCK_SPINMAX	1000
 
 struct lock *
 lock_create(const char *name)
 {
 	struct lock *lock;
 
-	lock = kmalloc(sizeof(struct lock));
+	lock = objcache_alloc(&lock_cache);
 	if (lock == NULL)
 	{
 		return NULL;
@@ -153,7 +205,7 @@ lock_create(const char *name)
 	lock->lk_name = kstrdup(name);
 	if (lock->lk_name == NULL)
 	{
-		kfree(lock);
+		objcache_free(&lock_cache, lock);
 		return NULL;
 	}
 
@@ -162,12 +214,17 @@ lock_create(const char *name)
 	if (lock->lk_wchan == NULL)
 	{
 		kfree(lock->lk_name);
-		kfree(lock);
+		objcache_free(&lock_cache, lock);
 		return NULL; //TODO : search the correct error to throw
 	}
 	spinlock_init(&lock->lk_lock);
 	lock->lk_owner = NULL;
 	lock->lk_flag = false;
+	lock->lk_nwaiters = 0;
+#if OPT_LOCKSTAT
+	lock->lk_stat = lockstat_getclass(name);
+	lock->lk_stamp = 0;
+#endif
 
 #endif
 	return lock;
@@ -183,20 +240,73 @@ void lock_destroy(struct lock *lock)
 	spinlock_cleanup(&lock->lk_lock);
 #endif
 	kfree(lock->lk_name);
-	kfree(lock);
+	objcache_free(&lock_cache, lock);
+}
+
+#if OPT_SYNCH
+/*
+ * Called with lk_lock held and the lock taken. If the owner is
+ * running (on another cpu, since we are running here), drop lk_lock
+ * and spin until it lets go or stops running, for at most *SPINS
+ * turns; then take lk_lock again. Returns true if it spun, in which
+ * case the caller should look at the lock again.
+ */
+static
+bool
+lock_spin(struct lock *lock, unsigned *spins)
+{
+	volatile struct thread *owner;
+
+	owner = lock->lk_owner;
+	if (*spins == 0 || owner->t_state != S_RUN)
+	{
+		return false;
+	}
+	spinlock_release(&lock->lk_lock);
+	while (*spins > 0 && lock->lk_owner == owner &&
+	       owner->t_state == S_RUN)
+	{
+		(*spins)--;
+	}
+	spinlock_acquire(&lock->lk_lock);
+	return true;
 }
+#endif
 
 void lock_acquire(struct lock *lock)
 {
 
 #if OPT_SYNCH
+	unsigned spins;
+#if OPT_LOCKSTAT
+	uint64_t start = 0;
+	bool contended = false;
+
+	if (lockstat_enabled)
+	{
+		start = lockstat_now();
+	}
+#endif
+
 	KASSERT(lock != NULL); // DEBUG
 	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(lock->lk_owner != curthread);
 
+	spins = LOCK_SPINMAX;
 	spinlock_acquire(&lock->lk_lock);
-	while (lock->lk_owner != NULL && lock->lk_flag == true)
+	while (lock->lk_owner != NULL)
 	{
+#if OPT_LOCKSTAT
+		contended = true;
+#endif
+		if (lock_spin(lock, &spins))
+		{
+			continue;
+		}
+		lock->lk_nwaiters++;
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+		lock->lk_nwaiters--;
+		spins = LOCK_SPINMAX;
 	}
 
 	KASSERT(lock->lk_owner == NULL);
@@ -205,6 +315,16 @@ void lock_acquire(struct lock *lock)
 	lock->lk_owner = curthread;
 	spinlock_release(&lock->lk_lock);
 
+#if OPT_LOCKSTAT
+	/* We own it now, so lk_stamp is ours to set. */
+	lock->lk_stamp = 0;
+	if (start != 0)
+	{
+		lock->lk_stamp = lockstat_acquired(lock->lk_stat, start,
+						   contended);
+	}
+#endif
+
 #endif
 	(void)lock; // suppress warning until code gets written
 }
@@ -218,12 +338,23 @@ void lock_release(struct lock *lock)
 	KASSERT(lock->lk_owner == curthread);
 	KASSERT(lock->lk_flag == true);
 
+#if OPT_LOCKSTAT
+	if (lock->lk_stamp != 0 && lockstat_enabled)
+	{
+		lockstat_released(lock->lk_stat, lock->lk_stamp);
+	}
+	lock->lk_stamp = 0;
+#endif
+
 	spinlock_acquire(&lock->lk_lock);
 
 	lock->lk_owner = NULL;
 	lock->lk_flag = false;
 
-	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+	if (lock->lk_nwaiters > 0)
+	{
+		wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+	}
 
 	spinlock_release(&lock->lk_lock);
 
@@ -254,7 +385,7 @@ cv_create(const char *name)
 {
 	struct cv *cv;
 
-	cv = kmalloc(sizeof(*cv));
+	cv = objcache_alloc(&cv_cache);
 	if (cv == NULL)
 	{
 		return NULL;
@@ -263,7 +394,7 @@ cv_create(const char *name)
 	cv->cv_name = kstrdup(name);
 	if (cv->cv_name == NULL)
 	{
-		kfree(cv);
+		objcache_free(&cv_cache, cv);
 		return NULL;
 	}
 
@@ -273,7 +404,7 @@ cv_create(const char *name)
 	if (cv->cv_wchan == NULL)
 	{
 		kfree(cv->cv_name);
-		kfree(cv);
+		objcache_free(&cv_cache, cv);
 		return NULL;
 	}
 	spinlock_init(&cv->cv_lock);
@@ -291,7 +422,7 @@ void cv_destroy(struct cv *cv)
 	wchan_destroy(cv->cv_wchan);
 #endif
 	kfree(cv->cv_name);
-	kfree(cv);
+	objcache_free(&cv_cache, cv);
 }
 
 void cv_wait(struct cv *cv, struct lock *lock)
@@ -314,6 +445,28 @@ void cv_wait(struct cv *cv, struct lock *lock)
 	(void)lock; // suppress warning until code gets written
 }
 
+int cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks)
+{
+	int result = 0;
+
+#if OPT_SYNCH
+	KASSERT(lock != NULL);
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	spinlock_acquire(&cv->cv_lock);
+	lock_release(lock);
+	result = wchan_sleep_timed(cv->cv_wchan, &cv->cv_lock, &ticks);
+	spinlock_release(&cv->cv_lock);
+
+	lock_acquire(lock);
+#endif
+	(void)cv;
+	(void)lock;
+	(void)ticks;
+	return result;
+}
+
 void cv_signal(struct cv *cv, struct lock *lock)
 {
 	// Write this
@@ -344,3 +497,291 @@ void cv_broadcast(struct cv *cv, struct lock *lock)
 	(void)cv;	// suppress warning until code gets written
 	(void)lock; // suppress warning until code gets written
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+//
+//    rw_lock protects everything but the per-cpu counters. Readers
+//    wait on rw_rwchan while there is a writer in or waiting; writers
+//    wait on rw_wwchan for the readers and any other writer to leave.
+//
+//    In the per-cpu variant, readers count themselves in the
+//    rwlock_cpu for whatever cpu they happen to be on, under that
+//    counter's own spinlock, instead of in rw_nreaders. A reader may
+//    come in on one cpu and leave on another, so one counter can go
+//    negative; only the sum means anything. A reader that sees no
+//    writer in or waiting (looking under its counter's lock) goes
+//    straight in without touching rw_lock. A writer first counts
+//    itself in rw_nwriters, so any reader that gets a counter lock
+//    after that takes the slow path, and then adds up the counters.
+//    After that point counters only go down, so the sum can come out
+//    too high, never too low; a high sum only makes the writer wait
+//    for the next wakeup.
+
+/* Counters for cpus beyond this many share slots. */
+#define RWLOCK_MAXCPUS	32
+
+/* Keep each counter on its own cache line. */
+#define RWLOCK_LINE	64
+
+struct rwlock_cpu {
+	struct spinlock rc_lock;
+	int rc_nreaders;
+	char rc_pad[RWLOCK_LINE - sizeof(struct spinlock) - sizeof(int)];
+};
+
+static
+struct rwlock *
+rwlock_create_common(const char *name, bool percpu)
+{
+	struct rwlock *rw;
+	unsigned i;
+
+	rw = objcache_alloc(&rwlock_cache);
+	if (rw == NULL)
+	{
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL)
+	{
+		goto fail;
+	}
+	rw->rw_rwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_rwchan == NULL)
+	{
+		goto fail_name;
+	}
+	rw->rw_wwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_wwchan == NULL)
+	{
+		goto fail_rwchan;
+	}
+
+	rw->rw_percpu = NULL;
+	if (percpu)
+	{
+		rw->rw_percpu = kmalloc(RWLOCK_MAXCPUS *
+					sizeof(struct rwlock_cpu));
+		if (rw->rw_percpu == NULL)
+		{
+			goto fail_wwchan;
+		}
+		for (i = 0; i < RWLOCK_MAXCPUS; i++)
+		{
+			spinlock_init(&rw->rw_percpu[i].rc_lock);
+			rw->rw_percpu[i].rc_nreaders = 0;
+		}
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_nreaders = 0;
+	rw->rw_nwriters = 0;
+	rw->rw_writer = NULL;
+	return rw;
+
+ fail_wwchan:
+	wchan_destroy(rw->rw_wwchan);
+ fail_rwchan:
+	wchan_destroy(rw->rw_rwchan);
+ fail_name:
+	kfree(rw->rwlock_name);
+ fail:
+	objcache_free(&rwlock_cache, rw);
+	return NULL;
+}
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	return rwlock_create_common(name, false);
+}
+
+struct rwlock *
+rwlock_create_percpu(const char *name)
+{
+	return rwlock_create_common(name, true);
+}
+
+void rwlock_destroy(struct rwlock *rw)
+{
+	unsigned i;
+	int sum;
+
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_nreaders == 0);
+
+	if (rw->rw_percpu != NULL)
+	{
+		/* Readers can move cpus, so only the sum has to be 0. */
+		sum = 0;
+		for (i = 0; i < RWLOCK_MAXCPUS; i++)
+		{
+			sum += rw->rw_percpu[i].rc_nreaders;
+			spinlock_cleanup(&rw->rw_percpu[i].rc_lock);
+		}
+		KASSERT(sum == 0);
+		kfree(rw->rw_percpu);
+	}
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_wwchan);
+	wchan_destroy(rw->rw_rwchan);
+	kfree(rw->rwlock_name);
+	objcache_free(&rwlock_cache, rw);
+}
+
+/*
+ * The counter for the cpu we're on. If we move before locking it,
+ * we just use some other cpu's counter, which is still correct.
+ */
+static
+struct rwlock_cpu *
+rwlock_mycpu(struct rwlock *rw)
+{
+	return &rw->rw_percpu[curcpu->c_number % RWLOCK_MAXCPUS];
+}
+
+/*
+ * Whether any reader is in. Called with rw_lock held.
+ */
+static
+bool
+rwlock_readers(struct rwlock *rw)
+{
+	struct rwlock_cpu *rc;
+	int sum;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&rw->rw_lock));
+
+	if (rw->rw_percpu == NULL)
+	{
+		return rw->rw_nreaders > 0;
+	}
+	sum = 0;
+	for (i = 0; i < RWLOCK_MAXCPUS; i++)
+	{
+		rc = &rw->rw_percpu[i];
+		spinlock_acquire(&rc->rc_lock);
+		sum += rc->rc_nreaders;
+		spinlock_release(&rc->rc_lock);
+	}
+	KASSERT(sum >= 0);
+	return sum > 0;
+}
+
+void rwlock_acquire_read(struct rwlock *rw)
+{
+	struct rwlock_cpu *rc;
+
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	if (rw->rw_percpu != NULL)
+	{
+		/*
+		 * Fast path. rwlock_acquire_write sets rw_writer before
+		 * dropping rw_nwriters, so check in the other order.
+		 */
+		rc = rwlock_mycpu(rw);
+		spinlock_acquire(&rc->rc_lock);
+		if (rw->rw_nwriters == 0 && rw->rw_writer == NULL)
+		{
+			rc->rc_nreaders++;
+			spinlock_release(&rc->rc_lock);
+			return;
+		}
+		spinlock_release(&rc->rc_lock);
+	}
+
+	spinlock_acquire(&rw->rw_lock);
+	while (rw->rw_writer != NULL || rw->rw_nwriters > 0)
+	{
+		wchan_sleep(rw->rw_rwchan, &rw->rw_lock);
+	}
+	if (rw->rw_percpu != NULL)
+	{
+		rc = rwlock_mycpu(rw);
+		spinlock_acquire(&rc->rc_lock);
+		rc->rc_nreaders++;
+		spinlock_release(&rc->rc_lock);
+	}
+	else
+	{
+		rw->rw_nreaders++;
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void rwlock_release_read(struct rwlock *rw)
+{
+	struct rwlock_cpu *rc;
+	bool wake;
+
+	KASSERT(rw != NULL);
+
+	if (rw->rw_percpu != NULL)
+	{
+		rc = rwlock_mycpu(rw);
+		spinlock_acquire(&rc->rc_lock);
+		rc->rc_nreaders--;
+		wake = rw->rw_nwriters > 0;
+		spinlock_release(&rc->rc_lock);
+		if (wake)
+		{
+			/* The writer will add the counters up again. */
+			spinlock_acquire(&rw->rw_lock);
+			wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+			spinlock_release(&rw->rw_lock);
+		}
+		return;
+	}
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_nreaders > 0);
+	rw->rw_nreaders--;
+	if (rw->rw_nreaders == 0 && rw->rw_nwriters > 0)
+	{
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_nwriters++;
+	while (rw->rw_writer != NULL || rwlock_readers(rw))
+	{
+		wchan_sleep(rw->rw_wwchan, &rw->rw_lock);
+	}
+	rw->rw_writer = curthread;
+	rw->rw_nwriters--;
+	spinlock_release(&rw->rw_lock);
+}
+
+void rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_writer == curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	if (rw->rw_nwriters > 0)
+	{
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	else
+	{
+		wchan_wakeall(rw->rw_rwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
@@ -50,6 +50,9 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <clock.h>
+#include <objcache.h>
+#include <lockstat.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -69,6 +72,36 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Object caches for threads and wait channels. The list node of a
+ * thread and the thread list of a wchan are left initialized when
+ * they are freed, so they are only set up once per object.
+ */
+static
+void
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+}
+
+static
+void
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_init(&wc->wc_threads);
+}
+
+static struct objcache thread_cache =
+	OBJCACHE_INITIALIZER("thread", sizeof(struct thread), thread_ctor);
+static struct objcache wchan_cache =
+	OBJCACHE_INITIALIZER("wchan", sizeof(struct wchan), wchan_ctor);
+
+static void wchan_timeout(void *data);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -120,14 +153,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = objcache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		objcache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -135,12 +168,25 @@ thread_create(const char *name)
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
+	/* t_listnode is set up by thread_ctor */
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 
+	/* Scheduling fields: new threads start at the top */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_lastran = 0;
+	thread->t_lastmigrate = 0;
+
+	/* Timed sleep fields */
+	timer_init(&thread->t_timer, wchan_timeout, thread);
+	thread->t_sleepwc = NULL;
+	thread->t_sleeplk = NULL;
+	thread->t_timedout = false;
+	thread->t_timerbusy = false;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -165,6 +211,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -177,11 +224,25 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_timerwheel = timerwheel_create();
+	if (c->c_timerwheel == NULL) {
+		panic("cpu_create: Out of memory\n");
+	}
+	c->c_tickless = false;
+	c->c_idleticks = 0;
+	c->c_tlb_asid = 0;
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NPRIO; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_nrunnable = 0;
 	spinlock_init(&c->c_runqueue_lock);
+	lockstat_addspinlock("runqueue", &c->c_runqueue_lock);
+	c->c_nmigrated = 0;
+	c->c_nstealfails = 0;
+	bzero(&c->c_vmstats, sizeof(c->c_vmstats));
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -263,6 +324,7 @@ thread_destroy(struct thread *thread)
 {
 	KASSERT(thread != curthread);
 	KASSERT(thread->t_state != S_RUN);
+	KASSERT(!thread->t_timerbusy);
 
 	/*
 	 * If you add things to struct thread, be sure to clean them up
@@ -281,7 +343,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	objcache_free(&thread_cache, thread);
 }
 
 /*
@@ -311,6 +373,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *tl;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -325,9 +390,13 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_NPRIO; i++) {
+		tl = &curcpu->c_runqueue[i];
+		tl->tl_count = 0;
+		tl->tl_head.tln_next = &tl->tl_tail;
+		tl->tl_tail.tln_prev = &tl->tl_head;
+	}
+	curcpu->c_nrunnable = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -439,6 +508,74 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Migration tuning, in hardclocks; see thread_consider_migration.
+ * A thread that has run within SCHED_CACHEHOT is assumed to still
+ * have its working set in its cpu's cache, and a thread is migrated
+ * at most once per SCHED_MIGRATE_INTERVAL.
+ */
+#define SCHED_CACHEHOT		2
+#define SCHED_MIGRATE_INTERVAL	10
+
+/*
+ * Run queue operations. Each cpu has one run queue per priority;
+ * threads are put on the tail of the queue for their priority, and
+ * taken from the head of the highest-priority queue that has any.
+ * The cpu's run queue lock must be held.
+ */
+static
+void
+runqueue_addtail(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_priority < SCHED_NPRIO);
+
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_nrunnable++;
+}
+
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<SCHED_NPRIO; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_nrunnable--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static bool thread_steal(unsigned minwaiting, bool hotok);
+
+/*
+ * Wake up one idle cpu other than BUSY and ourselves, if there is
+ * one, so it can take a thread from BUSY. c_isidle is only a hint
+ * here.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -463,7 +600,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_addtail(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -472,6 +609,13 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (targetcpu->c_nrunnable > 1) {
+		/*
+		 * Idle cpus don't take timer ticks, so they won't come
+		 * looking for work on their own; poke one to steal.
+		 */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -517,6 +661,11 @@ thread_fork(const char *name,
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
 
+	/* A new thread has no cache state anywhere; let it move at once. */
+	newthread->t_lastran = curcpu->c_hardclocks - SCHED_CACHEHOT;
+	newthread->t_lastmigrate =
+		curcpu->c_hardclocks - SCHED_MIGRATE_INTERVAL;
+
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
 		proc = curthread->t_proc;
@@ -585,12 +734,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_nrunnable == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* Note when it last ran here, for migration decisions. */
+	cur->t_lastran = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -633,15 +785,23 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before idling, try to take work from another cpu. This is
+	 * retried every time we come out of cpu_idle. While idle the
+	 * periodic timer tick is turned off; see clock_idle.
 	 */
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal(1, true)) {
+				clock_idle();
+				cpu_idle();
+				clock_unidle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -811,139 +971,275 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multilevel feedback queue. A thread at priority P runs
+ * for up to SCHED_QUANTUM(P) hardclocks before it has to yield; if it
+ * uses the whole slice it drops a priority, so CPU-bound threads sink
+ * to the bottom queue with long slices. A thread that goes to sleep
+ * and is woken moves up a priority, so threads that mostly wait (the
+ * shell, anything doing console I/O) stay near the top and get the
+ * CPU as soon as they want it. A running thread is also preempted at
+ * the next tick when a thread of higher priority is waiting.
+ *
+ * So that CPU-bound threads can't be starved, schedule() puts
+ * everything back at the top periodically.
  */
 
+#define SCHED_QUANTUM(prio) (1U << (prio))
+
+/*
+ * Raise the priority of a thread being woken up. The thread is on no
+ * run queue, so the caller's wchan lock is enough.
+ */
+static
+void
+thread_wakeboost(struct thread *t)
+{
+	if (t->t_priority > 0) {
+		t->t_priority--;
+	}
+	t->t_ticks = 0;
+}
+
+/*
+ * Charge the current thread for a hardclock. Called from hardclock()
+ * with interrupts off; returns true if the thread should yield.
+ */
+bool
+thread_tick(void)
+{
+	struct thread *cur;
+	unsigned i;
+	bool preempt;
+
+	/* Nobody to charge while idle; curthread is asleep. */
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	cur = curthread;
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		if (cur->t_priority < SCHED_NPRIO - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		return true;
+	}
+
+	preempt = false;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=0; i<cur->t_priority; i++) {
+		if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+			preempt = true;
+			break;
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return preempt;
+}
+
+/*
+ * This is called periodically from hardclock(). Move every thread on
+ * the current CPU's run queues, and the current thread, back to the
+ * top priority.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+	unsigned i;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NPRIO; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Load balancing is done by pulling: a cpu that has nothing to run
+ * takes a thread from the cpu with the most threads waiting, and
+ * every MIGRATE_HARDCLOCKS a cpu whose run queues are well below the
+ * busiest one's takes one too. Nobody pushes threads away, so a busy
+ * cpu never spends time finding takers, and only one runqueue lock
+ * is held at a time.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * which is fairly slow. So the thief looks for a thread that hasn't
+ * run for a while (t_lastran, on its old cpu's clock) and takes a
+ * cache-hot one only if it would otherwise idle. A thread that has
+ * just been migrated (t_lastmigrate) isn't moved again for
+ * SCHED_MIGRATE_INTERVAL hardclocks, so threads don't bounce between
+ * cpus. Threads stay on the cpu they last ran on otherwise, including
+ * when they wake up.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Timestamps are hardclock counts of the cpu the thread is on; the
+ * thief stamps t_lastmigrate with its own clock, which is the one
+ * the thread's next thief will compare against.
  */
-void
-thread_consider_migration(void)
+
+/*
+ * Return true if T may be taken from cpu C. Cold threads only unless
+ * HOTOK.
+ */
+static
+bool
+thread_stealable(struct cpu *c, struct thread *t, bool hotok)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	/*
+	 * Ordinarily, c's curthread will not appear on its run queue.
+	 * However, it can if it went to sleep, the processor became
+	 * idle so it remained curthread, and it was reawakened before
+	 * the processor has fully unidled. Migrating it would then
+	 * have two cpus running on its stack.
+	 */
+	if (t == c->c_curthread) {
+		return false;
+	}
+	if (c->c_hardclocks - t->t_lastmigrate < SCHED_MIGRATE_INTERVAL) {
+		return false;
+	}
+	if (!hotok && c->c_hardclocks - t->t_lastran < SCHED_CACHEHOT) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Find a thread to take from cpu C, looking from the one that would
+ * run last.
+ */
+static
+struct thread *
+runqueue_findstealable(struct cpu *c, bool hotok)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
 	struct thread *t;
+	unsigned i;
 
-	my_count = total_count = 0;
+	for (i=SCHED_NPRIO; i-- > 0; ) {
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
+			if (thread_stealable(c, t, hotok)) {
+				return t;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Pull a thread from the other cpu with the most threads waiting, if
+ * that is at least MINWAITING. Cold threads are preferred; cache-hot
+ * ones are taken only if HOTOK. Returns true if a thread was moved onto
+ * our run queue. Called with no runqueue lock held.
+ */
+static
+bool
+thread_steal(unsigned minwaiting, bool hotok)
+{
+	struct cpu *c, *victim;
+	struct thread *found;
+	unsigned i, numcpus, most, n;
+
+	KASSERT(!spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	/* Find the busiest cpu. The counts are only a hint. */
+	victim = NULL;
+	most = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			continue;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+		n = c->c_nrunnable;
+		if (n >= minwaiting && n > most) {
+			victim = c;
+			most = n;
+		}
+	}
+	if (victim == NULL) {
+		return false;
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	found = runqueue_findstealable(victim, false);
+	if (found == NULL && hotok) {
+		found = runqueue_findstealable(victim, true);
+	}
+	if (found != NULL) {
+		threadlist_remove(&victim->c_runqueue[found->t_priority],
+				  found);
+		victim->c_nrunnable--;
 	}
+	spinlock_release(&victim->c_runqueue_lock);
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	if (found == NULL) {
+		curcpu->c_nstealfails++;
+		return false;
 	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	found->t_cpu = curcpu->c_self;
+	found->t_lastmigrate = curcpu->c_hardclocks;
+	found->t_lastran = curcpu->c_hardclocks;
+	runqueue_addtail(curcpu, found);
+	curcpu->c_nmigrated++;
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+	DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u\n",
+	      found->t_name, victim->c_number, curcpu->c_number);
+	return true;
+}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+/*
+ * Called periodically from hardclock(). If some other cpu has at
+ * least two more threads waiting than we do, take one of its cold
+ * ones.
+ */
+void
+thread_consider_migration(void)
+{
+	(void)thread_steal(curcpu->c_nrunnable + 2, false);
+}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+/*
+ * Print per-cpu migration counts.
+ */
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i;
+	char name[16];
+
+	kprintf("cpu  runnable  migrated in  failed steals\n");
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("%3u  %8u  %11u  %13u\n", c->c_number,
+			c->c_nrunnable, c->c_nmigrated, c->c_nstealfails);
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	kprintf("Run queue locks:\n");
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		snprintf(name, sizeof(name), "cpu%u", c->c_number);
+		spinlock_printstats(name, &c->c_runqueue_lock);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -965,11 +1261,11 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = objcache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
+	/* wc_threads is set up by wchan_ctor */
 	wc->wc_name = name;
 
 	return wc;
@@ -983,7 +1279,7 @@ void
 wchan_destroy(struct wchan *wc)
 {
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	objcache_free(&wchan_cache, wc);
 }
 
 /*
@@ -1009,6 +1305,77 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(lk);
 }
 
+/*
+ * Timer function for wchan_sleep_timed. If the thread is still on
+ * its wait channel, take it off and make it runnable. The thread may
+ * go away as soon as t_timerbusy is cleared, so that comes last.
+ */
+static
+void
+wchan_timeout(void *data)
+{
+	struct thread *target = data;
+	struct spinlock *lk = target->t_sleeplk;
+
+	spinlock_acquire(lk);
+	if (target->t_sleepwc != NULL) {
+		threadlist_remove(&target->t_sleepwc->wc_threads, target);
+		target->t_sleepwc = NULL;
+		target->t_timedout = true;
+		thread_wakeboost(target);
+		thread_make_runnable(target, false);
+	}
+	spinlock_release(lk);
+	target->t_timerbusy = false;
+}
+
+/*
+ * Sleep on WC as wchan_sleep does, for at most *TICKS hardclocks.
+ * The thread's own timer is started before it goes on the channel;
+ * whichever of the timer and wchan_wake* gets LK first takes it off.
+ */
+int
+wchan_sleep_timed(struct wchan *wc, struct spinlock *lk, unsigned *ticks)
+{
+	struct thread *cur = curthread;
+	unsigned left;
+
+	KASSERT(!cur->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(lk));
+	KASSERT(curcpu->c_spinlocks == 1);
+
+	if (*ticks == 0) {
+		return ETIMEDOUT;
+	}
+
+	cur->t_sleepwc = wc;
+	cur->t_sleeplk = lk;
+	cur->t_timedout = false;
+	cur->t_timerbusy = true;
+	timer_start(&cur->t_timer, *ticks);
+
+	thread_switch(S_SLEEP, wc, lk);
+
+	left = timer_stop(&cur->t_timer);
+	if (left == 0) {
+		/*
+		 * Too late to cancel: wchan_timeout has run or is
+		 * running on another cpu. Wait for it to let go.
+		 */
+		while (cur->t_timerbusy) {
+			/* spin */
+		}
+	}
+	else {
+		cur->t_timerbusy = false;
+	}
+	*ticks = left;
+
+	spinlock_acquire(lk);
+	KASSERT(cur->t_sleepwc == NULL);
+	return cur->t_timedout ? ETIMEDOUT : 0;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1026,6 +1393,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 		/* Nobody was sleeping. */
 		return;
 	}
+	target->t_sleepwc = NULL;
 
 	/*
 	 * Note that thread_make_runnable acquires a runqueue lock
@@ -1035,6 +1403,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
+	thread_wakeboost(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1056,6 +1425,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * private list.
 	 */
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		target->t_sleepwc = NULL;
 		threadlist_addtail(&list, target);
 	}
 
@@ -1065,6 +1435,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_wakeboost(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1157,6 +1528,54 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown IPI to all other CPUs whose TLB belongs to
+ * address space ASID. Returns the number sent.
+ *
+ * A CPU whose TLB belongs to something else can be skipped even if
+ * it is about to switch to ASID, because switching flushes the TLB.
+ */
+unsigned
+ipi_tlbshootdown_asid(uint32_t asid, const struct tlbshootdown *mapping)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_tlb_asid == asid) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Add up the VM counters. They are read without stopping the other
+ * cpus, so the totals are only a snapshot.
+ */
+void
+cpu_sumvmstats(struct cpu_vmstats *sum)
+{
+	unsigned i;
+	struct cpu *c;
+
+	bzero(sum, sizeof(*sum));
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		sum->vs_nfaults += c->c_vmstats.vs_nfaults;
+		sum->vs_ntlbrefills += c->c_vmstats.vs_ntlbrefills;
+		sum->vs_ntlbflushes += c->c_vmstats.vs_ntlbflushes;
+		sum->vs_ntlbkept += c->c_vmstats.vs_ntlbkept;
+		sum->vs_nshootdowns += c->c_vmstats.vs_nshootdowns;
+		sum->vs_nshootdownipis += c->c_vmstats.vs_nshootdownipis;
+		sum->vs_nshootdownflushes +=
+			c->c_vmstats.vs_nshootdownflushes;
+	}
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
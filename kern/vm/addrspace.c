@@ -1,199 +1,1082 @@
-// /*
-//  * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
-//  *	The President and Fellows of Harvard College.
-//  *
-//  * Redistribution and use in source and binary forms, with or without
-//  * modification, are permitted provided that the following conditions
-//  * are met:
-//  * 1. Redistributions of source code must retain the above copyright
-//  *    notice, this list of conditions and the following disclaimer.
-//  * 2. Redistributions in binary form must reproduce the above copyright
-//  *    notice, this list of conditions and the following disclaimer in the
-//  *    documentation and/or other materials provided with the distribution.
-//  * 3. Neither the name of the University nor the names of its contributors
-//  *    may be used to endorse or promote products derived from this software
-//  *    without specific prior written permission.
-//  *
-//  * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
-//  * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
-//  * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
-//  * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
-//  * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
-//  * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
-//  * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
-//  * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
-//  * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
-//  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
-//  * SUCH DAMAGE.
-//  */
-
-// #include <types.h>
-// #include <kern/errno.h>
-// #include <lib.h>
-// #include <addrspace.h>
-// #include <vm.h>
-// #include <proc.h>
-
-// /*
-//  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
-//  * assignment, this file is not compiled or linked or in any way
-//  * used. The cheesy hack versions in dumbvm.c are used instead.
-//  */
-
-// struct addrspace *
-// as_create(void)
-// {
-// 	struct addrspace *as;
-
-// 	as = kmalloc(sizeof(struct addrspace));
-// 	if (as == NULL) {
-// 		return NULL;
-// 	}
-
-// 	/*
-// 	 * Initialize as needed.
-// 	 */
-// #if OPT_SHELL
-// 	as->as_vbase1 = 0;
-// 	as->as_npages1 = 0;
-// 	as->as_pbase1 = 0;
-// 	as->as_vbase2 = 0;
-// 	as->as_npages2 = 0;
-// 	as->as_pbase1 = 0;
-// 	as->as_stackpbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;		
-// #endif 
-
-// 	return as;
-// }
-
-// int
-// as_copy(struct addrspace *old, struct addrspace **ret)
-// {
-// 	struct addrspace *newas;
-
-// 	newas = as_create();
-// 	if (newas==NULL) {
-// 		return ENOMEM;
-// 	}
-
-// 	/*
-// 	 * Write this.
-// 	 */
-// #if OPT_SHELL
-// 	newas->as_vbase1 = old->as_vbase1;
-// 	newas->as_npages1 = old->as_npages1;
-// 	newas->as_pbase1 = old->as_pbase1;
-// 	newas->as_vbase2 = old->as_vbase2;
-// 	newas->as_npages2 = old->as_npages2;
-// 	newas->as_pbase2 = old->as_pbase2;
-// 	newas->as_stackpbase = old->as_stackpbase;
-// #endif 
-// 	(void)old;
-
-// 	*ret = newas;
-// 	return 0;
-// }
-
-// void
-// as_destroy(struct addrspace *as)
-// {
-// 	/*
-// 	 * Clean up as needed.
-// 	 */
-
-// 	kfree(as);
-// }
-
-// void
-// as_activate(void)
-// {
-// 	struct addrspace *as;
-
-// 	as = proc_getas();
-// 	if (as == NULL) {
-// 		/*
-// 		 * Kernel thread without an address space; leave the
-// 		 * prior address space in place.
-// 		 */
-// 		return;
-// 	}
-
-// 	/*
-// 	 * Write this.
-// 	 */
-// }
-
-// void
-// as_deactivate(void)
-// {
-// 	/*
-// 	 * Write this. For many designs it won't need to actually do
-// 	 * anything. See proc.c for an explanation of why it (might)
-// 	 * be needed.
-// 	 */
-// }
-
-// /*
-//  * Set up a segment at virtual address VADDR of size MEMSIZE. The
-//  * segment in memory extends from VADDR up to (but not including)
-//  * VADDR+MEMSIZE.
-//  *
-//  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
-//  * write, or execute permission should be set on the segment. At the
-//  * moment, these are ignored. When you write the VM system, you may
-//  * want to implement them.
-//  */
-// int
-// as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
-// 		 int readable, int writeable, int executable)
-// {
-// 	/*
-// 	 * Write this.
-// 	 */
-
-// 	(void)as;
-// 	(void)vaddr;
-// 	(void)memsize;
-// 	(void)readable;
-// 	(void)writeable;
-// 	(void)executable;
-// 	return ENOSYS;
-// }
-
-// int
-// as_prepare_load(struct addrspace *as)
-// {
-// 	/*
-// 	 * Write this.
-// 	 */
-
-// 	(void)as;
-// 	return 0;
-// }
-
-// int
-// as_complete_load(struct addrspace *as)
-// {
-// 	/*
-// 	 * Write this.
-// 	 */
-
-// 	(void)as;
-// 	return 0;
-// }
-
-// int
-// as_define_stack(struct addrspace *as, vaddr_t *stackptr)
-// {
-// 	/*
-// 	 * Write this.
-// 	 */
-
-// 	(void)as;
-
-// 	/* Initial user-level stack pointer */
-// 	*stackptr = USERSTACK;
-
-// 	return 0;
-// }
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
 
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <array.h>
+#include <stat.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vnode.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <vm.h>
+
+/*
+ * Note! If OPT_DUMBVM is set, this file is not compiled or linked or
+ * in any way used. The cheesy hack versions in dumbvm.c are used
+ * instead.
+ *
+ * Address spaces are demand-paged: defining a region only records
+ * it, and each page is allocated (and zero-filled or read from the
+ * executable) by as_fault the first time it is touched. Under memory
+ * pressure the pageout daemon takes pages away again with as_pageout;
+ * writable pages go to swap, read-only ones are simply dropped and
+ * rebuilt on the next fault.
+ *
+ * mmap regions are placed downwards from just below the stack, and
+ * the heap may not grow past the lowest of them. Shared mappings take
+ * their pages from the page cache (see pagecache.h) so that everyone
+ * mapping the file sees the same frames.
+ */
+
+/* The stack region is this many pages; only touched pages cost RAM. */
+#define VM_STACKPAGES    1024
+
+/* Source of as_id values. 0 is never handed out. */
+static struct spinlock as_id_lock = SPINLOCK_INITIALIZER;
+static uint32_t as_nextid = 1;
+
+////////////////////////////////////////////////////////////
+//
+// Regions
+
+static
+struct vm_region *
+region_create(vaddr_t base, size_t npages, int perms)
+{
+	struct vm_region *vr;
+
+	vr = kmalloc(sizeof(*vr));
+	if (vr == NULL) {
+		return NULL;
+	}
+	vr->vr_base = base;
+	vr->vr_npages = npages;
+	vr->vr_perms = perms;
+	vr->vr_vnode = NULL;
+	vr->vr_offset = 0;
+	vr->vr_filevaddr = 0;
+	vr->vr_filesize = 0;
+	vr->vr_mmap = 0;
+	return vr;
+}
+
+static
+void
+region_destroy(struct vm_region *vr)
+{
+	if (vr->vr_mmap == MAP_SHARED) {
+		pagecache_release(vr->vr_vnode);
+	}
+	if (vr->vr_vnode != NULL) {
+		VOP_DECREF(vr->vr_vnode);
+	}
+	kfree(vr);
+}
+
+static
+bool
+region_contains(struct vm_region *vr, vaddr_t vaddr)
+{
+	return vaddr >= vr->vr_base &&
+		vaddr - vr->vr_base < vr->vr_npages * PAGE_SIZE;
+}
+
+/*
+ * Return the MAP_SHARED region containing VADDR, or NULL.
+ */
+static
+struct vm_region *
+as_shared_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *vr;
+	unsigned i, num;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		vr = array_get(as->as_regions, i);
+		if (vr->vr_mmap == MAP_SHARED && region_contains(vr, vaddr)) {
+			return vr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Return the permissions for the page at VADDR: the union of those of
+ * every region containing it, or 0 if VADDR is not in any region.
+ */
+static
+int
+as_page_perms(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *vr;
+	unsigned i, num;
+	int perms;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	perms = 0;
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		vr = array_get(as->as_regions, i);
+		if (region_contains(vr, vaddr)) {
+			perms |= vr->vr_perms;
+		}
+	}
+	if (vaddr >= as->as_heapstart &&
+	    vaddr < ROUNDUP(as->as_heapend, PAGE_SIZE)) {
+		perms |= VR_READ | VR_WRITE;
+	}
+	return perms;
+}
+
+/*
+ * Fill in the contents of the page at VADDR, whose frame is PADDR:
+ * zeros, except for whatever file data any region maps onto it.
+ */
+static
+int
+as_fill_page(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	struct vm_region *vr;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	char *kva;
+	unsigned i, num;
+	int result;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	kva = (char *)PADDR_TO_KVADDR(paddr);
+	bzero(kva, PAGE_SIZE);
+
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		vr = array_get(as->as_regions, i);
+		if (vr->vr_vnode == NULL || vr->vr_filesize == 0) {
+			continue;
+		}
+
+		/* Part of a mapping may have been unmapped. */
+		start = vr->vr_filevaddr;
+		end = vr->vr_filevaddr + vr->vr_filesize;
+		if (start < vr->vr_base) {
+			start = vr->vr_base;
+		}
+		if (end > vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+			end = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		}
+		if (start < vaddr) {
+			start = vaddr;
+		}
+		if (end > vaddr + PAGE_SIZE) {
+			end = vaddr + PAGE_SIZE;
+		}
+		if (start >= end) {
+			continue;
+		}
+
+		uio_kinit(&iov, &ku, kva + (start - vaddr), end - start,
+			  vr->vr_offset + (start - vr->vr_filevaddr),
+			  UIO_READ);
+		result = VOP_READ(vr->vr_vnode, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			kprintf("vm: short read paging in 0x%x - "
+				"file truncated?\n", vaddr);
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Address spaces
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as;
+
+	as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL) {
+		return NULL;
+	}
+
+	as->as_regions = array_create();
+	if (as->as_regions == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		array_destroy(as->as_regions);
+		kfree(as);
+		return NULL;
+	}
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		pt_destroy(as->as_pt);
+		array_destroy(as->as_regions);
+		kfree(as);
+		return NULL;
+	}
+
+	spinlock_acquire(&as_id_lock);
+	as->as_id = as_nextid++;
+	spinlock_release(&as_id_lock);
+
+	as->as_heapstart = 0;
+	as->as_heapend = 0;
+	as->as_mmapbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+
+	return as;
+}
+
+/*
+ * Share one page of the parent with the child, copy-on-write: both
+ * PTEs point at the same frame with PTE_DIRTY clear, so the first
+ * write from either side takes a VM_FAULT_READONLY and gets a
+ * private copy (see as_fault). Swapped-out pages share the swap slot
+ * instead; each side reads in its own copy. Pages of MAP_SHARED
+ * regions stay shared: as_fault just marks them dirty again.
+ */
+static
+int
+as_copy_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	struct addrspace *newas = data;
+	pte_t *newpte;
+
+	if (!(*pte & (PTE_VALID | PTE_SWAPPED))) {
+		return 0;
+	}
+
+	newpte = pt_lookup(newas->as_pt, vaddr, true);
+	if (newpte == NULL) {
+		return ENOMEM;
+	}
+	if (*pte & PTE_SWAPPED) {
+		swap_share(PTE_SLOT(*pte));
+	}
+	else {
+		coremap_share(*pte & PTE_FRAME);
+		*pte &= ~PTE_DIRTY;
+	}
+	*newpte = *pte;
+	return 0;
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *newas;
+	struct vm_region *vr, *newvr;
+	unsigned i, num;
+	int result;
+
+	newas = as_create();
+	if (newas==NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(old->as_lock);
+
+	newas->as_heapstart = old->as_heapstart;
+	newas->as_heapend = old->as_heapend;
+	newas->as_mmapbase = old->as_mmapbase;
+
+	num = array_num(old->as_regions);
+	for (i=0; i<num; i++) {
+		vr = array_get(old->as_regions, i);
+		newvr = region_create(vr->vr_base, vr->vr_npages,
+				      vr->vr_perms);
+		if (newvr == NULL) {
+			lock_release(old->as_lock);
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		if (vr->vr_vnode != NULL) {
+			VOP_INCREF(vr->vr_vnode);
+			newvr->vr_vnode = vr->vr_vnode;
+			newvr->vr_offset = vr->vr_offset;
+			newvr->vr_filevaddr = vr->vr_filevaddr;
+			newvr->vr_filesize = vr->vr_filesize;
+		}
+		result = 0;
+		if (vr->vr_mmap == MAP_SHARED) {
+			result = pagecache_addmap(vr->vr_vnode);
+		}
+		if (result == 0) {
+			newvr->vr_mmap = vr->vr_mmap;
+			result = array_add(newas->as_regions, newvr, NULL);
+		}
+		if (result) {
+			region_destroy(newvr);
+			lock_release(old->as_lock);
+			as_destroy(newas);
+			return result;
+		}
+	}
+
+	result = pt_foreach(old->as_pt, as_copy_page, newas);
+
+	/*
+	 * The parent's pages are now read-only, so drop any writable
+	 * translations, wherever they are. Other CPUs the parent ran
+	 * on may still hold its translations even though it isn't
+	 * running there.
+	 */
+	vm_tlb_shootdown(old->as_id, TS_ALL);
+
+	lock_release(old->as_lock);
+
+	if (result) {
+		as_destroy(newas);
+		return result;
+	}
+
+	*ret = newas;
+	return 0;
+}
+
+static
+int
+as_free_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	(void)vaddr;
+	(void)data;
+
+	if (*pte & PTE_VALID) {
+		coremap_free(*pte & PTE_FRAME);
+	}
+	else if (*pte & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(*pte));
+	}
+	*pte = 0;
+	return 0;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	unsigned i, num;
+
+	/*
+	 * Freeing a frame clears its owner, so once our pages are gone
+	 * the pageout daemon can't pick us again; the lock keeps it
+	 * from paging one out underneath us meanwhile. Then wait for it
+	 * in case it already picked us and is waiting for the lock.
+	 */
+	lock_acquire(as->as_lock);
+	pt_foreach(as->as_pt, as_free_page, NULL);
+	lock_release(as->as_lock);
+	coremap_pageout_wait(as);
+
+	pt_destroy(as->as_pt);
+
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		region_destroy(array_get(as->as_regions, i));
+	}
+	array_setsize(as->as_regions, 0);
+	array_destroy(as->as_regions);
+
+	lock_destroy(as->as_lock);
+	kfree(as);
+}
+
+void
+as_activate(void)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * Kernel thread without an address space; leave the
+		 * prior address space in place.
+		 */
+		return;
+	}
+
+	vm_tlb_activate(as->as_id);
+}
+
+void
+as_deactivate(void)
+{
+	/*
+	 * Nothing to do: the TLB is only flushed when a different
+	 * address space is activated, and as_id values are never
+	 * reused, so translations left behind for a destroyed address
+	 * space can never be mistaken for anyone else's.
+	 */
+}
+
+/*
+ * Set up a segment at virtual address VADDR of size MEMSIZE. The
+ * segment in memory extends from VADDR up to (but not including)
+ * VADDR+MEMSIZE.
+ *
+ * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
+ * write, or execute permission should be set on the segment. Write
+ * permission is enforced through the TLB; read and execute are
+ * recorded but the MIPS cannot enforce them separately.
+ */
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+		 int readable, int writeable, int executable)
+{
+	struct vm_region *vr;
+	size_t npages;
+	int perms, result;
+
+	/* Align the region. First, the base... */
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
+	npages = memsize / PAGE_SIZE;
+
+	if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
+
+	perms = 0;
+	if (readable) {
+		perms |= VR_READ;
+	}
+	if (writeable) {
+		perms |= VR_WRITE;
+	}
+	if (executable) {
+		perms |= VR_EXEC;
+	}
+
+	vr = region_create(vaddr, npages, perms);
+	if (vr == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(as->as_lock);
+	result = array_add(as->as_regions, vr, NULL);
+	lock_release(as->as_lock);
+	if (result) {
+		region_destroy(vr);
+		return result;
+	}
+	return 0;
+}
+
+int
+as_define_backing(struct addrspace *as, vaddr_t vaddr, size_t filesize,
+		  struct vnode *v, off_t offset)
+{
+	struct vm_region *vr;
+	unsigned i, num;
+
+	if (filesize == 0) {
+		/* Nothing but zeros; demand zero-fill covers it. */
+		return 0;
+	}
+
+	lock_acquire(as->as_lock);
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		vr = array_get(as->as_regions, i);
+		if (!region_contains(vr, vaddr)) {
+			continue;
+		}
+		if (vr->vr_vnode != NULL ||
+		    !region_contains(vr, vaddr + filesize - 1)) {
+			break;
+		}
+
+		VOP_INCREF(v);
+		vr->vr_vnode = v;
+		vr->vr_offset = offset;
+		vr->vr_filevaddr = vaddr;
+		vr->vr_filesize = filesize;
+		lock_release(as->as_lock);
+		return 0;
+	}
+	lock_release(as->as_lock);
+	return EINVAL;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Nothing is loaded up front. */
+	(void)as;
+	return 0;
+}
+
+/*
+ * Everything the executable defines is in place now; the heap starts
+ * on the first page above all of it.
+ */
+int
+as_complete_load(struct addrspace *as)
+{
+	struct vm_region *vr;
+	vaddr_t top;
+	unsigned i, num;
+
+	lock_acquire(as->as_lock);
+	top = 0;
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		vr = array_get(as->as_regions, i);
+		if (vr->vr_base + vr->vr_npages * PAGE_SIZE > top) {
+			top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		}
+	}
+	as->as_heapstart = top;
+	as->as_heapend = top;
+	lock_release(as->as_lock);
+	return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	int result;
+
+	result = as_define_region(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+				  VM_STACKPAGES * PAGE_SIZE, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+
+	/* Initial user-level stack pointer */
+	*stackptr = USERSTACK;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Unmapping
+
+/*
+ * Throw away every page in [START, END), resident or swapped. All
+ * the TLB entries go in one batched shootdown, and only once that is
+ * finished are the frames freed, so nobody can get one of them while
+ * a stale translation still points at it.
+ */
+static
+void
+as_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct tlbshootdown ts;
+	vaddr_t va;
+	pte_t *pte;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+	KASSERT((start & PAGE_FRAME) == start);
+	KASSERT((end & PAGE_FRAME) == end);
+
+	vm_tlb_batch_init(&ts, as->as_id);
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte != NULL && (*pte & PTE_VALID)) {
+			vm_tlb_batch_add(&ts, va);
+		}
+	}
+	vm_tlb_batch_finish(&ts);
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte != NULL) {
+			as_free_page(va, pte, NULL);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Heap
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	vaddr_t oldend, newend, limit;
+
+	lock_acquire(as->as_lock);
+
+	if (as->as_heapstart == 0) {
+		/* No executable loaded yet, so no heap. */
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+
+	oldend = as->as_heapend;
+	limit = as->as_mmapbase;
+	if (amount < 0 &&
+	    (vaddr_t)0 - (vaddr_t)amount > oldend - as->as_heapstart) {
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+	if (amount > 0 && (vaddr_t)amount > limit - oldend) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+	newend = oldend + amount;
+
+	if (amount < 0) {
+		as_unmap_range(as, ROUNDUP(newend, PAGE_SIZE),
+			       ROUNDUP(oldend, PAGE_SIZE));
+	}
+	as->as_heapend = newend;
+
+	lock_release(as->as_lock);
+
+	*oldbreak = oldend;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// File mappings
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+	int perms, int flags, vaddr_t *addr)
+{
+	struct vm_region *vr;
+	struct stat st;
+	size_t npages, filesize;
+	vaddr_t base;
+	int result;
+
+	KASSERT(flags == MAP_SHARED || flags == MAP_PRIVATE);
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	if (len == 0 || len > USERSPACETOP) {
+		return EINVAL;
+	}
+	npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+
+	/* Private mappings read the file in like an executable does. */
+	filesize = 0;
+	if (flags == MAP_PRIVATE) {
+		result = VOP_STAT(v, &st);
+		if (result) {
+			return result;
+		}
+		if (offset < st.st_size) {
+			filesize = len;
+			if (st.st_size - offset < (off_t)len) {
+				filesize = st.st_size - offset;
+			}
+		}
+	}
+
+	vr = region_create(0, npages, perms);
+	if (vr == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(as->as_lock);
+
+	if (npages * PAGE_SIZE >
+	    as->as_mmapbase - ROUNDUP(as->as_heapend, PAGE_SIZE)) {
+		lock_release(as->as_lock);
+		region_destroy(vr);
+		return ENOMEM;
+	}
+	base = as->as_mmapbase - npages * PAGE_SIZE;
+
+	if (flags == MAP_SHARED) {
+		result = pagecache_addmap(v);
+		if (result) {
+			lock_release(as->as_lock);
+			region_destroy(vr);
+			return result;
+		}
+	}
+
+	VOP_INCREF(v);
+	vr->vr_base = base;
+	vr->vr_vnode = v;
+	vr->vr_offset = offset;
+	vr->vr_filevaddr = base;
+	vr->vr_filesize = filesize;
+	vr->vr_mmap = flags;
+
+	result = array_add(as->as_regions, vr, NULL);
+	if (result) {
+		region_destroy(vr);
+		lock_release(as->as_lock);
+		return result;
+	}
+	as->as_mmapbase = base;
+
+	lock_release(as->as_lock);
+
+	*addr = base;
+	return 0;
+}
+
+/*
+ * Unmapping the middle of a mapping splits it in two. The pieces keep
+ * the original vr_filevaddr and vr_offset, so each page still finds
+ * the same place in the file.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct vm_region *vr, *newvr;
+	vaddr_t end, vrend;
+	unsigned i, num;
+	int result;
+
+	if ((addr & PAGE_FRAME) != addr || len == 0 ||
+	    addr >= USERSPACETOP || len > USERSPACETOP - addr) {
+		return EINVAL;
+	}
+	end = ROUNDUP(addr + len, PAGE_SIZE);
+
+	lock_acquire(as->as_lock);
+
+	vr = NULL;
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		vr = array_get(as->as_regions, i);
+		if (vr->vr_mmap != 0 && region_contains(vr, addr)) {
+			break;
+		}
+	}
+	if (i == num) {
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+	vrend = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	if (end > vrend) {
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+
+	/* Make the upper piece first, so failing leaves everything mapped. */
+	if (addr > vr->vr_base && end < vrend) {
+		newvr = region_create(end, (vrend - end) / PAGE_SIZE,
+				      vr->vr_perms);
+		if (newvr == NULL) {
+			lock_release(as->as_lock);
+			return ENOMEM;
+		}
+		if (vr->vr_mmap == MAP_SHARED) {
+			result = pagecache_addmap(vr->vr_vnode);
+			if (result) {
+				lock_release(as->as_lock);
+				region_destroy(newvr);
+				return result;
+			}
+		}
+		VOP_INCREF(vr->vr_vnode);
+		newvr->vr_vnode = vr->vr_vnode;
+		newvr->vr_offset = vr->vr_offset;
+		newvr->vr_filevaddr = vr->vr_filevaddr;
+		newvr->vr_filesize = vr->vr_filesize;
+		newvr->vr_mmap = vr->vr_mmap;
+		result = array_add(as->as_regions, newvr, NULL);
+		if (result) {
+			region_destroy(newvr);
+			lock_release(as->as_lock);
+			return result;
+		}
+	}
+
+	as_unmap_range(as, addr, end);
+
+	if (addr == vr->vr_base && end == vrend) {
+		array_remove(as->as_regions, i);
+		region_destroy(vr);
+	}
+	else if (addr == vr->vr_base) {
+		vr->vr_base = end;
+		vr->vr_npages = (vrend - end) / PAGE_SIZE;
+	}
+	else {
+		vr->vr_npages = (addr - vr->vr_base) / PAGE_SIZE;
+	}
+
+	lock_release(as->as_lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Faults
+
+/*
+ * Give the page behind PTE a private, writable frame. If nobody else
+ * shares the frame it can simply be claimed; otherwise copy it and
+ * drop our reference to the shared one.
+ */
+static
+int
+as_unshare_page(pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+
+	KASSERT(*pte & PTE_VALID);
+
+	oldpa = *pte & PTE_FRAME;
+	if (coremap_refcount(oldpa) == 1) {
+		*pte |= PTE_DIRTY;
+		return 0;
+	}
+
+	newpa = coremap_alloc(1, CM_USER);
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	memcpy((void *)PADDR_TO_KVADDR(newpa),
+	       (const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	*pte = newpa | PTE_VALID | PTE_DIRTY;
+	coremap_free(oldpa);
+	return 0;
+}
+
+/*
+ * Make the page behind PTE resident in the frame PADDR: read it back
+ * from swap, or build it from scratch if it has never been touched.
+ */
+static
+int
+as_pagein(struct addrspace *as, vaddr_t vaddr, pte_t *pte, paddr_t paddr,
+	  int perms)
+{
+	int result;
+
+	if (*pte & PTE_SWAPPED) {
+		result = swap_pagein(paddr, PTE_SLOT(*pte));
+		if (result) {
+			return result;
+		}
+		swap_free(PTE_SLOT(*pte));
+	}
+	else {
+		result = as_fill_page(as, vaddr, paddr);
+		if (result) {
+			return result;
+		}
+	}
+
+	*pte = paddr | PTE_VALID;
+	if (perms & VR_WRITE) {
+		*pte |= PTE_DIRTY;
+	}
+	return 0;
+}
+
+/*
+ * Handle a fault on the page VADDR: bring the page in if it isn't
+ * resident (from the page cache for shared mappings), break
+ * copy-on-write sharing on writes, then load the
+ * translation into the TLB. The address space lock is held across
+ * the TLB load so the translation can't go stale before it is
+ * installed.
+ *
+ * If there is no free frame, drop the lock (so the pageout daemon
+ * can evict from this address space too), wait for memory, and start
+ * over.
+ */
+int
+as_fault(struct addrspace *as, int faulttype, vaddr_t vaddr)
+{
+	struct vm_region *shared;
+	pte_t *pte;
+	paddr_t pa;
+	off_t offset;
+	int perms, result;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+ retry:
+	lock_acquire(as->as_lock);
+
+	perms = as_page_perms(as, vaddr);
+	if (perms == 0) {
+		lock_release(as->as_lock);
+		return EFAULT;
+	}
+	if (faulttype != VM_FAULT_READ && !(perms & VR_WRITE)) {
+		lock_release(as->as_lock);
+		return EFAULT;
+	}
+
+	pte = pt_lookup(as->as_pt, vaddr, true);
+	if (pte == NULL) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+
+	shared = as_shared_region(as, vaddr);
+	offset = 0;
+	if (shared != NULL) {
+		offset = shared->vr_offset + (vaddr - shared->vr_filevaddr);
+	}
+
+	if (!(*pte & PTE_VALID) && shared != NULL) {
+		/* Cached pages are never evicted, so never swapped. */
+		KASSERT(!(*pte & PTE_SWAPPED));
+		result = pagecache_get(shared->vr_vnode, offset, &pa);
+		if (result == ENOMEM) {
+			goto nomem;
+		}
+		if (result) {
+			lock_release(as->as_lock);
+			return result;
+		}
+		*pte = pa | PTE_VALID;
+	}
+	else if (!(*pte & PTE_VALID)) {
+		pa = coremap_alloc(1, CM_USER);
+		if (pa == 0) {
+			goto nomem;
+		}
+		result = as_pagein(as, vaddr, pte, pa, perms);
+		if (result) {
+			coremap_free(pa);
+			lock_release(as->as_lock);
+			return result;
+		}
+	}
+
+	if (faulttype != VM_FAULT_READ && !(*pte & PTE_DIRTY)) {
+		if (shared != NULL) {
+			/* No copy: the frame is shared on purpose. */
+			*pte |= PTE_DIRTY;
+			pagecache_markdirty(shared->vr_vnode, offset);
+		}
+		else {
+			result = as_unshare_page(pte);
+			if (result == ENOMEM) {
+				goto nomem;
+			}
+			if (result) {
+				lock_release(as->as_lock);
+				return result;
+			}
+		}
+	}
+
+	coremap_touch(*pte & PTE_FRAME, as, vaddr);
+	vm_tlb_load(vaddr, *pte & PTE_FRAME, (*pte & PTE_DIRTY) != 0);
+
+	lock_release(as->as_lock);
+	return 0;
+
+ nomem:
+	lock_release(as->as_lock);
+	result = coremap_wait();
+	if (result) {
+		return result;
+	}
+	goto retry;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pageout
+
+int
+as_pageout(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	pte_t *pte, oldpte;
+	unsigned slot;
+	int result;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	lock_acquire(as->as_lock);
+
+	/*
+	 * The daemon picked this page without the lock; now that
+	 * nothing can change under us, make sure it is still ours.
+	 */
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte == NULL || !(*pte & PTE_VALID) ||
+	    (*pte & PTE_FRAME) != paddr ||
+	    !coremap_owns(paddr, as, vaddr)) {
+		lock_release(as->as_lock);
+		return EAGAIN;
+	}
+
+	/* Unmap it everywhere before looking at the contents. */
+	oldpte = *pte;
+	*pte = 0;
+	vm_tlb_shootdown(as->as_id, vaddr);
+
+	if (as_page_perms(as, vaddr) & VR_WRITE) {
+		/*
+		 * Swap frees the frame once it's written, maybe after we
+		 * return; disown it first so the daemon leaves it alone.
+		 */
+		coremap_disown(paddr);
+		result = swap_alloc(&slot);
+		if (result == 0) {
+			result = swap_pageout(paddr, slot);
+			if (result) {
+				swap_free(slot);
+			}
+		}
+		if (result) {
+			*pte = oldpte;
+			lock_release(as->as_lock);
+			return result;
+		}
+		*pte = PTE_MKSWAPPED(slot);
+	}
+	else {
+		coremap_free(paddr);
+	}
+	lock_release(as->as_lock);
+	return 0;
+}
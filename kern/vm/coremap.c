@@ -0,0 +1,638 @@
+/*
+ * Coremap: physical page allocator and pageout daemon.
+ *
+ * See coremap.h for the interface. All coremap state is protected by
+ * coremap_lock, which is a spinlock because alloc_kpages can be
+ * called from contexts that cannot sleep.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <lockstat.h>
+#include "opt-dumbvm.h"
+
+/* Frame states */
+#define CME_FREE	0	/* on the free list */
+#define CME_FIXED	1	/* below firstfree: kernel image, early boot */
+#define CME_KERNEL	2	/* allocated to the kernel */
+#define CME_USER	3	/* allocated to user memory */
+
+/* Null link for the free list */
+#define CM_NONE		((uint32_t)-1)
+
+/*
+ * Free frame thresholds. User allocations fail below CM_RESERVE so
+ * the kernel (including the pageout daemon itself) always has some
+ * memory to work with; the daemon is woken below CM_LOWATER and
+ * evicts pages until there are CM_HIWATER free.
+ */
+#define CM_RESERVE	8
+#define CM_LOWATER	16
+#define CM_HIWATER	32
+
+/*
+ * A stuck pageout daemon looks again after this many hardclocks even
+ * if nothing has been freed, in case what stopped it was temporary.
+ */
+#define CM_STUCK_TICKS	(HZ / 4)
+
+struct coremap_entry {
+	uint8_t cme_state;	/* CME_* */
+	uint8_t cme_referenced;	/* touched since the clock hand passed */
+	uint16_t cme_refcount;	/* mappings sharing this frame (user only) */
+	uint32_t cme_npages;	/* length of allocation (first frame only) */
+	uint32_t cme_next;	/* free list links (frame numbers) */
+	uint32_t cme_prev;
+	struct addrspace *cme_as; /* owner, if evictable (user only) */
+	vaddr_t cme_vaddr;	/* where cme_as maps this frame */
+};
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+static struct coremap_entry *coremap;
+static uint32_t cm_nframes;		/* total frames in RAM */
+static uint32_t cm_firstframe;		/* first frame we manage */
+static uint32_t cm_freehead;		/* head of the free list */
+
+/* Pageout state. Protected by coremap_lock. */
+static struct wchan *cm_pageout_wchan;	/* the daemon sleeps here */
+static struct wchan *cm_wait_wchan;	/* threads waiting on the daemon */
+static uint32_t cm_clockhand;		/* next frame the clock looks at */
+static struct addrspace *cm_pageout_as;	/* being paged out from now */
+static bool cm_pageout_stuck;		/* nothing left to evict */
+
+/* Counters, in frames. Protected by coremap_lock. */
+static uint32_t cm_nfree;
+static uint32_t cm_nkernel;
+static uint32_t cm_nuser;
+static uint32_t cm_nevicted;
+
+////////////////////////////////////////////////////////////
+//
+// Free list
+
+static
+void
+freelist_push(uint32_t frame)
+{
+	struct coremap_entry *cme = &coremap[frame];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	cme->cme_state = CME_FREE;
+	cme->cme_referenced = 0;
+	cme->cme_refcount = 0;
+	cme->cme_npages = 0;
+	cme->cme_as = NULL;
+	cme->cme_vaddr = 0;
+	cme->cme_prev = CM_NONE;
+	cme->cme_next = cm_freehead;
+	if (cm_freehead != CM_NONE) {
+		coremap[cm_freehead].cme_prev = frame;
+	}
+	cm_freehead = frame;
+	cm_nfree++;
+}
+
+static
+void
+freelist_remove(uint32_t frame)
+{
+	struct coremap_entry *cme = &coremap[frame];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(cme->cme_state == CME_FREE);
+
+	if (cme->cme_prev != CM_NONE) {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	else {
+		KASSERT(cm_freehead == frame);
+		cm_freehead = cme->cme_next;
+	}
+	if (cme->cme_next != CM_NONE) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	cme->cme_next = cme->cme_prev = CM_NONE;
+	cm_nfree--;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t firstfree, lastpaddr, cmpaddr;
+	size_t cmpages;
+	uint32_t i;
+
+	KASSERT(coremap == NULL);
+	lockstat_addspinlock("coremap", &coremap_lock);
+
+	lastpaddr = ram_getsize();
+	cm_nframes = lastpaddr / PAGE_SIZE;
+
+	/*
+	 * The coremap itself lives in stolen memory just above the
+	 * kernel; grab it before ram_getfirstfree shuts ram_stealmem
+	 * off.
+	 */
+	cmpages = DIVROUNDUP(cm_nframes * sizeof(struct coremap_entry),
+			     PAGE_SIZE);
+	cmpaddr = ram_stealmem(cmpages);
+	if (cmpaddr == 0) {
+		panic("coremap: no memory for %u frames\n", cm_nframes);
+	}
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(cmpaddr);
+
+	firstfree = ram_getfirstfree();
+	KASSERT((firstfree & PAGE_FRAME) == firstfree);
+	cm_firstframe = firstfree / PAGE_SIZE;
+	cm_freehead = CM_NONE;
+	cm_clockhand = cm_firstframe;
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<cm_firstframe; i++) {
+		coremap[i].cme_state = CME_FIXED;
+		coremap[i].cme_referenced = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_next = coremap[i].cme_prev = CM_NONE;
+	}
+	/* Push in reverse so the list starts at the lowest frame. */
+	for (i=cm_nframes; i-- > cm_firstframe; ) {
+		freelist_push(i);
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %u frames, %u free\n", cm_nframes, cm_nfree);
+}
+
+bool
+coremap_isready(void)
+{
+	return coremap != NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Allocation
+
+/*
+ * Poke the pageout daemon if memory is getting short.
+ */
+static
+void
+coremap_kick(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (cm_nfree < CM_LOWATER && cm_pageout_wchan != NULL) {
+		wchan_wakeone(cm_pageout_wchan, &coremap_lock);
+	}
+}
+
+/*
+ * Find NPAGES contiguous free frames. First fit, lowest address.
+ * Returns CM_NONE if there is no such run.
+ */
+static
+uint32_t
+coremap_findrun(unsigned npages)
+{
+	uint32_t i, start;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	start = cm_firstframe;
+	for (i=cm_firstframe; i<cm_nframes; i++) {
+		if (coremap[i].cme_state != CME_FREE) {
+			start = i + 1;
+			continue;
+		}
+		if (i + 1 - start == npages) {
+			return start;
+		}
+	}
+	return CM_NONE;
+}
+
+paddr_t
+coremap_alloc(unsigned npages, int owner)
+{
+	uint32_t start, i;
+	uint8_t state;
+
+	KASSERT(coremap != NULL);
+	KASSERT(npages > 0);
+	KASSERT(owner == CM_KERNEL || owner == CM_USER);
+
+	state = (owner == CM_KERNEL) ? CME_KERNEL : CME_USER;
+
+	spinlock_acquire(&coremap_lock);
+	if (npages > cm_nfree ||
+	    (owner == CM_USER && cm_nfree - npages < CM_RESERVE)) {
+		coremap_kick();
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	if (npages == 1) {
+		start = cm_freehead;
+	}
+	else {
+		start = coremap_findrun(npages);
+		if (start == CM_NONE) {
+			coremap_kick();
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+	}
+	KASSERT(start != CM_NONE);
+
+	for (i=start; i<start+npages; i++) {
+		freelist_remove(i);
+		coremap[i].cme_state = state;
+		coremap[i].cme_refcount = 1;
+		coremap[i].cme_npages = 0;
+	}
+	coremap[start].cme_npages = npages;
+
+	if (owner == CM_KERNEL) {
+		cm_nkernel += npages;
+	}
+	else {
+		cm_nuser += npages;
+	}
+	coremap_kick();
+	spinlock_release(&coremap_lock);
+
+	return (paddr_t)start * PAGE_SIZE;
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	uint32_t start, npages, i;
+	uint8_t state;
+
+	KASSERT(coremap != NULL);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	start = paddr / PAGE_SIZE;
+	KASSERT(start < cm_nframes);
+	if (start < cm_firstframe) {
+		/* Stolen before the coremap existed; can't give it back. */
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	state = coremap[start].cme_state;
+	npages = coremap[start].cme_npages;
+	if (state == CME_FREE || npages == 0) {
+		panic("coremap_free: 0x%x is not the start of an allocation\n",
+		      paddr);
+	}
+	KASSERT(start + npages <= cm_nframes);
+
+	KASSERT(coremap[start].cme_refcount > 0);
+	coremap[start].cme_refcount--;
+	if (coremap[start].cme_refcount > 0) {
+		/* Still mapped by someone else, who'll own it on next touch. */
+		KASSERT(npages == 1);
+		coremap[start].cme_as = NULL;
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	for (i=start; i<start+npages; i++) {
+		KASSERT(coremap[i].cme_state == state);
+		freelist_push(i);
+	}
+
+	if (state == CME_KERNEL) {
+		cm_nkernel -= npages;
+	}
+	else {
+		cm_nuser -= npages;
+	}
+
+	/* Things have changed; the daemon and its waiters can try again. */
+	cm_pageout_stuck = false;
+	if (cm_wait_wchan != NULL) {
+		wchan_wakeall(cm_wait_wchan, &coremap_lock);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sharing
+
+void
+coremap_share(paddr_t paddr)
+{
+	uint32_t frame;
+
+	KASSERT(coremap != NULL);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	frame = paddr / PAGE_SIZE;
+	KASSERT(frame >= cm_firstframe && frame < cm_nframes);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[frame].cme_state == CME_USER);
+	KASSERT(coremap[frame].cme_npages == 1);
+	KASSERT(coremap[frame].cme_refcount > 0);
+	KASSERT(coremap[frame].cme_refcount < (uint16_t)-1);
+	coremap[frame].cme_refcount++;
+	/* Nobody owns a shared frame; see coremap_touch. */
+	coremap[frame].cme_as = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	uint32_t frame;
+	unsigned ret;
+
+	KASSERT(coremap != NULL);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	frame = paddr / PAGE_SIZE;
+	KASSERT(frame < cm_nframes);
+
+	spinlock_acquire(&coremap_lock);
+	ret = coremap[frame].cme_refcount;
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Ownership
+
+void
+coremap_touch(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+	uint32_t frame;
+
+	KASSERT(coremap != NULL);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	frame = paddr / PAGE_SIZE;
+	KASSERT(frame >= cm_firstframe && frame < cm_nframes);
+	cme = &coremap[frame];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_state == CME_USER);
+	cme->cme_referenced = 1;
+	if (cme->cme_refcount == 1) {
+		cme->cme_as = as;
+		cme->cme_vaddr = vaddr;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+bool
+coremap_owns(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+	uint32_t frame;
+	bool ret;
+
+	KASSERT(coremap != NULL);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	frame = paddr / PAGE_SIZE;
+	KASSERT(frame >= cm_firstframe && frame < cm_nframes);
+	cme = &coremap[frame];
+
+	spinlock_acquire(&coremap_lock);
+	ret = cme->cme_state == CME_USER && cme->cme_refcount == 1 &&
+		cme->cme_as == as && cme->cme_vaddr == vaddr;
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+void
+coremap_disown(paddr_t paddr)
+{
+	uint32_t frame;
+
+	KASSERT(coremap != NULL);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	frame = paddr / PAGE_SIZE;
+	KASSERT(frame >= cm_firstframe && frame < cm_nframes);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[frame].cme_state == CME_USER);
+	coremap[frame].cme_as = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_pageout_wait(struct addrspace *as)
+{
+	KASSERT(coremap != NULL);
+
+	spinlock_acquire(&coremap_lock);
+	while (cm_pageout_as == as) {
+		wchan_sleep(cm_wait_wchan, &coremap_lock);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pageout
+
+int
+coremap_wait(void)
+{
+	int result = 0;
+
+	KASSERT(coremap != NULL);
+
+	spinlock_acquire(&coremap_lock);
+	while (cm_nfree <= CM_RESERVE) {
+		if (cm_pageout_wchan == NULL || cm_pageout_stuck) {
+			result = ENOMEM;
+			break;
+		}
+		wchan_wakeone(cm_pageout_wchan, &coremap_lock);
+		wchan_sleep(cm_wait_wchan, &coremap_lock);
+	}
+	spinlock_release(&coremap_lock);
+	return result;
+}
+
+#if !OPT_DUMBVM
+
+/*
+ * Pick a frame to evict: second-chance clock over the coremap. A
+ * frame that has been touched since the hand last passed it gets its
+ * referenced bit cleared and is skipped; the first untouched one is
+ * the victim. Only user frames with a single, known owner are
+ * candidates. Returns CM_NONE if two full turns find nothing.
+ */
+static
+uint32_t
+coremap_clock(void)
+{
+	struct coremap_entry *cme;
+	uint32_t n, frame;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (n=0; n < 2 * (cm_nframes - cm_firstframe); n++) {
+		frame = cm_clockhand;
+		cm_clockhand++;
+		if (cm_clockhand == cm_nframes) {
+			cm_clockhand = cm_firstframe;
+		}
+
+		cme = &coremap[frame];
+		if (cme->cme_state != CME_USER || cme->cme_refcount != 1 ||
+		    cme->cme_as == NULL) {
+			continue;
+		}
+		if (cme->cme_referenced) {
+			cme->cme_referenced = 0;
+			continue;
+		}
+		return frame;
+	}
+	return CM_NONE;
+}
+
+/*
+ * The pageout daemon. Sleeps until free memory drops below
+ * CM_LOWATER, then evicts pages until it is back up to CM_HIWATER.
+ * If it can't find anything to evict it gives up until some memory
+ * is freed or CM_STUCK_TICKS go by, and threads waiting in
+ * coremap_wait get ENOMEM.
+ *
+ * cm_pageout_as is set while we work on an address space outside
+ * coremap_lock, so that as_destroy (via coremap_pageout_wait) can
+ * wait for us to finish with it.
+ */
+static
+void
+coremap_pageout_thread(void *data1, unsigned long data2)
+{
+	struct addrspace *as;
+	vaddr_t vaddr;
+	uint32_t frame, nfailed;
+	unsigned ticks;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	spinlock_acquire(&coremap_lock);
+	while (1) {
+		while (cm_nfree >= CM_LOWATER || cm_pageout_stuck) {
+			if (!cm_pageout_stuck) {
+				wchan_sleep(cm_pageout_wchan, &coremap_lock);
+				continue;
+			}
+			ticks = CM_STUCK_TICKS;
+			result = wchan_sleep_timed(cm_pageout_wchan,
+						   &coremap_lock, &ticks);
+			if (result == ETIMEDOUT) {
+				cm_pageout_stuck = false;
+			}
+		}
+
+		nfailed = 0;
+		while (cm_nfree < CM_HIWATER) {
+			frame = coremap_clock();
+			if (frame == CM_NONE || nfailed > cm_nuser) {
+				cm_pageout_stuck = true;
+				break;
+			}
+			as = coremap[frame].cme_as;
+			vaddr = coremap[frame].cme_vaddr;
+			cm_pageout_as = as;
+			spinlock_release(&coremap_lock);
+
+			result = as_pageout(as, vaddr,
+					    (paddr_t)frame * PAGE_SIZE);
+
+			spinlock_acquire(&coremap_lock);
+			cm_pageout_as = NULL;
+			if (result) {
+				nfailed++;
+			}
+			else {
+				nfailed = 0;
+				cm_nevicted++;
+			}
+			wchan_wakeall(cm_wait_wchan, &coremap_lock);
+		}
+		wchan_wakeall(cm_wait_wchan, &coremap_lock);
+	}
+}
+
+void
+coremap_pageout_start(void)
+{
+	int result;
+
+	KASSERT(coremap != NULL);
+
+	cm_wait_wchan = wchan_create("coremap_wait");
+	cm_pageout_wchan = wchan_create("pageout");
+	if (cm_wait_wchan == NULL || cm_pageout_wchan == NULL) {
+		panic("coremap: out of memory\n");
+	}
+
+	result = thread_fork("pageout", NULL, coremap_pageout_thread,
+			     NULL, 0);
+	if (result) {
+		panic("coremap: thread_fork pageout: %s\n",
+		      strerror(result));
+	}
+}
+
+#endif /* OPT_DUMBVM */
+
+////////////////////////////////////////////////////////////
+//
+// Statistics
+
+void
+coremap_printstats(void)
+{
+	uint32_t nfree, nkernel, nuser, nevicted;
+
+	if (coremap == NULL) {
+		kprintf("coremap: not initialized\n");
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	nfree = cm_nfree;
+	nkernel = cm_nkernel;
+	nuser = cm_nuser;
+	nevicted = cm_nevicted;
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %u frames: %u fixed, %u kernel, %u user, %u free\n",
+		cm_nframes, cm_firstframe, nkernel, nuser, nfree);
+	kprintf("coremap: %u pages evicted\n", nevicted);
+}
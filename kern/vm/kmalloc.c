@@ -29,8 +29,13 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
 #include <vm.h>
+#include <lockstat.h>
 
 /*
  * Kernel malloc.
@@ -160,10 +165,9 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the pages and their freelists. Most kmalloc
+ * and kfree calls never get this far; they are handled by the per-cpu
+ * magazines below, which only come here to refill or drain.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -198,19 +202,15 @@ struct kheap_root {
 };
 
 /*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
+ * There are enough roots for a pageref for every page of RAM; the
+ * number is picked by kheap_bootstrap from the RAM size found at boot.
+ * The pageref pages themselves are only allocated as needed.
  */
 
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
+static unsigned num_pagerefpages;
+static struct kheap_root *kheaproots;
 
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+#define TOTAL_PAGEREFS (num_pagerefpages * NPAGEREFS_PER_PAGE)
 
 /*
  * Allocate a page to hold pagerefs.
@@ -262,7 +262,7 @@ allocpageref(void)
 	unsigned whichroot;
 	struct kheap_root *root;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
+	for (whichroot=0; whichroot < num_pagerefpages; whichroot++) {
 		root = &kheaproots[whichroot];
 		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
 			continue;
@@ -310,7 +310,7 @@ freepageref(struct pageref *p)
 	struct kheap_root *root;
 	struct pagerefpage *page;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
+	for (whichroot=0; whichroot < num_pagerefpages; whichroot++) {
 		root = &kheaproots[whichroot];
 
 		page = root->page;
@@ -345,6 +345,81 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * The block type of every page of RAM, plus one, indexed by physical
+ * page number: 0 for pages that aren't kernel heap pages (or are
+ * whole-page allocations), LARGE_BLKTYPE+1 for pages of the large
+ * block allocator. This lets kfree find out what a block is without
+ * taking any lock: while a block is allocated its page's entry can't
+ * change. Written only by the allocator that owns the page, with its
+ * lock held. Sized by kheap_bootstrap.
+ */
+#define LARGE_BLKTYPE NSIZES
+static uint8_t *pagetypes;
+static unsigned npagetypes;
+
+static
+void
+setpagetype(vaddr_t prpage, int blktype)
+{
+	paddr_t ppn;
+
+	KASSERT(prpage >= MIPS_KSEG0);
+	ppn = (prpage - MIPS_KSEG0) / PAGE_SIZE;
+	KASSERT(ppn < npagetypes);
+	pagetypes[ppn] = blktype + 1;
+}
+
+/*
+ * Return the block type of the heap page PRPAGE, LARGE_BLKTYPE for
+ * large block pages, or -1 if it is neither.
+ */
+static
+int
+getpagetype(vaddr_t prpage)
+{
+	paddr_t ppn;
+
+	if (prpage < MIPS_KSEG0) {
+		return -1;
+	}
+	ppn = (prpage - MIPS_KSEG0) / PAGE_SIZE;
+	if (ppn >= npagetypes) {
+		return -1;
+	}
+	return (int)pagetypes[ppn] - 1;
+}
+
+/*
+ * Size the heap roots and the page type table for the RAM we have.
+ * Both live in stolen memory and are never freed, so this must be
+ * called after ram_bootstrap and before anything calls kmalloc.
+ */
+void
+kheap_bootstrap(void)
+{
+	unsigned npages, nbytes;
+	paddr_t pa;
+
+	KASSERT(kheaproots == NULL);
+
+	npages = ram_getsize() / PAGE_SIZE;
+	num_pagerefpages = DIVROUNDUP(npages, NPAGEREFS_PER_PAGE);
+	npagetypes = npages;
+
+	nbytes = num_pagerefpages * sizeof(struct kheap_root) + npagetypes;
+	pa = ram_stealmem(DIVROUNDUP(nbytes, PAGE_SIZE));
+	if (pa == 0) {
+		panic("kmalloc: no memory for heap roots\n");
+	}
+	bzero((void *)PADDR_TO_KVADDR(pa), nbytes);
+
+	kheaproots = (struct kheap_root *)PADDR_TO_KVADDR(pa);
+	pagetypes = (uint8_t *)&kheaproots[num_pagerefpages];
+
+	lockstat_addspinlock("kmalloc", &kmalloc_spinlock);
+}
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -794,6 +869,9 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void kmag_printstats(void);
+static void large_printstats(void);
+
 /*
  * Print the whole heap.
  */
@@ -812,6 +890,11 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	spinlock_printstats("kmalloc lock", &kmalloc_spinlock);
+
+	kmag_printstats();
+	large_printstats();
 }
 
 ////////////////////////////////////////
@@ -867,18 +950,14 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take one block of type BLKTYPE off a page, making a fresh page if
+ * needed. This is the slow path behind the magazines; the block is
+ * raw, without guard band or label.
  */
 static
 void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+subpage_getblock(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
@@ -887,26 +966,6 @@ subpage_kmalloc(size_t sz
 
 	volatile int i;
 
-#ifdef GUARDS
-	size_t clientsz;
-#endif
-
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
-#endif
-
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -940,12 +999,6 @@ subpage_kmalloc(size_t sz
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
 
 			checksubpages();
 
@@ -988,6 +1041,7 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	setpagetype(prpage, blktype);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1018,48 +1072,20 @@ subpage_kmalloc(size_t sz
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Put the raw block at PTRADDR back on its page, releasing the page
+ * if it becomes completely free. The block has already been checked
+ * and deadbeefed by subpage_kfree.
  */
 static
-int
-subpage_kfree(void *ptr)
+void
+subpage_putblock(vaddr_t ptraddr)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
-#ifdef GUARDS
-	size_t blocksize, smallerblocksize;
-#endif
-
-	ptraddr = (vaddr_t)ptr;
-#ifdef GUARDS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/*
-		 * With guard bands, all client-facing subpage
-		 * pointers are offset by GUARD_PTROFFSET (which is 4)
-		 * from the underlying blocks and are therefore not
-		 * page-aligned. So a page-aligned pointer is not one
-		 * of ours. Catch this up front, as otherwise
-		 * subtracting GUARD_PTROFFSET could give a pointer on
-		 * a page we *do* own, and then we'll panic because
-		 * it's not a valid one.
-		 */
-		return -1;
-	}
-	ptraddr -= GUARD_PTROFFSET;
-#endif
-#ifdef LABELS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/* ditto */
-		return -1;
-	}
-	ptraddr -= LABEL_PTROFFSET;
-#endif
 
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -1068,7 +1094,6 @@ subpage_kfree(void *ptr)
 	for (pr = allbase; pr; pr = pr->next_all) {
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
 
 		/* check for corruption */
 		KASSERT(blktype>=0 && blktype<NSIZES);
@@ -1080,30 +1105,12 @@ subpage_kfree(void *ptr)
 	}
 
 	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
+		panic("kfree: subpage free of addr %p not on any heap page\n",
+		      (void *)ptraddr);
 	}
 
 	offset = ptraddr - prpage;
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
-	}
-
-#ifdef GUARDS
-	blocksize = sizes[blktype];
-	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
-	checkguardband(ptraddr, smallerblocksize, blocksize);
-#endif
-
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef((void *)ptraddr, sizes[blktype]);
-
 	/*
 	 * We probably ought to check for free twice by seeing if the block
 	 * is already on the free list. But that's expensive, so we don't.
@@ -1138,6 +1145,7 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
+		setpagetype(prpage, -1);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1151,16 +1159,736 @@ subpage_kfree(void *ptr)
 	checksubpages();
 	spinlock_release(&kmalloc_spinlock);
 #endif
+}
+
+////////////////////////////////////////
+//
+// Per-CPU magazines.
+//
+//    In front of the page freelists each CPU keeps, for each block
+//    size, two magazines: small stacks of free blocks. kmalloc pops
+//    a block off this CPU's loaded magazine and kfree pushes one on,
+//    with interrupts off so the thread stays put, and without taking
+//    any lock. When the loaded magazine is empty (for kmalloc) or
+//    full (for kfree) it is swapped with the previous one; only when
+//    that doesn't help either do we go to the depot, a global stock
+//    of full and empty magazines behind its own spinlock. So the
+//    common case touches only this CPU's state, and the slow path is
+//    taken at most once every KMAG_ROUNDS operations.
+//
+//    Blocks in magazines are still allocated as far as their pages
+//    are concerned and keep the pages from being freed. To bound the
+//    memory held this way the depot keeps at most KMAG_DEPOTMAX full
+//    magazines of each size; past that, magazines are emptied back
+//    onto their pages.
+//
+//    Magazines themselves are allocated straight from the page
+//    freelists with subpage_getblock, never through the magazines.
+//
+
+/* Blocks per magazine; chosen so a magazine is a 64-byte block. */
+#define KMAG_ROUNDS 14
+
+/* Full magazines the depot holds per block size */
+#define KMAG_DEPOTMAX 8
+
+/* Highest number of CPUs System/161 supports */
+#define KMAG_MAXCPUS 32
+
+struct kmag {
+	struct kmag *km_next;		/* depot list */
+	unsigned km_nrounds;		/* blocks in km_rounds[] */
+	void *km_rounds[KMAG_ROUNDS];
+};
+
+struct kmag_cpu {
+	struct kmag *kc_loaded[NSIZES];
+	struct kmag *kc_previous[NSIZES];
+};
+
+struct kmag_depot {
+	struct kmag *kd_full;
+	struct kmag *kd_empty;
+	unsigned kd_nfull;
+	unsigned kd_nempty;
+};
+
+static struct kmag_cpu kmag_cpus[KMAG_MAXCPUS];
+
+static struct spinlock kmag_depot_lock = SPINLOCK_INITIALIZER;
+static struct kmag_depot kmag_depots[NSIZES];
+
+/*
+ * Return this CPU's magazines, or NULL if it is too early in boot to
+ * tell which CPU we're on. Call with interrupts off.
+ *
+ * Blocks sitting in magazines look allocated to the heap checking and
+ * dumping code but hold deadbeef, so magazines are bypassed when
+ * CHECKGUARDS or LABELS is on.
+ */
+static
+struct kmag_cpu *
+kmag_getcpu(void)
+{
+#if defined(CHECKGUARDS) || defined(LABELS)
+	return NULL;
+#endif
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(curcpu->c_number < KMAG_MAXCPUS);
+	return &kmag_cpus[curcpu->c_number];
+}
+
+/*
+ * Give every block in MAG back to its page.
+ */
+static
+void
+kmag_drain(struct kmag *mag)
+{
+	while (mag->km_nrounds > 0) {
+		mag->km_nrounds--;
+		subpage_putblock((vaddr_t)mag->km_rounds[mag->km_nrounds]);
+	}
+}
+
+/*
+ * Get a block of type BLKTYPE from this CPU's magazines, or return
+ * NULL if there isn't one handy.
+ */
+static
+void *
+kmag_alloc(unsigned blktype)
+{
+	struct kmag_cpu *kc;
+	struct kmag_depot *kd;
+	struct kmag *mag, *prev, *full;
+	void *ret;
+	int s;
+
+	s = splhigh();
+	kc = kmag_getcpu();
+	if (kc == NULL) {
+		splx(s);
+		return NULL;
+	}
+
+	mag = kc->kc_loaded[blktype];
+	prev = kc->kc_previous[blktype];
+	if (mag == NULL || mag->km_nrounds == 0) {
+		if (prev != NULL && prev->km_nrounds > 0) {
+			kc->kc_loaded[blktype] = prev;
+			kc->kc_previous[blktype] = mag;
+		}
+		else {
+			/* Trade the empty previous magazine for a full one. */
+			kd = &kmag_depots[blktype];
+			spinlock_acquire(&kmag_depot_lock);
+			full = kd->kd_full;
+			if (full == NULL) {
+				spinlock_release(&kmag_depot_lock);
+				splx(s);
+				return NULL;
+			}
+			kd->kd_full = full->km_next;
+			kd->kd_nfull--;
+			if (prev != NULL) {
+				prev->km_next = kd->kd_empty;
+				kd->kd_empty = prev;
+				kd->kd_nempty++;
+			}
+			spinlock_release(&kmag_depot_lock);
+
+			kc->kc_previous[blktype] = mag;
+			kc->kc_loaded[blktype] = full;
+		}
+		mag = kc->kc_loaded[blktype];
+	}
+
+	KASSERT(mag->km_nrounds > 0);
+	mag->km_nrounds--;
+	ret = mag->km_rounds[mag->km_nrounds];
+	splx(s);
+	return ret;
+}
+
+/*
+ * Put the raw block PTR of type BLKTYPE in this CPU's magazines.
+ * Returns false if it couldn't; then the caller frees it directly.
+ */
+static
+bool
+kmag_free(void *ptr, unsigned blktype)
+{
+	struct kmag_cpu *kc;
+	struct kmag_depot *kd;
+	struct kmag *mag, *prev, *empty;
+	int s;
+
+	s = splhigh();
+	kc = kmag_getcpu();
+	if (kc == NULL) {
+		splx(s);
+		return false;
+	}
+
+	mag = kc->kc_loaded[blktype];
+	prev = kc->kc_previous[blktype];
+	if (mag == NULL || mag->km_nrounds == KMAG_ROUNDS) {
+		if (prev != NULL && prev->km_nrounds == 0) {
+			kc->kc_loaded[blktype] = prev;
+			kc->kc_previous[blktype] = mag;
+		}
+		else {
+			/*
+			 * Trade the full previous magazine for an empty
+			 * one. If the depot already has all the full ones
+			 * it will take, empty ours back onto the pages and
+			 * reuse it instead.
+			 */
+			kd = &kmag_depots[blktype];
+			empty = NULL;
+			spinlock_acquire(&kmag_depot_lock);
+			if (prev != NULL && kd->kd_nfull < KMAG_DEPOTMAX) {
+				prev->km_next = kd->kd_full;
+				kd->kd_full = prev;
+				kd->kd_nfull++;
+				prev = NULL;
+			}
+			if (prev == NULL && kd->kd_empty != NULL) {
+				empty = kd->kd_empty;
+				kd->kd_empty = empty->km_next;
+				kd->kd_nempty--;
+			}
+			spinlock_release(&kmag_depot_lock);
+
+			if (prev != NULL) {
+				kmag_drain(prev);
+				empty = prev;
+			}
+			else if (empty == NULL) {
+				empty = subpage_getblock(
+					blocktype(sizeof(struct kmag)));
+				if (empty == NULL) {
+					kc->kc_previous[blktype] = NULL;
+					splx(s);
+					return false;
+				}
+				empty->km_nrounds = 0;
+			}
+			KASSERT(empty->km_nrounds == 0);
+
+			kc->kc_previous[blktype] = mag;
+			kc->kc_loaded[blktype] = empty;
+		}
+		mag = kc->kc_loaded[blktype];
+	}
+
+	KASSERT(mag->km_nrounds < KMAG_ROUNDS);
+	mag->km_rounds[mag->km_nrounds] = ptr;
+	mag->km_nrounds++;
+	splx(s);
+	return true;
+}
+
+/*
+ * Print what the depot is holding. Blocks in the per-cpu magazines
+ * show up as allocated in kheap_printstats.
+ */
+static
+void
+kmag_printstats(void)
+{
+	unsigned nfull[NSIZES], nempty[NSIZES];
+	unsigned i;
+
+	spinlock_acquire(&kmag_depot_lock);
+	for (i=0; i<NSIZES; i++) {
+		nfull[i] = kmag_depots[i].kd_nfull;
+		nempty[i] = kmag_depots[i].kd_nempty;
+	}
+	spinlock_release(&kmag_depot_lock);
+
+	kprintf("Magazine depot:\n");
+	for (i=0; i<NSIZES; i++) {
+		kprintf("   size %-4lu  %u full, %u empty\n",
+			(unsigned long) sizes[i], nfull[i], nempty[i]);
+	}
+	spinlock_printstats("depot lock", &kmag_depot_lock);
+}
+
+////////////////////////////////////////
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	void *retptr;		// our result
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+	retptr = kmag_alloc(blktype);
+	if (retptr == NULL) {
+		retptr = subpage_getblock(blktype);
+		if (retptr == NULL) {
+			return NULL;
+		}
+	}
+
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+	return retptr;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t ptraddr;	// same as ptr
+	vaddr_t prpage;		// page ptr is on
+	vaddr_t offset;		// offset into page
+#ifdef GUARDS
+	size_t blocksize, smallerblocksize;
+#endif
+
+	ptraddr = (vaddr_t)ptr;
+#ifdef GUARDS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/*
+		 * With guard bands, all client-facing subpage
+		 * pointers are offset by GUARD_PTROFFSET (which is 4)
+		 * from the underlying blocks and are therefore not
+		 * page-aligned. So a page-aligned pointer is not one
+		 * of ours. Catch this up front, as otherwise
+		 * subtracting GUARD_PTROFFSET could give a pointer on
+		 * a page we *do* own, and then we'll panic because
+		 * it's not a valid one.
+		 */
+		return -1;
+	}
+	ptraddr -= GUARD_PTROFFSET;
+#endif
+#ifdef LABELS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/* ditto */
+		return -1;
+	}
+	ptraddr -= LABEL_PTROFFSET;
+#endif
+
+	prpage = ptraddr & PAGE_FRAME;
+	blktype = getpagetype(prpage);
+	if (blktype < 0 || blktype == LARGE_BLKTYPE) {
+		/* Not on any of our pages - not a subpage allocation */
+		return -1;
+	}
+	KASSERT(blktype < NSIZES);
+
+	offset = ptraddr - prpage;
+
+	/* Check for proper positioning and alignment */
+	if (offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+#ifdef GUARDS
+	blocksize = sizes[blktype];
+	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
+	checkguardband(ptraddr, smallerblocksize, blocksize);
+#endif
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+
+	if (!kmag_free((void *)ptraddr, blktype)) {
+		subpage_putblock(ptraddr);
+	}
+	return 0;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Large blocks.
+//
+//    Blocks too big for the subpage allocator but well under a few
+//    pages come out of arenas of LARGE_ARENAPAGES contiguous pages,
+//    instead of each getting whole pages of its own (a 3K buffer
+//    would otherwise waste 1K, and a 5K one 3K).
+//
+//    An arena is carved into variable-sized blocks, each a multiple
+//    of LARGE_GRAIN bytes, laid end to end and ending with a sentinel
+//    header of size 0. Every block starts with a header giving its
+//    own size and the size of the block before it (boundary tags), so
+//    a freed block can be merged with free neighbours on both sides
+//    in constant time.
+//
+//    Free blocks are kept on segregated free lists, one per size in
+//    grains, with a bitmap of which lists are nonempty. Allocation
+//    takes the first block from the smallest nonempty list big enough
+//    and splits off the rest. One entirely free arena is kept around;
+//    any others are given back to the page allocator.
+//
+//    Pages of arenas are marked LARGE_BLKTYPE in the page type table,
+//    which is how kfree recognizes large blocks.
+//
+
+#define LARGE_ARENAPAGES 16
+#define LARGE_ARENASIZE (LARGE_ARENAPAGES * PAGE_SIZE)
+
+/* Block size granule */
+#define LARGE_GRAIN 128
+
+/* Anything bigger than this gets whole pages. */
+#define LARGE_MAXSIZE (LARGE_ARENASIZE / 2)
+
+struct lblock {
+	uint32_t lb_size;		/* bytes with header; low bit: free */
+	uint32_t lb_prevsize;		/* size of previous block; 0 if first */
+	/* Free blocks only; allocated blocks' data starts here. */
+	struct lblock *lb_next;		/* free list */
+	struct lblock *lb_prev;
+};
+
+#define LB_HDRSIZE (2 * sizeof(uint32_t))
+#define LB_FREE 1
+#define LB_SIZE(lb) ((lb)->lb_size & ~(uint32_t)LB_FREE)
+#define LB_ISFREE(lb) (((lb)->lb_size & LB_FREE) != 0)
+#define LB_NEXT(lb) ((struct lblock *)((char *)(lb) + LB_SIZE(lb)))
+#define LB_PREV(lb) ((struct lblock *)((char *)(lb) - (lb)->lb_prevsize))
+#define LB_WHOLEARENA(lb) ((lb)->lb_prevsize == 0 && LB_NEXT(lb)->lb_size == 0)
+
+#define LARGE_NBINS (LARGE_ARENASIZE / LARGE_GRAIN)
+#define LARGE_BINWORDS (LARGE_NBINS / 32)
 
+static struct spinlock large_spinlock = SPINLOCK_INITIALIZER;
+static struct lblock *large_bins[LARGE_NBINS];
+static uint32_t large_binmap[LARGE_BINWORDS];
+
+static unsigned large_narenas;		/* arenas allocated */
+static unsigned large_nidle;		/* of those, entirely free */
+static size_t large_inuse;		/* bytes in allocated blocks */
+
+/*
+ * Free list a free block of SIZE bytes belongs on. Every block on
+ * list N is at least N grains long.
+ */
+static
+unsigned
+large_bin(size_t size)
+{
+	unsigned bin;
+
+	bin = size / LARGE_GRAIN;
+	return bin < LARGE_NBINS ? bin : LARGE_NBINS - 1;
+}
+
+static
+void
+large_insert(struct lblock *lb)
+{
+	unsigned bin;
+
+	KASSERT(spinlock_do_i_hold(&large_spinlock));
+
+	bin = large_bin(LB_SIZE(lb));
+	lb->lb_size |= LB_FREE;
+	lb->lb_prev = NULL;
+	lb->lb_next = large_bins[bin];
+	if (lb->lb_next != NULL) {
+		lb->lb_next->lb_prev = lb;
+	}
+	large_bins[bin] = lb;
+	large_binmap[bin / 32] |= (uint32_t)1 << (bin % 32);
+}
+
+static
+void
+large_remove(struct lblock *lb)
+{
+	unsigned bin;
+
+	KASSERT(spinlock_do_i_hold(&large_spinlock));
+	KASSERT(LB_ISFREE(lb));
+
+	bin = large_bin(LB_SIZE(lb));
+	if (lb->lb_prev != NULL) {
+		lb->lb_prev->lb_next = lb->lb_next;
+	}
+	else {
+		KASSERT(large_bins[bin] == lb);
+		large_bins[bin] = lb->lb_next;
+		if (large_bins[bin] == NULL) {
+			large_binmap[bin / 32] &= ~((uint32_t)1 << (bin % 32));
+		}
+	}
+	if (lb->lb_next != NULL) {
+		lb->lb_next->lb_prev = lb->lb_prev;
+	}
+	lb->lb_size &= ~(uint32_t)LB_FREE;
+}
+
+/*
+ * Find a free block of at least SIZE bytes (a multiple of
+ * LARGE_GRAIN) and take it off its free list. Returns NULL if there
+ * isn't one.
+ */
+static
+struct lblock *
+large_find(size_t size)
+{
+	unsigned bin, word;
+	uint32_t bits;
+	struct lblock *lb;
+
+	KASSERT(spinlock_do_i_hold(&large_spinlock));
+
+	bin = size / LARGE_GRAIN;
+	KASSERT(bin < LARGE_NBINS);
+
+	/*
+	 * The last list holds blocks of every size from its bin up, so
+	 * it may need searching; every other list either fits or not.
+	 */
+	for (word = bin / 32; word < LARGE_BINWORDS; word++) {
+		bits = large_binmap[word];
+		if (word == bin / 32) {
+			bits &= ~(uint32_t)0 << (bin % 32);
+		}
+		while (bits != 0) {
+			bin = word * 32;
+			while ((bits & ((uint32_t)1 << (bin % 32))) == 0) {
+				bin++;
+			}
+			bits &= ~((uint32_t)1 << (bin % 32));
+			for (lb = large_bins[bin]; lb != NULL;
+			     lb = lb->lb_next) {
+				if (LB_SIZE(lb) >= size) {
+					large_remove(lb);
+					return lb;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Set up a fresh arena at VA as one big free block.
+ */
+static
+void
+large_addarena(vaddr_t va)
+{
+	struct lblock *lb, *end;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&large_spinlock));
+
+	for (i=0; i<LARGE_ARENAPAGES; i++) {
+		setpagetype(va + i * PAGE_SIZE, LARGE_BLKTYPE);
+	}
+
+	lb = (struct lblock *)va;
+	lb->lb_size = LARGE_ARENASIZE - LB_HDRSIZE;
+	lb->lb_prevsize = 0;
+	end = LB_NEXT(lb);
+	end->lb_size = 0;
+	end->lb_prevsize = LB_SIZE(lb);
+	large_insert(lb);
+
+	large_narenas++;
+	large_nidle++;
+}
+
+/*
+ * Allocate a block of SZ bytes from the arenas. Returns NULL if SZ is
+ * too big for them or no arena can be had.
+ */
+static
+void *
+large_kmalloc(size_t sz)
+{
+	struct lblock *lb, *rest;
+	size_t need;
+	vaddr_t va;
+
+	if (sz > LARGE_MAXSIZE) {
+		return NULL;
+	}
+	need = ROUNDUP(sz + LB_HDRSIZE, LARGE_GRAIN);
+
+	spinlock_acquire(&large_spinlock);
+	lb = large_find(need);
+	if (lb == NULL) {
+		/* As in allocpagerefpage, don't hold the lock for this. */
+		spinlock_release(&large_spinlock);
+		va = alloc_kpages(LARGE_ARENAPAGES);
+		if (va == 0) {
+			return NULL;
+		}
+		spinlock_acquire(&large_spinlock);
+		large_addarena(va);
+		lb = large_find(need);
+		KASSERT(lb != NULL);
+	}
+
+	if (LB_WHOLEARENA(lb)) {
+		KASSERT(large_nidle > 0);
+		large_nidle--;
+	}
+
+	if (LB_SIZE(lb) - need >= LARGE_GRAIN) {
+		rest = (struct lblock *)((char *)lb + need);
+		rest->lb_size = LB_SIZE(lb) - need;
+		rest->lb_prevsize = need;
+		LB_NEXT(rest)->lb_prevsize = LB_SIZE(rest);
+		lb->lb_size = need;
+		large_insert(rest);
+	}
+	large_inuse += LB_SIZE(lb);
+
+	spinlock_release(&large_spinlock);
+	return (char *)lb + LB_HDRSIZE;
+}
+
+/*
+ * Free a block from large_kmalloc. If PTR isn't on an arena page,
+ * return -1.
+ */
+static
+int
+large_kfree(void *ptr)
+{
+	struct lblock *lb, *next, *prev;
+	vaddr_t tofree;
+	unsigned i;
+
+	if (getpagetype((vaddr_t)ptr & PAGE_FRAME) != LARGE_BLKTYPE) {
+		return -1;
+	}
+	if ((vaddr_t)ptr % LARGE_GRAIN != LB_HDRSIZE) {
+		panic("kfree: large free of invalid addr %p\n", ptr);
+	}
+	lb = (struct lblock *)((char *)ptr - LB_HDRSIZE);
+
+	spinlock_acquire(&large_spinlock);
+
+	if (LB_ISFREE(lb) || LB_SIZE(lb) == 0) {
+		panic("kfree: large free of free or invalid block %p\n", ptr);
+	}
+	large_inuse -= LB_SIZE(lb);
+	fill_deadbeef(ptr, LB_SIZE(lb) - LB_HDRSIZE);
+
+	next = LB_NEXT(lb);
+	if (LB_ISFREE(next)) {
+		large_remove(next);
+		lb->lb_size += LB_SIZE(next);
+	}
+	if (lb->lb_prevsize != 0) {
+		prev = LB_PREV(lb);
+		if (LB_ISFREE(prev)) {
+			large_remove(prev);
+			prev->lb_size += LB_SIZE(lb);
+			lb = prev;
+		}
+	}
+	LB_NEXT(lb)->lb_prevsize = LB_SIZE(lb);
+
+	tofree = 0;
+	if (LB_WHOLEARENA(lb) && large_nidle > 0) {
+		tofree = (vaddr_t)lb;
+		for (i=0; i<LARGE_ARENAPAGES; i++) {
+			setpagetype(tofree + i * PAGE_SIZE, -1);
+		}
+		large_narenas--;
+	}
+	else {
+		if (LB_WHOLEARENA(lb)) {
+			large_nidle++;
+		}
+		large_insert(lb);
+	}
+
+	spinlock_release(&large_spinlock);
+
+	if (tofree != 0) {
+		free_kpages(tofree);
+	}
 	return 0;
 }
 
+/*
+ * Print how much of the arenas is in use.
+ */
+static
+void
+large_printstats(void)
+{
+	unsigned narenas, nidle;
+	size_t inuse;
+
+	spinlock_acquire(&large_spinlock);
+	narenas = large_narenas;
+	nidle = large_nidle;
+	inuse = large_inuse;
+	spinlock_release(&large_spinlock);
+
+	kprintf("Large block arenas: %u (%u idle), %lu of %lu bytes in use\n",
+		narenas, nidle, (unsigned long)inuse,
+		(unsigned long)(narenas * LARGE_ARENASIZE));
+	spinlock_printstats("large lock", &large_spinlock);
+}
+
 //
 ////////////////////////////////////////////////////////////
 
 /*
- * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * Allocate a block of size SZ. Redirect to subpage_kmalloc,
+ * large_kmalloc, or alloc_kpages depending on how big SZ is.
  */
 void *
 kmalloc(size_t sz)
@@ -1183,6 +1911,11 @@ kmalloc(size_t sz)
 		unsigned long npages;
 		vaddr_t address;
 
+		address = (vaddr_t)large_kmalloc(sz);
+		if (address != 0) {
+			return (void *)address;
+		}
+
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
@@ -1208,11 +1941,14 @@ void
 kfree(void *ptr)
 {
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Try large blocks and then subpage; if both fail, assume it's
+	 * a whole-page allocation. Large blocks go first because the
+	 * subpage code adjusts the pointer for guard bands and labels
+	 * before looking at its page.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	} else if (large_kfree(ptr) && subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -0,0 +1,296 @@
+/*
+ * Object caches. See objcache.h.
+ *
+ * A slab is one page: objects packed from the start of the page, and
+ * a struct oc_slab at the very end, so the slab an object belongs to
+ * is found from its address alone. Free objects in a slab are chained
+ * through a link word. If the cache has no constructor the link can
+ * overwrite the start of the free object; otherwise each object gets
+ * an extra word after it for the link, so constructed state survives.
+ *
+ * Slabs with free objects are kept on oc_partial and full ones on
+ * oc_full. One completely free slab is kept in oc_empty to avoid
+ * going back and forth to the page allocator; any others are freed.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <objcache.h>
+
+struct oc_slab {
+	struct oc_slab *os_next;	/* on oc_partial or oc_full */
+	struct oc_slab *os_prev;
+	void *os_free;			/* first free object */
+	unsigned os_ninuse;		/* objects allocated */
+};
+
+/* Objects are aligned this much. */
+#define OC_ALIGN	8
+
+#define OC_SLAB(obj) \
+	((struct oc_slab *)((((vaddr_t)(obj)) & PAGE_FRAME) + \
+			    PAGE_SIZE - sizeof(struct oc_slab)))
+#define OC_PAGE(slab)	(((vaddr_t)(slab)) & PAGE_FRAME)
+
+/* Every cache that has made a slab, for objcache_printstats. */
+static struct spinlock objcache_listlock = SPINLOCK_INITIALIZER;
+static struct objcache *objcache_list;
+
+////////////////////////////////////////////////////////////
+//
+// Slabs
+
+/* Where the free-list link of OBJ lives. */
+static
+void **
+oc_link(struct objcache *oc, void *obj)
+{
+	if (oc->oc_ctor == NULL) {
+		return obj;
+	}
+	return (void **)((char *)obj + oc->oc_stride - sizeof(void *));
+}
+
+static
+void
+oc_setup(struct objcache *oc)
+{
+	size_t stride;
+
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+
+	if (oc->oc_stride != 0) {
+		return;
+	}
+	stride = oc->oc_size;
+	if (oc->oc_ctor != NULL) {
+		stride = ROUNDUP(stride, sizeof(void *)) + sizeof(void *);
+	}
+	else if (stride < sizeof(void *)) {
+		stride = sizeof(void *);
+	}
+	stride = ROUNDUP(stride, OC_ALIGN);
+
+	oc->oc_stride = stride;
+	oc->oc_perslab = (PAGE_SIZE - sizeof(struct oc_slab)) / stride;
+	if (oc->oc_perslab == 0) {
+		panic("objcache %s: objects of %zu bytes are too big\n",
+		      oc->oc_name, oc->oc_size);
+	}
+}
+
+static
+void
+slab_insert(struct oc_slab **head, struct oc_slab *slab)
+{
+	slab->os_prev = NULL;
+	slab->os_next = *head;
+	if (*head != NULL) {
+		(*head)->os_prev = slab;
+	}
+	*head = slab;
+}
+
+static
+void
+slab_remove(struct oc_slab **head, struct oc_slab *slab)
+{
+	if (slab->os_prev != NULL) {
+		slab->os_prev->os_next = slab->os_next;
+	}
+	else {
+		KASSERT(*head == slab);
+		*head = slab->os_next;
+	}
+	if (slab->os_next != NULL) {
+		slab->os_next->os_prev = slab->os_prev;
+	}
+	slab->os_next = slab->os_prev = NULL;
+}
+
+/*
+ * Make a new slab and construct all its objects. Called without the
+ * cache lock, since it may need to get a page.
+ */
+static
+struct oc_slab *
+slab_create(struct objcache *oc)
+{
+	struct oc_slab *slab;
+	vaddr_t page;
+	char *obj;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	slab = OC_SLAB(page);
+	slab->os_next = slab->os_prev = NULL;
+	slab->os_ninuse = 0;
+	slab->os_free = NULL;
+
+	/* Chain them backwards so the first object is handed out first. */
+	for (i = oc->oc_perslab; i-- > 0; ) {
+		obj = (char *)page + i * oc->oc_stride;
+		if (oc->oc_ctor != NULL) {
+			oc->oc_ctor(obj);
+		}
+		*oc_link(oc, obj) = slab->os_free;
+		slab->os_free = obj;
+	}
+	return slab;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Objects
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct oc_slab *slab;
+	void *obj;
+
+	spinlock_acquire(&oc->oc_lock);
+	oc_setup(oc);
+
+	if (oc->oc_partial == NULL && oc->oc_empty != NULL) {
+		slab_insert(&oc->oc_partial, oc->oc_empty);
+		oc->oc_empty = NULL;
+	}
+
+	if (oc->oc_partial == NULL) {
+		spinlock_release(&oc->oc_lock);
+
+		spinlock_acquire(&objcache_listlock);
+		if (!oc->oc_listed) {
+			oc->oc_next = objcache_list;
+			objcache_list = oc;
+			oc->oc_listed = true;
+		}
+		spinlock_release(&objcache_listlock);
+
+		slab = slab_create(oc);
+		if (slab == NULL) {
+			return NULL;
+		}
+
+		spinlock_acquire(&oc->oc_lock);
+		slab_insert(&oc->oc_partial, slab);
+		oc->oc_nslabs++;
+		oc->oc_ngrows++;
+	}
+
+	slab = oc->oc_partial;
+	KASSERT(slab->os_free != NULL);
+	obj = slab->os_free;
+	slab->os_free = *oc_link(oc, obj);
+	slab->os_ninuse++;
+	if (slab->os_ninuse == oc->oc_perslab) {
+		KASSERT(slab->os_free == NULL);
+		slab_remove(&oc->oc_partial, slab);
+		slab_insert(&oc->oc_full, slab);
+	}
+	oc->oc_ninuse++;
+	oc->oc_nallocs++;
+
+	spinlock_release(&oc->oc_lock);
+	return obj;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct oc_slab *slab, *tofree;
+	vaddr_t offset;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	slab = OC_SLAB(obj);
+	offset = (vaddr_t)obj - OC_PAGE(slab);
+
+	spinlock_acquire(&oc->oc_lock);
+
+	if (offset % oc->oc_stride != 0 ||
+	    offset / oc->oc_stride >= oc->oc_perslab) {
+		panic("objcache %s: free of invalid object %p\n",
+		      oc->oc_name, obj);
+	}
+	KASSERT(slab->os_ninuse > 0);
+
+	if (slab->os_ninuse == oc->oc_perslab) {
+		slab_remove(&oc->oc_full, slab);
+		slab_insert(&oc->oc_partial, slab);
+	}
+	*oc_link(oc, obj) = slab->os_free;
+	slab->os_free = obj;
+	slab->os_ninuse--;
+	oc->oc_ninuse--;
+	oc->oc_nfrees++;
+
+	tofree = NULL;
+	if (slab->os_ninuse == 0) {
+		slab_remove(&oc->oc_partial, slab);
+		if (oc->oc_empty == NULL) {
+			oc->oc_empty = slab;
+		}
+		else {
+			tofree = slab;
+			oc->oc_nslabs--;
+		}
+	}
+
+	spinlock_release(&oc->oc_lock);
+
+	if (tofree != NULL) {
+		free_kpages(OC_PAGE(tofree));
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Statistics
+
+/*
+ * For each cache: objects in use out of those in its slabs, the slab
+ * count, and how the slab pages are spent. "waste" is the space
+ * objects can't use (per-object link words and alignment, plus the
+ * tail of each page); "idle" is free objects sitting in slabs.
+ */
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+	unsigned nslabs, ninuse, nallocs, nfrees, ntotal;
+	unsigned waste, idle;
+
+	kprintf("Object caches:\n");
+	kprintf("%-12s %5s %6s %13s %6s %8s %8s %8s %8s\n",
+		"name", "size", "stride", "inuse/total", "slabs",
+		"allocs", "frees", "waste", "idle");
+
+	spinlock_acquire(&objcache_listlock);
+	for (oc = objcache_list; oc != NULL; oc = oc->oc_next) {
+		spinlock_acquire(&oc->oc_lock);
+		nslabs = oc->oc_nslabs;
+		ninuse = oc->oc_ninuse;
+		nallocs = oc->oc_nallocs;
+		nfrees = oc->oc_nfrees;
+		ntotal = nslabs * oc->oc_perslab;
+		spinlock_release(&oc->oc_lock);
+
+		waste = nslabs * PAGE_SIZE - ntotal * oc->oc_size;
+		idle = (ntotal - ninuse) * oc->oc_size;
+		kprintf("%-12s %5u %6u %6u/%-6u %6u %8u %8u %8u %8u\n",
+			oc->oc_name, (unsigned)oc->oc_size,
+			(unsigned)oc->oc_stride, ninuse, ntotal, nslabs,
+			nallocs, nfrees, waste, idle);
+	}
+	spinlock_release(&objcache_listlock);
+}
@@ -0,0 +1,271 @@
+/*
+ * Page cache for shared file mappings. See pagecache.h.
+ *
+ * Everything is protected by pc_lock, which is held across the file
+ * I/O so that two faults on the same page can't both read it in. It
+ * is taken with address space locks held, never the other way round.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <stat.h>
+#include <uio.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagecache.h>
+
+/* A cached page of a file */
+struct pc_page {
+	struct vnode *pp_vnode;
+	off_t pp_offset;		/* page-aligned */
+	paddr_t pp_paddr;		/* frame; the cache holds a reference */
+	bool pp_dirty;			/* written through a mapping */
+	struct pc_page *pp_next;	/* hash chain */
+};
+
+/* A file with shared mappings */
+struct pc_file {
+	struct vnode *pf_vnode;		/* the cache holds a reference */
+	unsigned pf_nmaps;		/* shared regions mapping it */
+	struct pc_file *pf_next;
+};
+
+#define PC_HASHSIZE	64
+
+static struct lock *pc_lock;
+static struct pc_page *pc_hash[PC_HASHSIZE];
+static struct pc_file *pc_files;
+
+void
+pagecache_bootstrap(void)
+{
+	pc_lock = lock_create("pagecache");
+	if (pc_lock == NULL) {
+		panic("pagecache: out of memory\n");
+	}
+}
+
+static
+unsigned
+pc_hashfunc(struct vnode *v, off_t offset)
+{
+	return (((uintptr_t)v >> 4) ^ (unsigned)(offset / PAGE_SIZE))
+		% PC_HASHSIZE;
+}
+
+static
+struct pc_page *
+pc_findpage(struct vnode *v, off_t offset)
+{
+	struct pc_page *pp;
+
+	KASSERT(lock_do_i_hold(pc_lock));
+
+	for (pp = pc_hash[pc_hashfunc(v, offset)]; pp != NULL;
+	     pp = pp->pp_next) {
+		if (pp->pp_vnode == v && pp->pp_offset == offset) {
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+static
+struct pc_file *
+pc_findfile(struct vnode *v)
+{
+	struct pc_file *pf;
+
+	KASSERT(lock_do_i_hold(pc_lock));
+
+	for (pf = pc_files; pf != NULL; pf = pf->pf_next) {
+		if (pf->pf_vnode == v) {
+			return pf;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Mappings
+
+int
+pagecache_addmap(struct vnode *v)
+{
+	struct pc_file *pf;
+
+	lock_acquire(pc_lock);
+	pf = pc_findfile(v);
+	if (pf == NULL) {
+		pf = kmalloc(sizeof(*pf));
+		if (pf == NULL) {
+			lock_release(pc_lock);
+			return ENOMEM;
+		}
+		VOP_INCREF(v);
+		pf->pf_vnode = v;
+		pf->pf_nmaps = 0;
+		pf->pf_next = pc_files;
+		pc_files = pf;
+	}
+	pf->pf_nmaps++;
+	lock_release(pc_lock);
+	return 0;
+}
+
+/*
+ * Write a dirty page back to its file. Only the part of the page
+ * before end of file is written; mappings never extend the file.
+ */
+static
+void
+pc_writeback(struct pc_page *pp, off_t filesize)
+{
+	struct iovec iov;
+	struct uio ku;
+	size_t len;
+	int result;
+
+	if (pp->pp_offset >= filesize) {
+		return;
+	}
+	len = PAGE_SIZE;
+	if (filesize - pp->pp_offset < PAGE_SIZE) {
+		len = filesize - pp->pp_offset;
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pp->pp_paddr), len,
+		  pp->pp_offset, UIO_WRITE);
+	result = VOP_WRITE(pp->pp_vnode, &ku);
+	if (result) {
+		kprintf("pagecache: writeback at offset %llu: %s\n",
+			(unsigned long long)pp->pp_offset, strerror(result));
+	}
+}
+
+void
+pagecache_release(struct vnode *v)
+{
+	struct pc_file *pf, **pfp;
+	struct pc_page *pp, **ppp;
+	struct stat st;
+	unsigned i;
+	int result;
+
+	lock_acquire(pc_lock);
+	pf = pc_findfile(v);
+	KASSERT(pf != NULL);
+	KASSERT(pf->pf_nmaps > 0);
+	pf->pf_nmaps--;
+	if (pf->pf_nmaps > 0) {
+		lock_release(pc_lock);
+		return;
+	}
+
+	for (pfp = &pc_files; *pfp != pf; pfp = &(*pfp)->pf_next) {
+		/* nothing */
+	}
+	*pfp = pf->pf_next;
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		kprintf("pagecache: stat: %s; not writing back\n",
+			strerror(result));
+		st.st_size = 0;
+	}
+
+	for (i=0; i<PC_HASHSIZE; i++) {
+		ppp = &pc_hash[i];
+		while (*ppp != NULL) {
+			pp = *ppp;
+			if (pp->pp_vnode != v) {
+				ppp = &pp->pp_next;
+				continue;
+			}
+			*ppp = pp->pp_next;
+			if (pp->pp_dirty) {
+				pc_writeback(pp, st.st_size);
+			}
+			coremap_free(pp->pp_paddr);
+			kfree(pp);
+		}
+	}
+	lock_release(pc_lock);
+
+	VOP_DECREF(pf->pf_vnode);
+	kfree(pf);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pages
+
+int
+pagecache_get(struct vnode *v, off_t offset, paddr_t *paddr)
+{
+	struct pc_page *pp;
+	struct iovec iov;
+	struct uio ku;
+	unsigned h;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	lock_acquire(pc_lock);
+	KASSERT(pc_findfile(v) != NULL);
+
+	pp = pc_findpage(v, offset);
+	if (pp == NULL) {
+		pp = kmalloc(sizeof(*pp));
+		if (pp == NULL) {
+			lock_release(pc_lock);
+			return ENOMEM;
+		}
+		pp->pp_paddr = coremap_alloc(1, CM_USER);
+		if (pp->pp_paddr == 0) {
+			kfree(pp);
+			lock_release(pc_lock);
+			return ENOMEM;
+		}
+
+		/* Past end of file reads as zeros. */
+		bzero((void *)PADDR_TO_KVADDR(pp->pp_paddr), PAGE_SIZE);
+		uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pp->pp_paddr),
+			  PAGE_SIZE, offset, UIO_READ);
+		result = VOP_READ(v, &ku);
+		if (result) {
+			coremap_free(pp->pp_paddr);
+			kfree(pp);
+			lock_release(pc_lock);
+			return result;
+		}
+
+		pp->pp_vnode = v;
+		pp->pp_offset = offset;
+		pp->pp_dirty = false;
+		h = pc_hashfunc(v, offset);
+		pp->pp_next = pc_hash[h];
+		pc_hash[h] = pp;
+	}
+
+	coremap_share(pp->pp_paddr);
+	*paddr = pp->pp_paddr;
+	lock_release(pc_lock);
+	return 0;
+}
+
+void
+pagecache_markdirty(struct vnode *v, off_t offset)
+{
+	struct pc_page *pp;
+
+	lock_acquire(pc_lock);
+	pp = pc_findpage(v, offset);
+	KASSERT(pp != NULL);
+	pp->pp_dirty = true;
+	lock_release(pc_lock);
+}
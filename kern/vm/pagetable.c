@@ -0,0 +1,93 @@
+/*
+ * Two-level user page tables. See pagetable.h.
+ *
+ * The page table has no lock of its own; it belongs to an address
+ * space and is protected by that address space's lock.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <pagetable.h>
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	bzero(pt->pt_dir, sizeof(pt->pt_dir));
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	KASSERT(pt != NULL);
+
+	for (i=0; i<PT_L1_ENTRIES; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			kfree(pt->pt_dir[i]);
+		}
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *l2;
+
+	KASSERT(pt != NULL);
+	KASSERT(vaddr < USERSPACETOP);
+
+	l2 = pt->pt_dir[PT_L1_INDEX(vaddr)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmalloc(PAGE_SIZE);
+		if (l2 == NULL) {
+			return NULL;
+		}
+		bzero(l2, PAGE_SIZE);
+		pt->pt_dir[PT_L1_INDEX(vaddr)] = l2;
+	}
+	return &l2[PT_L2_INDEX(vaddr)];
+}
+
+int
+pt_foreach(struct pagetable *pt,
+	   int (*func)(vaddr_t vaddr, pte_t *pte, void *data),
+	   void *data)
+{
+	unsigned i, j;
+	pte_t *l2;
+	int result;
+
+	KASSERT(pt != NULL);
+
+	for (i=0; i<PT_L1_ENTRIES; i++) {
+		l2 = pt->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2_ENTRIES; j++) {
+			if (l2[j] == 0) {
+				continue;
+			}
+			result = func(((vaddr_t)i << PT_L1_SHIFT) |
+				      ((vaddr_t)j << PT_L2_SHIFT),
+				      &l2[j], data);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
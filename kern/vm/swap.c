@@ -0,0 +1,367 @@
+/*
+ * Swap space. See swap.h.
+ *
+ * The bitmap, the slot reference counts, the per-slot pageout state
+ * and the counters are protected by swap_lock, which the pageout
+ * completion also takes from the disk interrupt handler. The I/O
+ * itself is done without it; the caller owns the slot it is reading
+ * or writing.
+ *
+ * Async pageouts use a fixed pool of SWAP_NWRITES requests, so paging
+ * out never allocates memory and at most that many frames are waiting
+ * on the disk; the pageout daemon waits for one to finish if all are
+ * in use. While a slot's write is in flight, swap_frame[] holds the
+ * frame with its data and swap_writing[] is set. A slot freed in the
+ * meantime is only put back in the bitmap when the write finishes.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <stat.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <device.h>
+#include <wchan.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+
+/* Pageouts in flight at once */
+#define SWAP_NWRITES	16
+
+struct swap_write {
+	struct devreq sw_req;
+	unsigned sw_slot;
+	struct swap_write *sw_next;	/* free list */
+};
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct vnode *swap_vnode;	/* raw swap device, or NULL */
+static struct device *swap_device;	/* the device behind it */
+static struct bitmap *swap_map;		/* slots in use */
+static uint16_t *swap_refcount;		/* references to each slot */
+static unsigned swap_nslots;
+
+/* Async pageouts */
+static paddr_t *swap_frame;		/* frame holding the slot, or 0 */
+static bool *swap_writing;		/* write in flight */
+static struct swap_write swap_writes[SWAP_NWRITES];
+static struct swap_write *swap_freewrites;
+static struct wchan *swap_wchan;	/* waiting for a free swap_write */
+
+/* Counters. Protected by swap_lock. */
+static unsigned swap_nused;
+static unsigned swap_npageins;
+static unsigned swap_npageouts;
+static unsigned swap_nfromframe;	/* pageins copied from swap_frame */
+static unsigned swap_nfailed;		/* async pageouts that failed */
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	unsigned nslots, i;
+	int result;
+
+	result = vfs_swapon(SWAP_DEVICE, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: stat %s: %s\n", SWAP_DEVICE, strerror(result));
+	}
+	nslots = st.st_size / PAGE_SIZE;
+	if (nslots == 0) {
+		kprintf("swap: %s is too small; running without swap\n",
+			SWAP_DEVICE);
+		VOP_DECREF(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	/* A device vnode's vn_data is the device (see dev_create_vnode) */
+	swap_device = swap_vnode->vn_data;
+	KASSERT(PAGE_SIZE % swap_device->d_blocksize == 0);
+
+	swap_map = bitmap_create(nslots);
+	swap_refcount = kmalloc(nslots * sizeof(swap_refcount[0]));
+	swap_frame = kmalloc(nslots * sizeof(swap_frame[0]));
+	swap_writing = kmalloc(nslots * sizeof(swap_writing[0]));
+	swap_wchan = wchan_create("swap");
+	if (swap_map == NULL || swap_refcount == NULL || swap_frame == NULL ||
+	    swap_writing == NULL || swap_wchan == NULL) {
+		panic("swap: no memory for %u slots\n", nslots);
+	}
+	bzero(swap_refcount, nslots * sizeof(swap_refcount[0]));
+	bzero(swap_frame, nslots * sizeof(swap_frame[0]));
+	bzero(swap_writing, nslots * sizeof(swap_writing[0]));
+	swap_nslots = nslots;
+
+	swap_freewrites = NULL;
+	for (i=0; i<SWAP_NWRITES; i++) {
+		swap_writes[i].sw_next = swap_freewrites;
+		swap_freewrites = &swap_writes[i];
+	}
+
+	kprintf("swap: %u pages on %s\n", nslots, SWAP_DEVICE);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Slots
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		KASSERT(swap_refcount[*slot] == 0);
+		swap_refcount[*slot] = 1;
+		swap_nused++;
+	}
+	spinlock_release(&swap_lock);
+	return result;
+}
+
+void
+swap_share(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refcount[slot] > 0);
+	KASSERT(swap_refcount[slot] < (uint16_t)-1);
+	swap_refcount[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	paddr_t frame = 0;
+
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refcount[slot] > 0);
+	swap_refcount[slot]--;
+	if (swap_refcount[slot] == 0 && !swap_writing[slot]) {
+		/* Drop the frame a failed pageout left behind, if any */
+		frame = swap_frame[slot];
+		swap_frame[slot] = 0;
+		bitmap_unmark(swap_map, slot);
+		swap_nused--;
+	}
+	spinlock_release(&swap_lock);
+
+	if (frame != 0) {
+		coremap_free(frame);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O
+
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Completion for async pageouts. Called from the disk interrupt
+ * handler. If the write failed and the slot is still wanted, the frame
+ * is kept so the data isn't lost.
+ */
+static
+void
+swap_writedone(struct devreq *req, int result)
+{
+	struct swap_write *sw = req->dr_arg;
+	unsigned slot = sw->sw_slot;
+	paddr_t frame = 0;
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_writing[slot]);
+	swap_writing[slot] = false;
+	if (result == 0) {
+		swap_npageouts++;
+	}
+	else {
+		swap_nfailed++;
+	}
+	if (result == 0 || swap_refcount[slot] == 0) {
+		frame = swap_frame[slot];
+		swap_frame[slot] = 0;
+	}
+	if (swap_refcount[slot] == 0) {
+		/* Freed while we were writing it */
+		bitmap_unmark(swap_map, slot);
+		swap_nused--;
+	}
+	sw->sw_next = swap_freewrites;
+	swap_freewrites = sw;
+	wchan_wakeone(swap_wchan, &swap_lock);
+	spinlock_release(&swap_lock);
+
+	if (frame != 0) {
+		coremap_free(frame);
+	}
+}
+
+int
+swap_pagein(paddr_t paddr, unsigned slot)
+{
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	/*
+	 * If the page is still in memory, waiting to be written or left
+	 * behind by a failed write, copy it; holding the lock keeps the
+	 * completion from freeing the frame under us.
+	 */
+	spinlock_acquire(&swap_lock);
+	if (swap_frame[slot] != 0) {
+		memcpy((void *)PADDR_TO_KVADDR(paddr),
+		       (const void *)PADDR_TO_KVADDR(swap_frame[slot]),
+		       PAGE_SIZE);
+		swap_npageins++;
+		swap_nfromframe++;
+		spinlock_release(&swap_lock);
+		return 0;
+	}
+	spinlock_release(&swap_lock);
+
+	result = swap_io(paddr, slot, UIO_READ);
+	if (result == 0) {
+		spinlock_acquire(&swap_lock);
+		swap_npageins++;
+		spinlock_release(&swap_lock);
+	}
+	return result;
+}
+
+int
+swap_pageout(paddr_t paddr, unsigned slot)
+{
+	struct swap_write *sw;
+	struct devreq *req;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	if (swap_device->d_ops->devop_submit == NULL) {
+		result = swap_io(paddr, slot, UIO_WRITE);
+		if (result) {
+			return result;
+		}
+		spinlock_acquire(&swap_lock);
+		swap_npageouts++;
+		spinlock_release(&swap_lock);
+		coremap_free(paddr);
+		return 0;
+	}
+
+	spinlock_acquire(&swap_lock);
+	while (swap_freewrites == NULL) {
+		wchan_sleep(swap_wchan, &swap_lock);
+	}
+	sw = swap_freewrites;
+	swap_freewrites = sw->sw_next;
+	KASSERT(swap_refcount[slot] > 0);
+	KASSERT(swap_frame[slot] == 0 && !swap_writing[slot]);
+	swap_frame[slot] = paddr;
+	swap_writing[slot] = true;
+	spinlock_release(&swap_lock);
+
+	sw->sw_slot = slot;
+	req = &sw->sw_req;
+	req->dr_block = slot * (PAGE_SIZE / swap_device->d_blocksize);
+	req->dr_nblocks = PAGE_SIZE / swap_device->d_blocksize;
+	req->dr_write = true;
+	req->dr_data = (void *)PADDR_TO_KVADDR(paddr);
+	req->dr_done = swap_writedone;
+	req->dr_arg = sw;
+
+	result = DEVOP_SUBMIT(swap_device, req);
+	if (result) {
+		spinlock_acquire(&swap_lock);
+		swap_frame[slot] = 0;
+		swap_writing[slot] = false;
+		sw->sw_next = swap_freewrites;
+		swap_freewrites = sw;
+		wchan_wakeone(swap_wchan, &swap_lock);
+		spinlock_release(&swap_lock);
+		return result;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Statistics
+
+void
+swap_printstats(void)
+{
+	unsigned nused, npageins, npageouts, nfromframe, nfailed;
+
+	if (swap_vnode == NULL) {
+		kprintf("swap: none\n");
+		return;
+	}
+
+	spinlock_acquire(&swap_lock);
+	nused = swap_nused;
+	npageins = swap_npageins;
+	npageouts = swap_npageouts;
+	nfromframe = swap_nfromframe;
+	nfailed = swap_nfailed;
+	spinlock_release(&swap_lock);
+
+	kprintf("swap: %u/%u slots in use, %u pageins, %u pageouts\n",
+		nused, swap_nslots, npageins, npageouts);
+	kprintf("swap: %u pageins before the pageout was done, "
+		"%u failed pageouts\n", nfromframe, nfailed);
+}
@@ -0,0 +1,375 @@
+/*
+ * VM system glue: kernel page allocation, the fault entry point, and
+ * TLB management.
+ *
+ * Physical memory is managed by the coremap (coremap.c); per-process
+ * state lives in the address space (addrspace.c) and its page table
+ * (pagetable.c).
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <proc.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <vm.h>
+
+/*
+ * Wrap ram_stealmem in a spinlock. Only used before vm_bootstrap.
+ */
+static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Cross-CPU shootdowns are done one at a time; vm_shootdown_sem
+ * collects the acknowledgements. Being one at a time also means each
+ * CPU has at most one shootdown queued, well under TLBSHOOTDOWN_MAX.
+ */
+static struct lock *vm_shootdown_lock;
+static struct semaphore *vm_shootdown_sem;
+
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+
+	vm_shootdown_lock = lock_create("vm_shootdown");
+	vm_shootdown_sem = sem_create("vm_shootdown", 0);
+	if (vm_shootdown_lock == NULL || vm_shootdown_sem == NULL) {
+		panic("vm_bootstrap: out of memory\n");
+	}
+
+	swap_bootstrap();
+	pagecache_bootstrap();
+	coremap_pageout_start();
+}
+
+/*
+ * Check that we're in a context that can sleep.
+ */
+static
+void
+vm_can_sleep(void)
+{
+	if (CURCPU_EXISTS()) {
+		/* must not hold spinlocks */
+		KASSERT(curcpu->c_spinlocks == 0);
+
+		/* must not be in an interrupt handler */
+		KASSERT(curthread->t_in_interrupt == 0);
+	}
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+
+	if (coremap_isready()) {
+		pa = coremap_alloc(npages, CM_KERNEL);
+	}
+	else {
+		spinlock_acquire(&stealmem_lock);
+		pa = ram_stealmem(npages);
+		spinlock_release(&stealmem_lock);
+	}
+	if (pa == 0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	KASSERT(addr >= MIPS_KSEG0);
+
+	if (coremap_isready()) {
+		coremap_free(addr - MIPS_KSEG0);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// TLB
+
+/*
+ * Make this CPU's TLB hold translations for address space ASID. The
+ * TLB has no address space tags of its own, so if it currently holds
+ * some other address space's translations it has to be flushed; if
+ * they are already ours (we switched to a kernel thread and back, or
+ * the same process was rescheduled), they are still good.
+ */
+void
+vm_tlb_activate(uint32_t asid)
+{
+	bool flush;
+	int spl;
+
+	KASSERT(asid != 0);
+
+	spl = splhigh();
+	flush = (curcpu->c_tlb_asid != asid);
+	if (flush) {
+		vm_tlb_flush();
+		curcpu->c_tlb_asid = asid;
+		curcpu->c_vmstats.vs_ntlbflushes++;
+	}
+	else {
+		curcpu->c_vmstats.vs_ntlbkept++;
+	}
+	splx(spl);
+}
+
+/*
+ * Load a translation for VADDR into this CPU's TLB. After a TLB miss
+ * there is no entry for VADDR and the processor picks a slot to
+ * replace; after a VM_FAULT_READONLY the existing read-only entry has
+ * to be overwritten in place instead, since the TLB must never hold
+ * two entries for the same page.
+ */
+void
+vm_tlb_load(vaddr_t vaddr, paddr_t paddr, bool writable)
+{
+	uint32_t ehi, elo;
+	int spl, i;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	ehi = vaddr;
+	elo = paddr | TLBLO_VALID;
+	if (writable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	spl = splhigh();
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+	}
+	else {
+		tlb_random(ehi, elo);
+	}
+	curcpu->c_vmstats.vs_ntlbrefills++;
+	splx(spl);
+}
+
+/*
+ * Drop this CPU's translation for VADDR, if any.
+ */
+void
+vm_tlb_invalidate(vaddr_t vaddr)
+{
+	int spl, i;
+
+	spl = splhigh();
+	i = tlb_probe(vaddr & PAGE_FRAME, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * Drop every translation in this CPU's TLB.
+ */
+void
+vm_tlb_flush(void)
+{
+	int spl, i;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * Carry out a shootdown on this CPU. Only CPUs whose TLB belongs to
+ * the address space in question have anything to drop.
+ */
+static
+void
+vm_tlb_shootdown_local(const struct tlbshootdown *ts)
+{
+	unsigned i;
+
+	if (curcpu->c_tlb_asid != ts->ts_asid) {
+		return;
+	}
+	if (ts->ts_npages > TS_MAXPAGES) {
+		vm_tlb_flush();
+		return;
+	}
+	for (i=0; i<ts->ts_npages; i++) {
+		vm_tlb_invalidate(ts->ts_vaddrs[i]);
+	}
+}
+
+void
+vm_tlb_batch_init(struct tlbshootdown *ts, uint32_t asid)
+{
+	KASSERT(asid != 0);
+
+	ts->ts_asid = asid;
+	ts->ts_npages = 0;
+	ts->ts_done = vm_shootdown_sem;
+}
+
+void
+vm_tlb_batch_add(struct tlbshootdown *ts, vaddr_t vaddr)
+{
+	if (vaddr == TS_ALL) {
+		ts->ts_npages = TS_MAXPAGES + 1;
+		return;
+	}
+	if (ts->ts_npages < TS_MAXPAGES) {
+		ts->ts_vaddrs[ts->ts_npages] = vaddr & PAGE_FRAME;
+	}
+	if (ts->ts_npages <= TS_MAXPAGES) {
+		/* Past TS_MAXPAGES, stop counting: it's a full flush. */
+		ts->ts_npages++;
+	}
+}
+
+/*
+ * Send the batch to every CPU that has translations for its address
+ * space, do it here too, and wait for everyone to acknowledge.
+ * Interrupts are off while the IPIs go out so that we can't migrate
+ * between handling our own TLB and picking which CPUs count as
+ * "other". Shootdowns are done one at a time, so no CPU ever has more
+ * than one queued.
+ */
+void
+vm_tlb_batch_finish(struct tlbshootdown *ts)
+{
+	unsigned i, n;
+	int spl;
+
+	if (ts->ts_npages == 0) {
+		return;
+	}
+
+	lock_acquire(vm_shootdown_lock);
+	spl = splhigh();
+	vm_tlb_shootdown_local(ts);
+	n = ipi_tlbshootdown_asid(ts->ts_asid, ts);
+	curcpu->c_vmstats.vs_nshootdowns++;
+	curcpu->c_vmstats.vs_nshootdownipis += n;
+	if (ts->ts_npages > TS_MAXPAGES) {
+		curcpu->c_vmstats.vs_nshootdownflushes++;
+	}
+	splx(spl);
+	for (i=0; i<n; i++) {
+		P(vm_shootdown_sem);
+	}
+	lock_release(vm_shootdown_lock);
+}
+
+void
+vm_tlb_shootdown(uint32_t asid, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+
+	vm_tlb_batch_init(&ts, asid);
+	vm_tlb_batch_add(&ts, vaddr);
+	vm_tlb_batch_finish(&ts);
+}
+
+/*
+ * Called in interrupt context on the target CPU.
+ */
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vm_tlb_shootdown_local(ts);
+	V(ts->ts_done);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Faults
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	int spl;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x type %d\n", faultaddress, faulttype);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	spl = splhigh();
+	curcpu->c_vmstats.vs_nfaults++;
+	splx(spl);
+
+	vm_can_sleep();
+	return as_fault(as, faulttype, faultaddress);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Statistics
+
+void
+vm_printstats(void)
+{
+	struct cpu_vmstats vs;
+
+	cpu_sumvmstats(&vs);
+
+	kprintf("vm: %u faults, %u TLB refills\n",
+		vs.vs_nfaults, vs.vs_ntlbrefills);
+	kprintf("vm: %u TLB flushes, %u switches kept the TLB\n",
+		vs.vs_ntlbflushes, vs.vs_ntlbkept);
+	kprintf("vm: %u shootdowns (%u full flushes), %u IPIs\n",
+		vs.vs_nshootdowns, vs.vs_nshootdownflushes,
+		vs.vs_nshootdownipis);
+	coremap_printstats();
+	swap_printstats();
+}
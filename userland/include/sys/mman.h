@@ -0,0 +1,22 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get the PROT_* and MAP_* constants from the kernel.
+ */
+#include <kern/mman.h>
+
+/*
+ * Map LEN bytes of the file open on FD, starting at OFFSET (which
+ * must be page-aligned), into memory. ADDR is only a hint and is
+ * currently ignored; the kernel picks the address. Pages are read
+ * from the file when first touched. With MAP_SHARED, changes are
+ * written back to the file once the last mapping of it goes away.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+
+
+#endif /* _SYS_MMAN_H_ */
@@ -0,0 +1,160 @@
+/*
+ * rwvtest - check pread/pwrite/readv/writev.
+ *
+ * Checks that pread and pwrite leave the file offset alone, that
+ * they fail with ESPIPE on the console, and that readv and writev
+ * reject an iovcnt of 0 or more than IOV_MAX.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <err.h>
+#include <errno.h>
+
+#define TESTFILE "rwvtest.dat"
+
+static char buf[64];
+static struct iovec iov[IOV_MAX + 1];
+
+static
+void
+checkpos(int fd, off_t want, const char *what)
+{
+	off_t pos;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0) {
+		err(1, "%s: lseek", what);
+	}
+	if (pos != want) {
+		errx(1, "%s: offset moved to %lld, expected %lld",
+		     what, (long long)pos, (long long)want);
+	}
+}
+
+static
+void
+expecterr(ssize_t r, int want, const char *what)
+{
+	if (r >= 0) {
+		errx(1, "%s: succeeded, expected failure", what);
+	}
+	if (errno != want) {
+		err(1, "%s: wrong error", what);
+	}
+}
+
+static
+void
+test_positional(int fd)
+{
+	ssize_t r;
+
+	r = write(fd, "0123456789", 10);
+	if (r != 10) {
+		err(1, "write");
+	}
+	checkpos(fd, 10, "write");
+
+	r = pwrite(fd, "abc", 3, 2);
+	if (r != 3) {
+		err(1, "pwrite");
+	}
+	checkpos(fd, 10, "pwrite");
+
+	memset(buf, 0, sizeof(buf));
+	r = pread(fd, buf, 5, 1);
+	if (r != 5) {
+		err(1, "pread");
+	}
+	if (memcmp(buf, "1abc5", 5) != 0) {
+		errx(1, "pread: got %.5s, expected 1abc5", buf);
+	}
+	checkpos(fd, 10, "pread");
+
+	expecterr(pread(fd, buf, 1, -1), EINVAL, "pread at -1");
+	expecterr(pwrite(fd, buf, 1, -1), EINVAL, "pwrite at -1");
+
+	printf("pread/pwrite offset: passed\n");
+}
+
+static
+void
+test_console(void)
+{
+	expecterr(pread(STDIN_FILENO, buf, 1, 0), ESPIPE, "pread on stdin");
+	expecterr(pwrite(STDOUT_FILENO, "x", 1, 0), ESPIPE,
+		  "pwrite on stdout");
+
+	printf("pread/pwrite on console: passed\n");
+}
+
+static
+void
+test_vectors(int fd)
+{
+	char a[4], b[6];
+	ssize_t r;
+
+	iov[0].iov_base = (void *)"ABCD";
+	iov[0].iov_len = 4;
+	iov[1].iov_base = (void *)"EFGHIJ";
+	iov[1].iov_len = 6;
+	if (lseek(fd, 0, SEEK_SET) != 0) {
+		err(1, "lseek");
+	}
+	r = writev(fd, iov, 2);
+	if (r != 10) {
+		err(1, "writev");
+	}
+	checkpos(fd, 10, "writev");
+
+	iov[0].iov_base = a;
+	iov[0].iov_len = sizeof(a);
+	iov[1].iov_base = b;
+	iov[1].iov_len = sizeof(b);
+	if (lseek(fd, 0, SEEK_SET) != 0) {
+		err(1, "lseek");
+	}
+	r = readv(fd, iov, 2);
+	if (r != 10) {
+		err(1, "readv");
+	}
+	if (memcmp(a, "ABCD", 4) != 0 || memcmp(b, "EFGHIJ", 6) != 0) {
+		errx(1, "readv: wrong data");
+	}
+	checkpos(fd, 10, "readv");
+
+	expecterr(readv(fd, iov, 0), EINVAL, "readv with 0 iovecs");
+	expecterr(writev(fd, iov, 0), EINVAL, "writev with 0 iovecs");
+	expecterr(readv(fd, iov, IOV_MAX + 1), EINVAL,
+		  "readv with IOV_MAX+1 iovecs");
+	expecterr(writev(fd, iov, IOV_MAX + 1), EINVAL,
+		  "writev with IOV_MAX+1 iovecs");
+
+	printf("readv/writev: passed\n");
+}
+
+int
+main(void)
+{
+	int fd;
+
+	fd = open(TESTFILE, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", TESTFILE);
+	}
+
+	test_positional(fd);
+	test_console();
+	test_vectors(fd);
+
+	close(fd);
+	remove(TESTFILE);
+	printf("rwvtest: all passed\n");
+	return 0;
+}